@@ -13,6 +13,10 @@ fi
 nvmfile=/mnt/mypmem0/chensm/leafdata
 
 cmdinit="$1 thread 2 mempool 50 nvmpool ${nvmfile} 200"
+cmdopen="$1 thread 2 mempool 50 nvmpool_open ${nvmfile} 200"
+
+# recovery requires the NVM file to be mapped at the same address
+export PMEM_MMAP_HINT=${PMEM_MMAP_HINT:-0x600000000000}
 
 echo 'debug_bulkload'
 echo -n 'Test  1: '
@@ -57,3 +61,147 @@ echo -n 'Test 17: '
 ${cmdinit} debug_lookup 5320 1.0 | grep good
 echo -n 'Test 18: '
 ${cmdinit} debug_lookup 101180 1.0 | grep good
+
+echo 'debug_scan'
+echo -n 'Test 19: '
+${cmdinit} debug_scan 20 1.0 | grep good
+echo -n 'Test 20: '
+${cmdinit} debug_scan 5320 0.7 | grep good
+echo -n 'Test 21: '
+${cmdinit} debug_scan 101180 1.0 | grep good
+
+echo 'recovery'
+echo -n 'Test 22: '
+${cmdinit} debug_insert 31025 > /dev/null
+${cmdopen} check_tree | grep OK
+echo -n 'Test 23: '
+${cmdinit} debug_del 83120 > /dev/null
+${cmdopen} check_tree | grep OK
+
+echo 'ccmode'
+echo -n 'Test 24: '
+${cmdinit} ccmode lock debug_insert 31025 | grep good
+echo -n 'Test 25: '
+${cmdinit} ccmode lock debug_del 83120 | grep good
+echo -n 'Test 26: '
+${cmdinit} ccmode olc debug_insert 31025 | grep good
+echo -n 'Test 27: '
+${cmdinit} ccmode olc debug_del 83120 | grep good
+echo -n 'Test 28: '
+${cmdinit} ccmode olc debug_scan 5320 0.7 | grep good
+
+echo 'debug_lookup_batch'
+echo -n 'Test 29: '
+${cmdinit} debug_lookup_batch 5320 1.0 | grep good
+echo -n 'Test 30: '
+${cmdinit} debug_lookup_batch 101180 1.0 | grep good
+echo -n 'Test 31: '
+${cmdinit} ccmode lock debug_lookup_batch 101180 1.0 | grep good
+
+echo 'debug_insert_batch'
+echo -n 'Test 32: '
+${cmdinit} debug_insert_batch 31025 | grep good
+echo -n 'Test 33: '
+${cmdinit} debug_insert_batch 371025 | grep good
+
+echo 'debug_put'
+echo -n 'Test 34: '
+${cmdinit} debug_put 31025 | grep good
+echo -n 'Test 35: '
+${cmdinit} ccmode olc debug_put 101180 | grep good
+
+echo 'debug_update'
+echo -n 'Test 36: '
+${cmdinit} debug_update 101180 0.7 | grep good
+echo -n 'Test 37: '
+${cmdinit} ccmode lock debug_update 101180 1.0 | grep good
+echo -n 'Test 38: '
+${cmdinit} ccmode olc debug_update 101180 1.0 | grep good
+
+echo 'debug_cas'
+echo -n 'Test 39: '
+${cmdinit} debug_cas 20000 | grep good
+echo -n 'Test 40: '
+${cmdinit} ccmode olc debug_cas 20000 | grep good
+
+echo 'debug_merge'
+echo -n 'Test 41: '
+${cmdinit} debug_merge 83120 | grep good
+echo -n 'Test 42: '
+${cmdinit} ccmode olc debug_merge 83120 | grep good
+echo -n 'Test 43: '
+${cmdinit} debug_merge 83120 > /dev/null
+${cmdopen} check_tree | grep OK
+
+echo 'pool growth'
+echo -n 'Test 44: '
+$1 thread 2 mempool 1 nvmpool ${nvmfile} 2 debug_insert 371025 | grep good
+echo -n 'Test 45: '
+$1 thread 2 mempool 1 nvmpool_open ${nvmfile} 2 check_tree | grep OK
+rm -f ${nvmfile}.*
+
+echo 'free list rebuild'
+echo -n 'Test 46: '
+${cmdinit} debug_merge 83120 > /dev/null
+${cmdopen} debug_insert 371025 | grep good
+echo -n 'Test 47: '
+${cmdopen} check_tree | grep OK
+
+echo 'huge pages'
+echo -n 'Test 48: '
+$1 thread 2 hugepage thp mempool 1 nvmpool ${nvmfile} 3 debug_insert 371025 | grep good
+echo -n 'Test 49: '
+$1 thread 2 hugepage 2mb mempool 1 nvmpool_open ${nvmfile} 4 check_tree 2> /dev/null | grep OK
+rm -f ${nvmfile}.*
+
+echo 'worker placement'
+echo -n 'Test 50: '
+$1 thread 4 pin compact mempool 50 nvmpool ${nvmfile} 200 debug_insert 371025 | grep good
+echo -n 'Test 51: '
+$1 thread 4 pin scatter hugepage thp mempool 50 nvmpool ${nvmfile} 200 debug_lookup 10000 0.7 | grep good
+
+echo 'multiple NVM files'
+echo -n 'Test 52: '
+$1 thread 3 mempool 50 nvmpool ${nvmfile},${nvmfile}_1 4 debug_insert 371025 | grep good
+echo -n 'Test 53: '
+$1 thread 2 mempool 50 nvmpool_open ${nvmfile} 4 check_tree | grep OK
+rm -f ${nvmfile}.* ${nvmfile}_1*
+
+echo 'NVM backends'
+echo -n 'Test 54: '
+$1 thread 2 mempool 50 nvmpool ${nvmfile} 20 file debug_insert 37102 | grep good
+echo -n 'Test 55: '
+$1 thread 2 mempool 50 nvmpool_open ${nvmfile} 20 file check_tree | grep OK
+echo -n 'Test 56: '
+$1 thread 2 mempool 50 nvmpool ${nvmfile} 200 dram debug_merge 83120 | grep good
+
+echo 'NVM latency emulation'
+echo -n 'Test 57: '
+$1 thread 2 nvmemu 100 300 200 mempool 50 nvmpool ${nvmfile} 200 dram debug_insert 37102 | grep good
+echo -n 'Test 58: '
+$1 thread 2 nvmemu 100 300 200 mempool 50 nvmpool ${nvmfile} 200 dram debug_scan 10000 0.7 | grep good
+
+echo 'debug_mix'
+echo -n 'Test 59: '
+${cmdinit} debug_mix 83120 | grep good
+echo -n 'Test 60: '
+$1 thread 4 mempool 50 nvmpool ${nvmfile} 200 ccmode olc debug_mix 83120 | grep good
+
+echo 'value recovery'
+echo -n 'Test 61: '
+${cmdinit} debug_put 31025 crash > /dev/null
+${cmdopen} check_put 31025 | grep good
+echo -n 'Test 62: '
+${cmdopen} ccmode olc check_put 31025 | grep good
+
+echo 'concurrent checkpoint'
+echo -n 'Test 63: '
+$1 thread 3 mempool 50 nvmpool ${nvmfile} 200 debug_checkpoint 100000 crash | grep good
+echo -n 'Test 64: '
+${cmdopen} check_tree | grep -A10 "from checkpoint" | grep OK
+
+echo 'segment growth'
+echo -n 'Test 65: '
+$1 thread 2 mempool 1 nvmpool ${nvmfile} 1 debug_insert 1234567 | grep good
+echo -n 'Test 66: '
+$1 thread 2 mempool 1 nvmpool_open ${nvmfile} 1 check_tree | grep OK
@@ -0,0 +1,127 @@
+/**
+ * @file fixedkey.h
+ * @author  Shimin Chen <shimin.chen@gmail.com>, Jihang Liu, Leying Chen
+ * @version 1.0
+ *
+ * @section LICENSE
+ *
+ * TBD
+ *
+ * @section DESCRIPTION
+ *
+ * fixedKey defines fixed-width keys of 16B or 32B (e.g. tenant+id).
+ *
+ * A key consists of 8B words.  Keys are compared as unsigned integers
+ * word by word, and w[0] is the most significant word.
+ */
+
+#ifndef _BTREE_FIXEDKEY_H
+#define _BTREE_FIXEDKEY_H
+/* ---------------------------------------------------------------------- */
+
+#include <stdio.h>
+
+/* ---------------------------------------------------------------------- */
+template <int WORDS>
+struct fixedKey {
+    unsigned long long  w[WORDS];
+
+    static fixedKey minKey(void)
+    {
+        fixedKey k;
+        for (int i=0; i<WORDS; i++) k.w[i]= 0;
+        return k;
+    }
+
+    static fixedKey maxKey(void)
+    {
+        fixedKey k;
+        for (int i=0; i<WORDS; i++) k.w[i]= ~0ULL;
+        return k;
+    }
+
+    // compare: <0, 0, >0
+    int cmp(const fixedKey &o) const
+    {
+        for (int i=0; i<WORDS; i++) {
+            if (w[i] != o.w[i]) return ((w[i] < o.w[i]) ? -1 : 1);
+        }
+        return 0;
+    }
+
+    bool operator== (const fixedKey &o) const
+    {
+        for (int i=0; i<WORDS; i++) if (w[i] != o.w[i]) return false;
+        return true;
+    }
+    bool operator!= (const fixedKey &o) const { return !(*this == o); }
+    bool operator<  (const fixedKey &o) const { return cmp(o) < 0; }
+    bool operator<= (const fixedKey &o) const { return cmp(o) <= 0; }
+    bool operator>  (const fixedKey &o) const { return cmp(o) > 0; }
+    bool operator>= (const fixedKey &o) const { return cmp(o) >= 0; }
+
+}; // fixedKey
+
+/**
+ * map an 8B integer key to a fixed-width key, preserving the key order
+ *
+ * The driver programs generate 8B keys.  The last word is the key (with
+ * the sign bit flipped), and the other words are prefixes of it so that
+ * the comparisons of the words before the last are also exercised.
+ */
+template <int WORDS>
+static inline fixedKey<WORDS> fixedKeyFromInt(long long x)
+{
+    fixedKey<WORDS> k;
+    unsigned long long u= ((unsigned long long)x) ^ (1ULL<<63);
+
+    k.w[0]= (u >> 20);
+    for (int i=1; i<WORDS-1; i++) k.w[i]= (u >> 40);
+    k.w[WORDS-1]= u;
+    return k;
+}
+
+// the record pointer of a key generated by fixedKeyFromInt in tests
+template <int WORDS>
+static inline void * fixedKeyToPtr(const fixedKey<WORDS> &k)
+{
+    return (void *)(k.w[WORDS-1] ^ (1ULL<<63));
+}
+
+// the smallest key that is larger than k (k must not be the max key)
+template <int WORDS>
+static inline fixedKey<WORDS> fixedKeyNext(fixedKey<WORDS> k)
+{
+    for (int i=WORDS-1; i>=0; i--) {
+        if (++(k.w[i]) != 0) break;  // no carry
+    }
+    return k;
+}
+
+/**
+ * 1B fingerprint of a fixed-width key
+ *
+ * All the words are mixed with a multiplicative hash, and the top byte is
+ * used, so keys that differ in any word (e.g. same id, different tenant)
+ * are likely to have different fingerprints.
+ */
+template <int WORDS>
+static inline unsigned char fixedKeyHash1B(const fixedKey<WORDS> &k)
+{
+    unsigned long long h= 0;
+    for (int i=0; i<WORDS; i++) h= (h ^ k.w[i]) * 0x9E3779B97F4A7C15ULL;
+    return (unsigned char)(h >> 56);
+}
+
+// print the words in hex separated by '.'
+template <int WORDS>
+static inline const char * fixedKeyToStr(const fixedKey<WORDS> &k, char *buf)
+{
+    char *s= buf;
+    for (int i=0; i<WORDS; i++)
+        s += sprintf(s, (i==0 ? "%llx" : ".%llx"), k.w[i]);
+    return buf;
+}
+
+/* ---------------------------------------------------------------------- */
+#endif /* _BTREE_FIXEDKEY_H */
@@ -10,6 +10,10 @@
  * @section DESCRIPTION
  * 
  * keyInput provides the mechanisms to read index keys from files.
+ *
+ * A key file contains key_file_type records, which are mapped to key_type
+ * with fileKey().  Keys generated in memory are 8B integers mapped to
+ * key_type with makeKey().
  */
 
 #ifndef _BTREE_KEYINPUT_H
@@ -40,7 +44,7 @@ class keyInput {
    * @param index  the index-th key
    * @return       the key
    */
-   virtual Int64 get_key (Int64 index)
+   virtual key_type get_key (Int64 index)
    {
 	fprintf (stderr, "get_key is not implemented!\n");
 	exit (1);
@@ -70,7 +74,7 @@ class bufferedKeyInput: public keyInput {
    Int64 key_start;
 
 #define KEY_BUFFER_SIZE   (1024*1024)
-   Int64 *key_buffer;
+   key_file_type *key_buffer;
 
  public:
   /**
@@ -88,7 +92,7 @@ class bufferedKeyInput: public keyInput {
        perror (filename); exit (1);
      }
 
-     Int64 myoff= start_key*sizeof(Int64);
+     Int64 myoff= start_key*sizeof(key_file_type);
      if (lseek(key_fd, myoff, SEEK_SET) != myoff) {
         fprintf(stderr, "can't seek to start_key=%lld off=%lld\n", 
                          start_key, myoff);
@@ -100,7 +104,7 @@ class bufferedKeyInput: public keyInput {
      key_top = 0;
      key_start= start_key;
 
-     key_buffer= (Int64 *) memalign(4096, KEY_BUFFER_SIZE);
+     key_buffer= (key_file_type *) memalign(4096, KEY_BUFFER_SIZE);
      if (!key_buffer) {perror("memalign"); exit(1);}
    }
 
@@ -112,7 +116,7 @@ class bufferedKeyInput: public keyInput {
 
    // index should be non-descending
    // index starts at start_key
-   Int64 get_key (Int64 index)
+   key_type get_key (Int64 index)
    {int len;
 
      index -= key_start;
@@ -121,12 +125,12 @@ class bufferedKeyInput: public keyInput {
          len = read (key_fd, key_buffer, KEY_BUFFER_SIZE);
          if (len < 0) { perror("read"); exit(1); }
          key_bottom = key_top;
-         key_top += len/sizeof(Int64);
+         key_top += len/sizeof(key_file_type);
      }
 
      Int64 pos = index - key_bottom;
      assert (pos >= 0);
-     return key_buffer[pos];
+     return fileKey(key_buffer[pos]);
    }
 
    keyInput *openCursor(Int64 start_key, Int64 keynum) 
@@ -166,9 +170,9 @@ class simpleKeyInput: public keyInput {
 	key_step = step;
    }
 
-   Int64 get_key (Int64 index)
+   key_type get_key (Int64 index)
    {
-	return (key_start + key_step * index);
+	return makeKey(key_start + key_step * index);
    }
 };
 
@@ -178,7 +182,7 @@ class simpleKeyInput: public keyInput {
 class inMemKeyInput: public keyInput {
  public:
 	Int64	key_num;
-	Int64	*keys;
+	key_type *keys;
 	Int64	key_start;
 	Int64	key_step;
 
@@ -211,8 +215,10 @@ class inMemKeyInput: public keyInput {
         
         static int compare (const void * ip1, const void * ip2)
         {
-                Int64 tt= (*(Int64 *)ip1 - *(Int64 *)ip2);
-                return ((tt>0)?1: ((tt<0)?-1:0));
+                // compare instead of subtract: the difference may overflow
+                Int64 a= *(Int64 *)ip1;
+                Int64 b= *(Int64 *)ip2;
+                return ((a>b)?1: ((a<b)?-1:0));
         }
         
         static void sortkey (Int64 keynum, Int64 key[])
@@ -242,11 +248,16 @@ class inMemKeyInput: public keyInput {
 	inMemKeyInput (Int64 num, Int64 start, Int64 step)
 	{
 		key_num= num;
-		keys= new Int64[num];
-		assert(keys);
+		Int64 *ikeys= new Int64[num];
+		keys= new key_type[num];
+		assert(ikeys && keys);
+
+		keygen(key_num, ikeys);
+		sortkey(key_num, ikeys);
 
-		keygen(key_num, keys);
-		sortkey(key_num, keys);
+		// makeKey preserves the order
+		for (Int64 i=0; i<num; i++) keys[i]= makeKey(ikeys[i]);
+		delete[] ikeys;
 
 		key_start= start;
 		key_step= step;
@@ -257,7 +268,7 @@ class inMemKeyInput: public keyInput {
 		delete[] keys;
 	}
 
-        Int64 get_key (Int64 index)
+        key_type get_key (Int64 index)
         {
 	        Int64 ii= key_start + key_step*index;
                 assert((0<=ii) && (ii<key_num));
@@ -18,27 +18,300 @@
  * segment of the memory pool to reduce contention.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <thread>
 #include "mempool.h"
+#include "nvm-common.h"
 
 thread_local int worker_id= -1;  /* in Thread Local Storage */
+thread_local int epoch_depth= 0;
 
 threadMemPools   the_thread_mempools;
 threadNVMPools   the_thread_nvmpools;
+epochManager     the_epochs;
+threadPlacement  the_placement;
 
 /* -------------------------------------------------------------- */
-void threadMemPools::init (int num_workers, long long size, long long align)
+void epochManager::advance (void)
+{
+    unsigned long long e= em_global;
+    for (int i=0; i<em_num_workers; i++) {
+       unsigned long long le= em_local[i].epoch;
+       if ((le != 0) && (le != e)) return;  // worker i is in epoch e-1
+    }
+    __sync_bool_compare_and_swap(&em_global, e, e+1);
+}
+
+void epochManager::synchronize (void)
+{
+    assert(epoch_depth == 0);
+    unsigned long long e= em_global;
+    while (em_global < e + 2) {
+       advance();
+       sched_yield();
+    }
+}
+
+/* -------------------------------------------------------------- */
+#define PLACEMENT_MPOL_BIND  2   /* MPOL_BIND in <numaif.h> */
+
+static const char *placement_name[]= {"none", "compact", "scatter"};
+
+/**
+ * the NUMA node of a CPU, or 0 if it is unknown
+ */
+static int cpuNode (int cpu)
+{
+    char path[80];
+    for (int n=0; n<PLACEMENT_MAX_NODES; n++) {
+       sprintf(path, "/sys/devices/system/cpu/cpu%d/node%d", cpu, n);
+       if (access(path, F_OK) == 0) return n;
+    }
+    return 0;
+}
+
+void threadPlacement::init (int num_workers, int policy)
+{
+    assert((num_workers>0) && (policy>=PLACEMENT_NONE)
+        && (policy<=PLACEMENT_SCATTER));
+
+    delete[] tp_cpu; delete[] tp_node;
+    tp_policy= policy;
+    tp_num_workers= num_workers;
+    tp_cpu= new int[num_workers];
+    tp_node= new int[num_workers];
+    tp_num_nodes= 1;
+    if (policy == PLACEMENT_NONE) return;
+
+    // 1. the allowed CPUs and their nodes, in the order of nodes
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+       perror ("sched_getaffinity"); exit (1);
+    }
+
+    int ncpu= 0;
+    int cpus[CPU_SETSIZE], nodes[CPU_SETSIZE];
+    for (int n=0; n<PLACEMENT_MAX_NODES; n++) {
+       for (int c=0; c<CPU_SETSIZE; c++) {
+          if (CPU_ISSET(c, &allowed) && cpuNode(c) == n) {
+             cpus[ncpu]= c; nodes[ncpu]= n; ncpu++;
+             if (n+1 > tp_num_nodes) tp_num_nodes= n+1;
+          }
+       }
+    }
+    assert(ncpu > 0);
+
+    // 2. the order of the CPUs for the workers
+    int order[ncpu];
+    if (policy == PLACEMENT_COMPACT) {
+       for (int k=0; k<ncpu; k++) order[k]= k;
+    }
+    else {
+       // take the next CPU of every node in turn
+       int next[tp_num_nodes];
+       for (int n=0; n<tp_num_nodes; n++) next[n]= 0;
+       for (int k=0; k<ncpu; ) {
+          for (int n=0; n<tp_num_nodes && k<ncpu; n++) {
+             int seen= 0;
+             for (int j=0; j<ncpu; j++) {
+                if (nodes[j] != n) continue;
+                if (seen++ == next[n]) { order[k++]= j; next[n]++; break; }
+             }
+          }
+       }
+    }
+
+    for (int w=0; w<num_workers; w++) {
+       tp_cpu[w]= cpus[order[w % ncpu]];
+       tp_node[w]= nodes[order[w % ncpu]];
+    }
+
+    printf("worker placement: %s, %d CPUs, %d NUMA nodes\n",
+           placement_name[policy], ncpu, tp_num_nodes);
+}
+
+void threadPlacement::pin (int worker)
+{
+    int c= cpu(worker);
+    if (c < 0) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(c, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+       perror ("sched_setaffinity");
+    }
+}
+
+void threadPlacement::bind (int worker, char *addr, long long size)
+{
+    static bool warned= false;
+
+    int n= node(worker);
+    if (n < 0) return;
+
+    // the pages that start in the range
+    unsigned long long b= ((unsigned long long)addr + 4095) & ~4095ULL;
+    unsigned long long e= ((unsigned long long)addr + size) & ~4095ULL;
+    if (e <= b) return;
+
+    unsigned long mask= 1UL << n;
+    if (syscall(SYS_mbind, b, e-b, PLACEMENT_MPOL_BIND, &mask,
+                PLACEMENT_MAX_NODES+1, 0) != 0 && !warned) {
+       warned= true;
+       perror ("Warning: mbind");
+    }
+}
+
+/* -------------------------------------------------------------- */
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT  26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB    (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB    (30 << MAP_HUGE_SHIFT)
+#endif
+
+static const char *page_name[]= {"4KB", "THP", "2MB", "1GB"};
+
+/**
+ * touch every page of [p, p+size) in parallel
+ *
+ * Thread t touches the t-th of num_threads equal parts on the CPU of
+ * worker t, so the part that is the pool of worker t is first touched
+ * on its NUMA node.
+ *
+ * @param write  write a byte to every page, or only read the pages
+ */
+static void prefault (char *p, long long size, int num_threads, bool write)
+{
+    long long part= (size / num_threads + 4095) / 4096 * 4096;
+    auto touch= [=](int t) {
+        char *s= p + t*part;
+        char *e= ((t == num_threads-1) ? p + size : s + part);
+        volatile char sum= 0;
+        for (char *q= s; q < e; q += 4096) {
+           if (write) *q= 1;
+           else sum += *q;
+        }
+    };
+
+    if (num_threads == 1) { touch(0); return; }
+
+    std::thread threads[num_threads];
+    for (int t=0; t<num_threads; t++) {
+       threads[t] = std::thread([=](){
+            the_placement.pin(t);
+            touch(t);
+         });
+    }
+    for (int t=0; t<num_threads; t++) threads[t].join();
+}
+
+/**
+ * the mapping size of size bytes of DRAM with the given pages
+ */
+static long long pageRoundUp (long long size, int page)
+{
+    long long ps= (page == MEMPOOL_PAGE_1GB ? 1024LL*MB
+                 : page == MEMPOOL_PAGE_4KB ? 4096 : MEMPOOL_HUGE_PAGE_SIZE);
+    return (size + ps - 1) / ps * ps;
+}
+
+/**
+ * allocate DRAM with the given pages
+ *
+ * A huge page allocation is mapped with a length of pageRoundUp(size, page)
+ * even if it falls back from hugetlbfs pages to transparent huge pages, so
+ * that freePages can unmap it.
+ *
+ * @param page  MEMPOOL_PAGE_*
+ * @param warn  print a warning if there are not enough hugetlbfs pages
+ * @return      the allocated memory, or NULL if it fails
+ */
+static char * allocPages (long long size, long long align, int page, bool warn)
+{
+    if (page == MEMPOOL_PAGE_4KB)
+       return (char *)memalign (align, size);
+
+    long long len= pageRoundUp(size, page);
+    if (page == MEMPOOL_PAGE_2MB || page == MEMPOOL_PAGE_1GB) {
+       int flags= MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+                | (page == MEMPOOL_PAGE_1GB ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+       void *p= mmap(NULL, len, PROT_READ|PROT_WRITE, flags, -1, 0);
+       if (p != MAP_FAILED) return (char *)p;
+
+       if (warn)
+          fprintf(stderr, "Warning: not enough %s hugetlbfs pages, "
+                          "use transparent huge pages\n", page_name[page]);
+    }
+
+    // transparent huge pages: map at a 2MB boundary and trim the rest
+    long long hs= MEMPOOL_HUGE_PAGE_SIZE;
+    char *r= (char *)mmap(NULL, len + hs, PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (r == (char *)MAP_FAILED) return NULL;
+
+    char *p= (char *)(((unsigned long long)r + hs - 1) & ~(unsigned long long)(hs - 1));
+    if (p > r) munmap(r, p - r);
+    munmap(p + len, r + hs - p);
+    if (madvise(p, len, MADV_HUGEPAGE) != 0) perror ("madvise");
+    return p;
+}
+
+/**
+ * free the memory from allocPages
+ */
+static void freePages (char *p, long long size, int page)
+{
+    if (page == MEMPOOL_PAGE_4KB)
+       free(p);
+    else
+       munmap(p, pageRoundUp(size, page));
+}
+
+threadMemPools::~threadMemPools()
+{
+    if(tm_buf) {
+        freePages(tm_buf, tm_size, tm_page);
+        tm_buf= NULL;
+    }
+    if(tm_pools) {
+        for (int i=0; i<tm_num_workers; i++)
+          for (mempoolSegment *s= tm_pools[i].get_segments(); s; s= s->next)
+            if (s->extension) freePages(s->start, s->size, tm_page);
+        delete[] tm_pools;
+        tm_pools= NULL;
+    }
+}
+
+void threadMemPools::init (int num_workers, long long size, long long align,
+                           int page)
 {
     assert((num_workers>0)&&(size>0)&&(align>0)&((align&(align-1))==0));
 
     // 1. allocate memory
     tm_num_workers= num_workers;
+    the_epochs.init(num_workers);
     tm_pools= new mempool[tm_num_workers];
 
     long long size_per_pool= (size/tm_num_workers/align)*align;
     size_per_pool= (size_per_pool<MB ? MB:size_per_pool);
+    if (page != MEMPOOL_PAGE_4KB && the_placement.get_policy() != PLACEMENT_NONE) {
+       // a huge page is on a single NUMA node
+       size_per_pool= pageRoundUp(size_per_pool, page);
+    }
     tm_size= size_per_pool*tm_num_workers;
 
-    tm_buf= (char *)memalign (align, tm_size);
+    tm_page= page;
+    tm_buf= allocPages (tm_size, align, tm_page, true);
     if (!tm_buf || !tm_pools) {
 	perror ("malloc"); exit (1);
     }
@@ -48,14 +321,32 @@ void threadMemPools::init (int num_workers, long long size, long long align)
     for (int i=0; i<tm_num_workers; i++) {
        sprintf(name, "DRAM pool %d", i);
        tm_pools[i].init(tm_buf+i*size_per_pool, size_per_pool, align, strdup(name));
+       the_placement.bind(i, tm_buf+i*size_per_pool, size_per_pool);
     }
 
     // 3. touch every page to make sure that they are allocated
-    for(long long i = 0; i<tm_size; i+=4096) {
-        tm_buf[i] = 1;
+    prefault(tm_buf, tm_size, tm_num_workers, true);
+
+    // 4. the pools grow with segments from new_segment
+    for (int i=0; i<tm_num_workers; i++) {
+       tm_pools[i].set_source(this);
+       tm_pools[i].set_peers(tm_pools, tm_num_workers, i,
+                             the_placement.node(i));
     }
 }
 
+char * threadMemPools::new_segment (mempool *pool, long long size)
+{
+    char *p= allocPages (size, pool->get_align(), tm_page, false);
+    if (!p) return NULL;
+    the_placement.bind(pool->get_id(), p, size);
+
+    for(long long i = 0; i<size; i+=4096) {
+        p[i] = 1;
+    }
+    return p;
+}
+
 void threadMemPools::print(void)
 {
     if (tm_pools==NULL) {
@@ -82,21 +373,244 @@ void threadMemPools::print_usage(void)
     printf("--------------------\n");
 }
 
+/* -------------------------------------------------------------- */
+void mempool::set_hwm (char **hwm, char *cur)
+{
+    mempool_segs->claimed= cur - mempool_segs->start;
+    mempool_cur= mempool_end= cur;
+
+    mempool_hwm= hwm;
+    *mempool_hwm= cur;
+    clwb(mempool_hwm); sfence();
+}
+
+void mempool::advance_hwm (mempoolSegment *seg, char *end)
+{
+    // a high water mark in another segment (a newer segment of the pool)
+    // means that seg is used up
+    char *h;
+    while (((h= *mempool_hwm) >= seg->start) && (h < end)) {
+       if (__sync_bool_compare_and_swap(mempool_hwm, h, end)) break;
+    }
+    clwb(mempool_hwm); sfence();
+}
+
+bool mempool::claim (mempool *owner, unsigned long long size)
+{
+    mempoolSegment *seg= owner->mempool_segs;
+    if (seg->claimed + (long long)size > seg->size) return false;
+
+    long long n= (size + MEMPOOL_CHUNK_SIZE - 1) / MEMPOOL_CHUNK_SIZE
+                 * MEMPOOL_CHUNK_SIZE;
+    long long off= __sync_fetch_and_add(&(seg->claimed), n);
+    if (off + (long long)size > seg->size) return false;
+
+    char *end= seg->start + ((off + n < seg->size) ? off + n : seg->size);
+    if (owner->mempool_hwm) owner->advance_hwm(seg, end);
+
+    // the rest of the old chunk is not used
+    mempool_cur= seg->start + off;
+    mempool_end= end;
+    return true;
+}
+
+bool mempool::refill (unsigned long long size)
+{
+    // 1. the current segment
+    if (claim (this, size)) return true;
+
+    // 2. the current segment of a peer in the same group, starting from
+    //    the next one
+    for (int k=1; k<mempool_num_peers; k++) {
+       mempool *peer= &(mempool_peers[(mempool_id + k) % mempool_num_peers]);
+       if (peer->mempool_group != mempool_group) continue;
+       if (claim (peer, size)) return true;
+    }
+
+    // 3. a new segment
+    if (grow (size)) return true;
+
+    // 4. the current segment of a remote peer
+    for (int k=1; k<mempool_num_peers; k++) {
+       mempool *peer= &(mempool_peers[(mempool_id + k) % mempool_num_peers]);
+       if (peer->mempool_group == mempool_group) continue;
+       if (claim (peer, size)) return true;
+    }
+    return false;
+}
+
+bool mempool::grow (unsigned long long size)
+{
+    if (mempool_source == NULL) return false;
+
+    // the segments double in size
+    long long seg_size= 2 * mempool_segs->size;
+    if (seg_size < mempool_size) seg_size= mempool_size;
+    seg_size= (seg_size + mempool_align - 1) / mempool_align * mempool_align;
+    if ((long long)size > seg_size)
+       seg_size= (size + mempool_align - 1) / mempool_align * mempool_align;
+    while (mempool_source->reserved_size(seg_size) + (long long)size > seg_size)
+       seg_size += mempool_align;
+
+    char *p= mempool_source->new_segment(this, seg_size);
+    if (p == NULL) return false;
+
+    mempoolSegment *seg= new mempoolSegment;
+    seg->start= p;
+    seg->size= seg_size;
+    seg->claimed= mempool_source->reserved_size(seg_size);
+    seg->extension= 1;
+    seg->next= mempool_segs;
+    mempool_total += seg_size;
+
+    // the high water mark moves to the segment before the peers see it
+    if (mempool_hwm) {
+       *mempool_hwm= p;
+       clwb(mempool_hwm); sfence();
+    }
+    asm volatile("" ::: "memory");
+    mempool_segs= seg;
+
+    return claim (this, size);
+}
+
+/* -------------------------------------------------------------- */
+
+/**
+ * map a file of the NVM pool
+ *
+ * @param addr     the address to map the file at, or NULL to choose one
+ * @param size     the size of the file
+ * @param create   create the file, or map an existing file
+ * @param backend  NVM_BACKEND_DRAM allocates memory instead
+ * @return         the mapping address, or NULL if it fails
+ */
+static char * mapFile (const char *fname, char *addr, long long size,
+                       bool create, int backend)
+{
+    if (backend == NVM_BACKEND_DRAM) {
+       return (char *)memalign (MEMPOOL_HUGE_PAGE_SIZE, size);
+    }
+
+    // pmem_map_file cannot map at a given address, and it would use
+    // PMEM_MMAP_HINT, where the first file is mapped.  So mmap the file.
+    int fd= open(fname, O_RDWR | (create ? O_CREAT : 0), 0666);
+    if (fd < 0) { perror (fname); return NULL; }
+    if (create && ftruncate(fd, size) != 0) {
+       perror ("ftruncate"); close(fd); return NULL;
+    }
+
+    // map a new file at a 2MB boundary, so that DAX can use huge
+    // mappings: find a free range with a larger reservation.
+    // The page tables of an existing file are populated at once.
+    int flags= MAP_SHARED | (addr ? MAP_FIXED_NOREPLACE : 0)
+                          | (create ? 0 : MAP_POPULATE);
+    void *p= MAP_FAILED;
+    if (addr == NULL && size >= MEMPOOL_HUGE_PAGE_SIZE) {
+       long long len= size + MEMPOOL_HUGE_PAGE_SIZE;
+       void *r= mmap(NULL, len, PROT_NONE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+       if (r != MAP_FAILED) {
+          munmap(r, len);
+          char *a= (char *)(((unsigned long long)r + MEMPOOL_HUGE_PAGE_SIZE-1)
+                            & ~(unsigned long long)(MEMPOOL_HUGE_PAGE_SIZE-1));
+          p= mmap(a, size, PROT_READ|PROT_WRITE,
+                  flags|MAP_FIXED_NOREPLACE, fd, 0);
+          if (p != MAP_FAILED && p != a) { munmap(p, size); p= MAP_FAILED; }
+       }
+    }
+    if (p == MAP_FAILED)
+       p= mmap(addr, size, PROT_READ|PROT_WRITE, flags, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) { perror ("mmap"); return NULL; }
+    return (char *)p;
+}
+
+/**
+ * make the blocks of a new file of the pmem backend durable
+ *
+ * A new file is sized with ftruncate (or fallocate by pmem_map_file), and
+ * the file system may allocate its blocks when the pages are first
+ * touched.  clwb and sfence do not persist that allocation on a DAX file
+ * system, so the prefaulted pages are synced before the file is recorded
+ * in the header, and before the allocation bitmap or a high water mark
+ * can point into it.
+ */
+static void syncNewFile (char *p, long long size, int backend)
+{
+    if (backend != NVM_BACKEND_PMEM) return;
+    if (msync(p, size, MS_SYNC) != 0) { perror ("msync"); exit(1); }
+}
+
+/**
+ * map the file of extension segment k, which is <nvm_file>.<k+1>
+ */
+static char * mapSegment (const char *nvm_file, long long k, char *addr,
+                          long long size, int backend)
+{
+    char fname[strlen(nvm_file) + 32];
+    sprintf(fname, "%s.%lld", nvm_file, k+1);
+    return mapFile(fname, addr, size, (addr == NULL), backend);
+}
+
+/**
+ * unmap a file or a segment of the NVM pool
+ */
+static void unmapFile (char *addr, long long size, int backend)
+{
+    if (backend == NVM_BACKEND_DRAM) free(addr);
+    else if (backend == NVM_BACKEND_PMEM) pmem_unmap(addr, size);
+    else munmap(addr, size);
+}
+
+/**
+ * the file of a worker's pool: the file of its NUMA node
+ */
+static int workerFile (int worker, int num_files)
+{
+    int node= the_placement.node(worker);
+    return ((node >= 0) ? node : worker) % num_files;
+}
+
 /* -------------------------------------------------------------- */
 threadNVMPools::~threadNVMPools()
 {
     if(tm_buf) {
-#ifdef NVMPOOL_REAL
-        pmem_unmap(tm_buf, tm_size);
-#else  // NVMPOOL_REAL not defined, use DRAM memory
-        free(tm_buf);
-#endif
+       for (long long k=0; k<tn_header->num_segments; k++) {
+          unmapFile(tn_header->segments[k].base, tn_header->segments[k].size,
+                    tn_backend);
+       }
+       for (long long f=1; f<tn_header->num_files; f++) {
+          unmapFile(tn_header->files[f].base, tn_header->files[f].size,
+                    tn_backend);
+       }
+        unmapFile(tm_buf, tm_size, tn_backend);
         tm_buf= NULL;
     }
     if(tm_pools) {
         delete[] tm_pools;
         tm_pools= NULL;
     }
+    if(tn_value_heaps) {
+        delete[] tn_value_heaps;
+        tn_value_heaps= NULL;
+    }
+    if(tn_value_chunks) {
+        delete[] tn_value_chunks;
+        tn_value_chunks= NULL;
+    }
+    if(tn_worker_file) {
+        delete[] tn_worker_file;
+        tn_worker_file= NULL;
+    }
+    if(tn_pending) {
+        delete[] tn_pending;
+        tn_pending= NULL;
+    }
+    if(tn_used_end) {
+        delete[] tn_used_end;
+        tn_used_end= NULL;
+    }
 }
 
 /**
@@ -108,69 +622,792 @@ static void handleSigbus (int sig)
     _exit(0);
 }
 
+/**
+ * the end of the header and the allocation bitmap of file f
+ */
+char * threadNVMPools::meta_end (int f)
+{
+    nvmPoolFile *file= &(tn_header->files[f]);
+    return (f == 0 ? file->base + NVMPOOL_HEADER_SIZE : file->base)
+           + NVMPOOL_BITMAP_SIZE(file->size);
+}
 
-void threadNVMPools::init (int num_workers, const char * nvm_file, long long size)
+void threadNVMPools::init (int num_workers, const char * nvm_file, long long size,
+                           bool recover, int page, int backend)
 {
     // map_addr must be 4KB aligned, size must be multiple of 4KB
     assert((num_workers>0)&&(size>0)&&(size % 4096 == 0));
+    assert(num_workers <= NVMPOOL_MAX_WORKERS);
 
     // set sigbus handler
     signal(SIGBUS, handleSigbus);
 
     // 1. allocate memory
     tm_num_workers= num_workers;
+    the_epochs.init(num_workers);
     tm_pools= new mempool[tm_num_workers];
-    if (!tm_pools) { perror ("malloc"); exit (1); }
+    tn_value_heaps= new valueHeap[tm_num_workers];
+    tn_worker_file= new int[tm_num_workers];
+    if (!tm_pools || !tn_value_heaps || !tn_worker_file) {
+       perror ("malloc"); exit (1);
+    }
+
+    // nvm_file is "<file0>,<file1>,..."
+    char *names= strdup(nvm_file);
+    char *file_name[NVMPOOL_MAX_FILES];
+    int num_files= 0;
+    for (char *s= strtok(names, ","); s; s= strtok(NULL, ",")) {
+       if (num_files == NVMPOOL_MAX_FILES || strlen(s) >= NVMPOOL_PATH_SIZE) {
+          fprintf(stderr, "Error: at most %d NVM files of less than %d "
+                          "characters\n", NVMPOOL_MAX_FILES, NVMPOOL_PATH_SIZE);
+          exit(1);
+       }
+       file_name[num_files++]= s;
+    }
+    if (num_files == 0) { fprintf(stderr, "Error: no NVM file\n"); exit(1); }
+    tn_nvm_file= file_name[0];
+    tn_backend= backend;
+
+    // NVM_BACKEND_FILE persists with msync at sfence
+    nvm_flush_msync= (backend == NVM_BACKEND_FILE);
 
-    tn_nvm_file= nvm_file;
+    // the number of pools in every file
+    for (int i=0; i<tm_num_workers; i++)
+       tn_worker_file[i]= workerFile(i, num_files);
+    int file_workers[NVMPOOL_MAX_FILES];
+    for (int f=0; f<num_files; f++) file_workers[f]= 0;
+    for (int i=0; i<tm_num_workers; i++) file_workers[tn_worker_file[i]]++;
 
     long long size_per_pool= (size/tm_num_workers/4096)*4096;
     size_per_pool= (size_per_pool<MB ? MB:size_per_pool);
-    tm_size= size_per_pool*tm_num_workers;
+    if (page != MEMPOOL_PAGE_4KB) {
+       // huge pages: every pool and extension segment is a multiple of 2MB
+       size_per_pool= pageRoundUp(size_per_pool, MEMPOOL_PAGE_THP);
+    }
+    long long file_size[NVMPOOL_MAX_FILES];
+    for (int f=0; f<num_files; f++)
+       file_size[f]= size_per_pool*(file_workers[f] > 0 ? file_workers[f] : 1);
+    tm_size= file_size[0];
+
 
+    if (backend == NVM_BACKEND_PMEM) {
+       // pmdk allows PMEM_MMAP_HINT=map_addr to set the map address
 
-#ifdef NVMPOOL_REAL
+       int is_pmem = false;
+       size_t mapped_len = tm_size;
 
-    // pmdk allows PMEM_MMAP_HINT=map_addr to set the map address
+       if (recover) {
+          // map the entire existing file
+          tm_buf= (char *) pmem_map_file(tn_nvm_file, 0, 0, 0, &mapped_len, &is_pmem);
+       }
+       else {
+          tm_buf= (char *) pmem_map_file(tn_nvm_file, tm_size, PMEM_FILE_CREATE, 0666, &mapped_len, &is_pmem);
+       }
+       if (tm_buf == NULL) {
+          perror ("pmem_map_file");
+          exit(1);
+       }
+       if (! is_pmem) {
+          fprintf(stderr, "Warning: %s is not persistent memory, clwb and "
+                          "sfence do not make it durable\n", tn_nvm_file);
+       }
 
-    int is_pmem = false;
-    size_t mapped_len = tm_size;
+       printf("NVM mapping address: %p, size: %ld\n", tm_buf, mapped_len);
+       if (page != MEMPOOL_PAGE_4KB
+       &&  ((unsigned long long)tm_buf & (MEMPOOL_HUGE_PAGE_SIZE-1)) != 0) {
+          // pmem_map_file aligns a mapping of >=2MB, unless PMEM_MMAP_HINT
+          // is given
+          fprintf(stderr, "Warning: NVM mapping is not 2MB aligned, "
+                          "DAX cannot use huge pages\n");
+       }
+       if (recover) {
+          // an existing pool may be split differently among the workers
+          tm_size= mapped_len;
+       }
+       if (tm_size != mapped_len) {
+          fprintf(stderr, "Error: cannot map %lld bytes\n", tm_size);
+          pmem_unmap(tm_buf, mapped_len);
+          exit(1);
+       }
+    }
+    else if (backend == NVM_BACKEND_FILE) {
+       // an existing file is mapped at the address in its header, a new file
+       // at PMEM_MMAP_HINT if it is given
+       char *addr= NULL;
+       if (recover) {
+          struct stat st;
+          int fd= open(tn_nvm_file, O_RDONLY);
+          if (fd < 0 || fstat(fd, &st) != 0
+          ||  pread(fd, &addr, sizeof(addr), offsetof(nvmPoolHeader, base))
+              != sizeof(addr)) {
+             perror (tn_nvm_file); exit(1);
+          }
+          close(fd);
+          tm_size= st.st_size;
+       }
+       else if (getenv("PMEM_MMAP_HINT")) {
+          addr= (char *) strtoull(getenv("PMEM_MMAP_HINT"), NULL, 16);
+       }
 
-    tm_buf= (char *) pmem_map_file(tn_nvm_file, tm_size, PMEM_FILE_CREATE, 0666, &mapped_len, &is_pmem);
-    if (tm_buf == NULL) {
-       perror ("pmem_map_file");
-       exit(1);
+       tm_buf= mapFile(tn_nvm_file, addr, tm_size, !recover, backend);
+       if (tm_buf == NULL) {
+          fprintf(stderr, "Error: cannot map %s at %p\n", tn_nvm_file, addr);
+          exit(1);
+       }
+       printf("NVM mapping address: %p, size: %lld\n", tm_buf, tm_size);
     }
+    else {  // NVM_BACKEND_DRAM
+       if (recover) {
+          fprintf(stderr, "Error: recovery requires the pmem or file backend\n");
+          exit(1);
+       }
 
-    printf("NVM mapping address: %p, size: %ld\n", tm_buf, mapped_len);
-    if (tm_size != mapped_len) {
-       fprintf(stderr, "Error: cannot map %lld bytes\n", tm_size);
-       pmem_unmap(tm_buf, mapped_len);
-       exit(1);
+       tm_buf= (char *)memalign ((page != MEMPOOL_PAGE_4KB
+                                  ? MEMPOOL_HUGE_PAGE_SIZE : 4096), tm_size);
+       if (!tm_buf) {
+           perror ("malloc"); exit (1);
+       }
     }
 
-#else  // NVMPOOL_REAL not defined, use DRAM memory
+    tn_header= (nvmPoolHeader *)tm_buf;
 
-    tm_buf= (char *)memalign (4096, tm_size);
-    if (!tm_buf) {
-        perror ("malloc"); exit (1);
+    // 2. check the header of an existing pool and map its other files
+    //    or create the other files of a new pool
+    //    and touch every page to make sure that they are allocated
+    if (recover) {
+       if (tn_header->magic != NVMPOOL_MAGIC || tn_header->size != tm_size) {
+          fprintf(stderr, "Error: %s is not an NVM pool of %lld bytes\n",
+                  tn_nvm_file, tm_size);
+          exit(1);
+       }
+       if (tn_header->base != tm_buf) {
+          fprintf(stderr, "Error: %s was mapped at %p. "
+                          "Please set PMEM_MMAP_HINT=%p\n",
+                  tn_nvm_file, tn_header->base, tn_header->base);
+          exit(1);
+       }
+       if (num_files > 1 && num_files != tn_header->num_files) {
+          fprintf(stderr, "Warning: %s has %lld files, use them instead\n",
+                  tn_nvm_file, tn_header->num_files);
+       }
+
+       // the workers of the existing files
+       num_files= tn_header->num_files;
+       for (int i=0; i<tm_num_workers; i++)
+          tn_worker_file[i]= workerFile(i, num_files);
+
+       // read every page, do not overwrite the contents
+       prefault(tm_buf, tm_size, tm_num_workers, false);
+
+       // map the other files and the extension segments at their old
+       // addresses (mapFile populates them)
+       for (long long f=1; f<num_files; f++) {
+          nvmPoolFile *file= &(tn_header->files[f]);
+          char *p= mapFile(file->path, file->base, file->size, false, backend);
+          if (p != file->base) {
+             fprintf(stderr, "Error: cannot map %s at %p\n",
+                     file->path, file->base);
+             exit(1);
+          }
+       }
+       for (long long k=0; k<tn_header->num_segments; k++) {
+          nvmPoolSegment *seg= &(tn_header->segments[k]);
+          char *p= mapSegment(tn_header->files[seg->file].path, k,
+                              seg->base, seg->size, backend);
+          if (p != seg->base) {
+             fprintf(stderr, "Error: cannot map segment %lld of %s at %p\n",
+                     k+1, tn_header->files[seg->file].path, seg->base);
+             exit(1);
+          }
+       }
+       tn_old_segments= tn_header->num_segments;
+
+       // the nodes that were being allocated at the crash
+       tn_pending= new char *[NVMPOOL_MAX_WORKERS];
+       for (int j=0; j<NVMPOOL_MAX_WORKERS; j++) {
+          if (tn_header->worker[j].pending)
+             tn_pending[tn_num_pending++]= tn_header->worker[j].pending;
+       }
+    }
+    else {
+       prefault(tm_buf, tm_size, tm_num_workers, true);  // XXX: need a special signature
+       syncNewFile(tm_buf, tm_size, backend);
+
+       memset(tn_header, 0, NVMPOOL_HEADER_SIZE);
+       tn_header->base= tm_buf;
+       tn_header->size= tm_size;
+
+       tn_header->num_files= num_files;
+       for (int f=0; f<num_files; f++) {
+          nvmPoolFile *file= &(tn_header->files[f]);
+          char *p= tm_buf;
+          if (f > 0) {
+             p= mapFile(file_name[f], NULL, file_size[f], true, backend);
+             if (!p) {
+                fprintf(stderr, "Error: cannot create %s\n", file_name[f]);
+                exit(1);
+             }
+             printf("NVM mapping address: %p, size: %lld\n", p, file_size[f]);
+             prefault(p, file_size[f], tm_num_workers, true);
+             syncNewFile(p, file_size[f], backend);
+          }
+          file->base= p;
+          file->size= file_size[f];
+          strcpy(file->path, file_name[f]);
+
+          // the allocation bitmap follows the header or starts the file
+          char *bitmap= (f == 0 ? p + NVMPOOL_HEADER_SIZE : p);
+          memset(bitmap, 0, NVMPOOL_BITMAP_SIZE(file_size[f]));
+          clwbmore(bitmap, bitmap + NVMPOOL_BITMAP_SIZE(file_size[f]) - 1);
+       }
     }
 
-#endif // NVMPOOL_REAL
+    // 3. compute the slice and the first unused address of every new pool
+    //    The headers and the allocation bitmaps are not in any pool.
+    //    A new pool is used up to the highest old high water mark in its range.
+    //    An old pool whose high water mark is in an extension segment has
+    //    used up its range.  The extension segments are not reused for
+    //    bump allocation.
+    char * start[tm_num_workers];
+    long long slice[tm_num_workers];
+    char * cur[tm_num_workers];
+    for (int f=0; f<num_files; f++) file_workers[f]= 0;
+    for (int i=0; i<tm_num_workers; i++) file_workers[tn_worker_file[i]]++;
+
+    int rank[num_files];
+    for (int f=0; f<num_files; f++) rank[f]= 0;
+    for (int i=0; i<tm_num_workers; i++) {
+       int f= tn_worker_file[i];
+       nvmPoolFile *file= &(tn_header->files[f]);
+       slice[i]= (file->size/file_workers[f]/4096)*4096;
+       start[i]= file->base + (rank[f]++)*slice[i];
+
+       char * end= start[i] + slice[i];
+       char * mend= meta_end(f);
+       cur[i]= ((start[i] < mend) ? (mend < end ? mend : end) : start[i]);
+
+       if (recover) {
+          for (int j=0; j<tn_header->num_workers; j++) {
+             char * old_start= tn_header->worker[j].start;
+             char * old_end= old_start + tn_header->worker[j].size;
+             char * old_hwm= tn_header->worker[j].hwm;
+             if (old_hwm < old_start || old_hwm > old_end) old_hwm= old_end;
+             if (old_start < end && old_hwm > start[i]) {
+                char * used= (old_hwm < end ? old_hwm : end);
+                if (used > cur[i]) cur[i]= used;
+             }
+          }
+       }
+    }
 
-    // 2. initialize NVM memory pools
+    if (recover) {
+       tn_used_end= new char *[tm_num_workers];
+       for (int i=0; i<tm_num_workers; i++) tn_used_end[i]= cur[i];
+    }
+
+    // 4. initialize NVM memory pools
     char name[80];
     for (int i=0; i<tm_num_workers; i++) {
        sprintf(name, "NVM pool %d", i);
-       tm_pools[i].init(tm_buf+i*size_per_pool, size_per_pool, 4096, strdup(name));
+       tm_pools[i].init(start[i], slice[i], 4096, strdup(name));
+       tn_header->worker[i].start= start[i];
+       tn_header->worker[i].size= slice[i];
+       tm_pools[i].set_hwm(&(tn_header->worker[i].hwm), cur[i]);
+       tm_pools[i].set_source(this);
+       tm_pools[i].set_bitmap(this);
+       tm_pools[i].set_peers(tm_pools, tm_num_workers, i, tn_worker_file[i]);
+       tn_value_heaps[i].init(this, &(tm_pools[i]));
     }
 
-    // 3. touch every page to make sure that they are allocated
-    for(long long i = 0; i<tm_size; i+=4096) {
-        tm_buf[i] = 1;  // XXX: need a special signature
+    // 5. make the header persistent
+    tn_header->num_workers= tm_num_workers;
+    clwbmore(tn_header, &(tn_header->worker[tm_num_workers])-1);
+    sfence();
+
+    tn_header->magic= NVMPOOL_MAGIC;
+    clwb(tn_header); sfence();
+}
+
+char * threadNVMPools::new_segment (mempool *pool, long long size)
+{
+    while (__sync_lock_test_and_set(&tn_seg_lock, 1)) ;
+
+    // the segment is created next to the file of the pool
+    char *p= NULL;
+    long long k= tn_header->num_segments;
+    int f= tn_worker_file[pool->get_id()];
+    if (k < NVMPOOL_MAX_SEGMENTS) {
+       p= mapSegment(tn_header->files[f].path, k, NULL, size, tn_backend);
+    }
+    else {
+       fprintf(stderr, "%s: segment table full (%d extension segments)\n",
+               pool->get_name(), NVMPOOL_MAX_SEGMENTS);
+    }
+
+    if (p) {
+       for(long long i = 0; i<size; i+=4096) {
+           p[i] = 1;
+       }
+
+       syncNewFile(p, size, tn_backend);
+
+       // the segment starts with its allocation bitmap
+       memset(p, 0, NVMPOOL_BITMAP_SIZE(size));
+       clwbmore(p, p + NVMPOOL_BITMAP_SIZE(size) - 1);
+
+       // record the segment before the pool writes its high water mark
+       nvmPoolSegment *seg= &(tn_header->segments[k]);
+       seg->base= p;
+       seg->size= size;
+       seg->file= f;
+       clwbmore(seg, (char *)(seg+1) - 1);
+       sfence();
+
+       tn_header->num_segments= k+1;
+       clwb(&(tn_header->num_segments)); sfence();
+    }
+
+    __sync_lock_release(&tn_seg_lock);
+    return p;
+}
+
+char * threadNVMPools::get_root (long long size)
+{
+    if (tn_header->root == NULL) {
+       tn_header->root= (char *) tm_pools[0].alloc(size);
+       clwb(&(tn_header->root)); sfence();
+    }
+    return tn_header->root;
+}
+
+
+/* -------------------------------------------------------------- */
+// allocation bitmaps
+
+/**
+ * find the allocation bitmap that covers p
+ *
+ * @param line  the returned index of the line of p in the bitmap
+ */
+unsigned long long * threadNVMPools::find_bitmap (char *p, long long *line)
+{
+    if (p >= tm_buf && p < tm_buf + tm_size) {
+       *line= (p - tm_buf) / NVMPOOL_LINE_SIZE;
+       return (unsigned long long *)(tm_buf + NVMPOOL_HEADER_SIZE);
+    }
+    for (long long f=1; f<tn_header->num_files; f++) {
+       char *base= tn_header->files[f].base;
+       if (p >= base && p < base + tn_header->files[f].size) {
+          *line= (p - base) / NVMPOOL_LINE_SIZE;
+          return (unsigned long long *)base;
+       }
+    }
+    for (long long k=0; k<tn_header->num_segments; k++) {
+       char *base= tn_header->segments[k].base;
+       if (p >= base && p < base + tn_header->segments[k].size) {
+          *line= (p - base) / NVMPOOL_LINE_SIZE;
+          return (unsigned long long *)base;
+       }
     }
+    fprintf(stderr, "Error: %p is not in the NVM pool\n", p);
+    exit(1);
 }
 
+/**
+ * set or clear the bits of [p, p+size) and flush them
+ */
+void threadNVMPools::set_bits (char *p, long long size, bool used)
+{
+    long long line;
+    unsigned long long *bm= find_bitmap(p, &line);
+    long long first= line;
+    long long num= (p + size - 1 - (char *)getline(p)) / NVMPOOL_LINE_SIZE + 1;
+
+    while (num > 0) {
+       int b= line % 64;
+       int n= ((num < 64 - b) ? num : 64 - b);
+       unsigned long long mask= ((n == 64) ? ~0ULL : (((1ULL << n) - 1) << b));
+       if (used) __sync_fetch_and_or(&(bm[line/64]), mask);
+       else      __sync_fetch_and_and(&(bm[line/64]), ~mask);
+       line += n; num -= n;
+    }
+    clwbmore(&(bm[first/64]), &(bm[(line-1)/64]));
+}
+
+void threadNVMPools::mark_alloc (char *p, long long size)
+{
+    if (size <= 0) return;
+    set_bits(p, size, true);
+    sfence();
+}
+
+void threadNVMPools::mark_node (mempool *pool, char *p, long long size)
+{
+    // the redo record: recovery frees p if it is not reachable
+    char **pending= &(tn_header->worker[pool->get_id()].pending);
+    *pending= p;
+    clwb(pending); sfence();
+
+    // the caller persists the node with an sfence before publishing it
+    set_bits(p, size, true);
+}
+
+void threadNVMPools::unmark_node (char *p)
+{
+    assert(tn_header->node_size > 0);
+    set_bits(p, tn_header->node_size, false);
+    sfence();
+}
+
+void threadNVMPools::free_region (char *p, long long size)
+{
+    if (size <= 0) return;
+    set_bits(p, size, false);
+    sfence();
+}
+
+void threadNVMPools::set_node_size (long long size)
+{
+    // a power of two from a line to 64 lines
+    assert((size >= NVMPOOL_LINE_SIZE) && (size <= 64*NVMPOOL_LINE_SIZE)
+           && ((size & (size-1)) == 0));
+    if (tn_header->node_size != size) {
+       tn_header->node_size= size;
+       clwb(&(tn_header->node_size)); sfence();
+    }
+}
+
+int threadNVMPools::get_pending (char *nodes[])
+{
+    for (int i=0; i<tn_num_pending; i++) nodes[i]= tn_pending[i];
+    return tn_num_pending;
+}
+
+/**
+ * put the unused nodes in [lo, hi) into the free list of pool
+ *
+ * A node is aligned at its size, so its lines are in one bitmap word.
+ *
+ * @param bm    the allocation bitmap whose line 0 is at base
+ * @return      the number of free nodes
+ */
+static long long scanFreeNodes (mempool *pool, unsigned long long *bm,
+                                char *base, char *lo, char *hi,
+                                long long node_size)
+{
+    long long nlines= node_size / NVMPOOL_LINE_SIZE;
+    unsigned long long mask= ((nlines == 64) ? ~0ULL : ((1ULL << nlines) - 1));
+    long long line= (lo - base + node_size - 1) / node_size * nlines;
+    long long end= (hi - base) / node_size * nlines;
+    long long num= 0;
+
+    for (; line < end; line += nlines) {
+       if ((bm[line/64] & (mask << (line % 64))) == 0) {
+          pool->put_free_node(base + line * NVMPOOL_LINE_SIZE);
+          num ++;
+       }
+    }
+    return num;
+}
+
+void threadNVMPools::put_free_region (mempool *pool, char *p, long long size)
+{
+    long long node_size= tn_header->node_size;
+    if ((size <= 0) || (node_size <= 0)) return;
+
+    long long line;
+    unsigned long long *bm= find_bitmap(p, &line);
+    char *base= p - line * NVMPOOL_LINE_SIZE;
+    scanFreeNodes(pool, bm, base, p, p + size, node_size);
+}
+
+void threadNVMPools::rebuild_free_lists (void)
+{
+    long long node_size= tn_header->node_size;
+    if ((tn_used_end == NULL) || (node_size <= 0)) return;
+
+    // 1. the pending nodes have been released by the tree
+    for (int j=0; j<NVMPOOL_MAX_WORKERS; j++) tn_header->worker[j].pending= NULL;
+    clwbmore(tn_header->worker, &(tn_header->worker[NVMPOOL_MAX_WORKERS])-1);
+    sfence();
+    tn_num_pending= 0;
+
+    // 2. release the empty value chunks, and give the free records of the
+    //    others to the value heaps in turn.  The lines of a chunk on the
+    //    list are marked again, in case new_value_chunk did not mark them.
+    long long kept= 0, released= 0;
+    valueChunk **prev= &(tn_header->value_chunks);
+    while (*prev) {
+       valueChunk *ch= *prev;
+       bool empty= true;
+       for (int w=0; w<VALUE_BITMAP_WORDS; w++) {
+          if (ch->bitmap[w]) {empty= false; break;}
+       }
+       if (empty) {
+          // free the lines before unlinking, so that a crash in between
+          // leaves the chunk on the list
+          set_bits((char *)ch, VALUE_CHUNK_SIZE, false); sfence();
+          *prev= ch->next;
+          clwb(prev); sfence();
+          released ++;
+       }
+       else {
+          set_bits((char *)ch, VALUE_CHUNK_SIZE, true);
+          tn_value_heaps[(kept++) % tm_num_workers].add_chunk(ch);
+          prev= &(ch->next);
+       }
+    }
+    sfence();
+    if (kept + released > 0) {
+       printf("rebuilt value heaps: %lld chunks, %lld empty chunks released\n",
+              kept, released);
+    }
+
+    // 3. pool i scans its slice, and the old extension segments of its
+    //    file in turn with the other pools of the file
+    int *owner= new int[tn_old_segments + 1];
+    int file_workers[NVMPOOL_MAX_FILES];
+    for (long long f=0; f<tn_header->num_files; f++) file_workers[f]= 0;
+    for (int i=0; i<tm_num_workers; i++) file_workers[tn_worker_file[i]]++;
+    for (long long k=0; k<tn_old_segments; k++) {
+       int f= tn_header->segments[k].file;
+       if (file_workers[f] == 0) { owner[k]= k % tm_num_workers; continue; }
+       int r= k % file_workers[f];
+       for (int i=0; i<tm_num_workers; i++) {
+          if (tn_worker_file[i] == f && r-- == 0) { owner[k]= i; break; }
+       }
+    }
+
+    long long *num= new long long[tm_num_workers];
+
+    std::thread threads[tm_num_workers];
+    for (int i=0; i<tm_num_workers; i++) {
+       threads[i] = std::thread([=](){
+            int f= tn_worker_file[i];
+            char *base= tn_header->files[f].base;
+            unsigned long long *bm= (unsigned long long *)
+                            (f == 0 ? base + NVMPOOL_HEADER_SIZE : base);
+            char *lo= tn_header->worker[i].start;
+            if (lo < meta_end(f)) lo= meta_end(f);
+            num[i]= scanFreeNodes(&(tm_pools[i]), bm, base,
+                                  lo, tn_used_end[i], node_size);
+
+            for (long long k=0; k<tn_old_segments; k++) {
+               if (owner[k] != i) continue;
+               char *base= tn_header->segments[k].base;
+               long long size= tn_header->segments[k].size;
+               num[i] += scanFreeNodes(&(tm_pools[i]),
+                        (unsigned long long *)base, base,
+                        base + NVMPOOL_BITMAP_SIZE(size), base + size,
+                        node_size);
+            }
+         });
+    }
+    for (int i=0; i<tm_num_workers; i++) threads[i].join();
+
+    long long total= 0;
+    for (int i=0; i<tm_num_workers; i++) total += num[i];
+    delete[] num;
+    delete[] owner;
+
+    delete[] tn_used_end;
+    tn_used_end= NULL;
+
+    printf("rebuilt NVM free lists: %lld free nodes\n", total);
+}
+
+/* -------------------------------------------------------------- */
+// value chunks
+
+valueChunk * threadNVMPools::new_value_chunk (mempool *pool, int sclass)
+{
+    // not marked yet: a crash before the chunk is linked leaves free lines
+    valueChunk *ch= (valueChunk *)(pool->alloc_transient(VALUE_CHUNK_SIZE));
+    ch->magic= VALUE_CHUNK_MAGIC;
+    ch->sclass= sclass;
+    ch->num= VALUE_CHUNK_PAYLOAD / VALUE_SLOT_SIZE(sclass);
+    memset(ch->bitmap, 0, sizeof(ch->bitmap));
+
+    while (__sync_lock_test_and_set(&tn_value_lock, 1)) ;
+
+    ch->next= tn_header->value_chunks;
+    clwbmore(ch, (char *)(ch+1) - 1); sfence();
+
+    tn_header->value_chunks= ch;
+    clwb(&(tn_header->value_chunks)); sfence();
+
+    __sync_lock_release(&tn_value_lock);
+
+    mark_alloc((char *)ch, VALUE_CHUNK_SIZE);
+    return ch;
+}
+
+static int compareChunk(const void *a, const void *b)
+{
+    char *pa= *((char **)a), *pb= *((char **)b);
+    return ((pa < pb) ? -1 : ((pa > pb) ? 1 : 0));
+}
+
+bool threadNVMPools::begin_value_recovery (void)
+{
+    long long n= 0;
+    for (valueChunk *ch= tn_header->value_chunks; ch; ch= ch->next) n++;
+    if (n == 0) return false;
+
+    tn_value_chunks= new valueChunk *[n];
+    n= 0;
+    for (valueChunk *ch= tn_header->value_chunks; ch; ch= ch->next) {
+       memset(ch->bitmap, 0, sizeof(ch->bitmap));
+       tn_value_chunks[n++]= ch;
+    }
+    qsort(tn_value_chunks, n, sizeof(valueChunk *), compareChunk);
+    tn_num_value_chunks= n;
+    return true;
+}
+
+/**
+ * set the bit of p if it is a record in a value chunk
+ *
+ * p can be any record pointer in the tree.  It is read only if it is at
+ * the start of a slot of a chunk.
+ */
+void threadNVMPools::recover_value (void *p)
+{
+    // the last chunk at or below p
+    long long lo= 0, hi= tn_num_value_chunks - 1;
+    while (lo <= hi) {
+       long long mid= (lo + hi) / 2;
+       if ((char *)(tn_value_chunks[mid]) <= (char *)p) lo= mid + 1;
+       else hi= mid - 1;
+    }
+    if (hi < 0) return;
+
+    valueChunk *ch= tn_value_chunks[hi];
+    long long off= (char *)p - (char *)ch - VALUE_CHUNK_HEADER;
+    long long size= VALUE_SLOT_SIZE(ch->sclass);
+    if ((off < 0) || (off % size) || (off / size >= ch->num)) return;
+
+    nvmValue *v= (nvmValue *)p;
+    if ((v->sclass != ch->sclass) || (v->slot != off / size)) return;
+    ch->bitmap[v->slot / 64] |= (1ULL << (v->slot % 64));
+}
+
+void threadNVMPools::end_value_recovery (void)
+{
+    for (long long i=0; i<tn_num_value_chunks; i++) {
+       valueChunk *ch= tn_value_chunks[i];
+       clwbmore(ch->bitmap, (char *)(ch->bitmap + VALUE_BITMAP_WORDS) - 1);
+    }
+    sfence();
+
+    delete[] tn_value_chunks;
+    tn_value_chunks= NULL;
+    tn_num_value_chunks= 0;
+}
+
+long long threadNVMPools::count_values (void)
+{
+    long long n= 0;
+    for (valueChunk *ch= tn_header->value_chunks; ch; ch= ch->next) {
+       for (int w=0; w<VALUE_BITMAP_WORDS; w++)
+          n += __builtin_popcountll(ch->bitmap[w]);
+    }
+    return n;
+}
+
+/* -------------------------------------------------------------- */
+// value heaps
+
+void valueHeap::mark (nvmValue *v, bool used)
+{
+    valueChunk *ch= chunkOf(v);
+    unsigned long long *w= &(ch->bitmap[v->slot / 64]);
+    unsigned long long bit= (1ULL << (v->slot % 64));
+
+    // the slots of a chunk may be on the free lists of several heaps
+    if (used) __sync_fetch_and_or(w, bit);
+    else      __sync_fetch_and_and(w, ~bit);
+    clwb(w);
+}
+
+nvmValue * valueHeap::alloc (int len)
+{
+    assert((len >= 0) && (len <= VALUE_MAX_LEN));
+    int c= VALUE_MIN_CLASS;
+    while ((c < VALUE_LARGE_CLASS)
+           && (VALUE_SLOT_SIZE(c) < len + (int)sizeof(nvmValue))) c++;
+
+    if (vh_free[c] == NULL) {
+       reclaim(the_epochs.em_global);
+       if (vh_free[c] == NULL) add_chunk(vh_nvm->new_value_chunk(vh_pool, c));
+    }
+
+    nvmValue *v= vh_free[c];
+    vh_free[c]= nextFree(v);
+
+    v->len= len;
+    mark(v, true);  // persistent with the sfence that persists the record
+    return v;
+}
+
+void valueHeap::free (nvmValue *v)
+{
+    mark(v, false); sfence();
+    put_free(v);
+}
+
+void valueHeap::retire (nvmValue *v)
+{
+    // the record is not reachable after a crash any more
+    mark(v, false);
+
+    unsigned long long e= the_epochs.em_global;
+    reclaim(e);
+
+    // the array of epoch e is empty or holds records of epoch e
+    int i= e % EBR_LIMBO_NUM;
+    if (vh_limbo_num[i] == vh_limbo_cap[i]) {
+       vh_limbo_cap[i]= (vh_limbo_cap[i] ? 2*vh_limbo_cap[i] : 256);
+       vh_limbo[i]= (nvmValue **)realloc(vh_limbo[i],
+                                         vh_limbo_cap[i]*sizeof(nvmValue *));
+       if (vh_limbo[i] == NULL) {perror("realloc"); exit(1);}
+    }
+    vh_limbo[i][vh_limbo_num[i]++]= v;
+    vh_limbo_epoch[i]= e;
+
+    if (++vh_retired >= EBR_ADVANCE_STEP) {
+       vh_retired= 0;
+       the_epochs.advance();
+    }
+}
+
+/**
+ * move the retired records of epochs <= e-2 to the free lists
+ */
+void valueHeap::reclaim (unsigned long long e)
+{
+    for (int i=0; i<EBR_LIMBO_NUM; i++) {
+       if (vh_limbo_num[i] && (vh_limbo_epoch[i] + 2 <= e)) {
+          for (int j=0; j<vh_limbo_num[i]; j++) put_free(vh_limbo[i][j]);
+          vh_limbo_num[i]= 0;
+       }
+    }
+}
+
+void valueHeap::add_chunk (valueChunk *ch)
+{
+    int size= VALUE_SLOT_SIZE(ch->sclass);
+    char *base= (char *)ch + VALUE_CHUNK_HEADER;
+
+    // push the last slot first, so that the first slot is used first
+    for (int s= ch->num - 1; s >= 0; s--) {
+       if (ch->bitmap[s / 64] & (1ULL << (s % 64))) continue;
+       nvmValue *v= (nvmValue *)(base + (long long)s * size);
+       v->sclass= ch->sclass;
+       v->slot= s;
+       put_free(v);
+    }
+}
 
 void threadNVMPools::print(void)
 {
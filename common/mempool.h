@@ -28,6 +28,64 @@
  * We can find the first nonleaf node.  Then, the NVM can be scanned to 
  * determine the allocated nodes and unused nodes.
  *
+ * The first 8KB of the NVM mapping holds an nvmPoolHeader.  It records the
+ * mapping address, the pool geometry, the tree root page, and a persistent
+ * high water mark per pool.  A pool bump-allocates from MEMPOOL_CHUNK_SIZE
+ * chunks that are claimed from its current segment, and the high water mark
+ * is advanced to the end of every claimed chunk, so an existing pool can
+ * be opened again (threadNVMPools::init with recover=true) without losing
+ * any allocated space.
+ *
+ * The free lists are volatile.  Instead, an NVM mapping keeps a persistent
+ * allocation bitmap with one bit per cache line after its header (or at
+ * the start of an extension segment).  alloc and alloc_node set the bits
+ * of the allocated lines, and free_node and retire_node clear the bits of
+ * the node.  Before it sets the bits, alloc_node records the node as the
+ * pending node of the pool, so that recovery can free the node if it was
+ * not published at a crash (see threadNVMPools::release_node).  Then
+ * threadNVMPools::rebuild_free_lists turns the unused lines below the high
+ * water marks into free nodes, one thread per pool.
+ *
+ * A pool that runs dry takes a chunk from the current segment of another
+ * pool of the same kind in its group (and advances the high water mark of
+ * that pool), or a batch of free nodes that such a pool has donated.  The
+ * group of a DRAM pool is the NUMA node of its worker, and the group of an
+ * NVM pool is its file, so that memory stays local.  Otherwise, it gets
+ * another segment twice the size of its newest segment from its
+ * mempoolSource and chains it, so that the NVM segment table of
+ * NVMPOOL_MAX_SEGMENTS entries covers any realistic growth of the pools.
+ * Only when that fails, it takes a
+ * chunk from a pool in another group.  threadMemPools allocates DRAM
+ * segments with memalign.  threadNVMPools maps a new file <nvm_file>.<k>
+ * for the k-th extension segment and records its address in the header,
+ * so that recovery maps it at the same address.  With the pmem backend, a
+ * new file is synced with msync after its pages are touched and before it
+ * is recorded, so that the block allocation of the file system is durable.
+ * The unused tail of a segment is not reused.
+ *
+ * The NVM can span several files, e.g. one per NUMA node's namespace.
+ * The first file holds the header, which records the path and the mapping
+ * address of every file, so that recovery finds all of them from the
+ * first one.  A worker's pool is a slice of the file of its NUMA node (see
+ * threadPlacement), or of file (worker % number of files) if the workers
+ * are not pinned, and its extension segments are created next to that
+ * file.  Every file after the first starts with its allocation bitmap.
+ *
+ * The DRAM pools can be backed by huge pages to reduce TLB misses on the
+ * non-leaf nodes: transparent huge pages (madvise(MADV_HUGEPAGE)) or
+ * hugetlbfs pages of 2MB or 1GB (mmap(MAP_HUGETLB)).  If no hugetlbfs
+ * page is available, transparent huge pages are used instead.  With huge
+ * pages, the NVM pools are multiples of 2MB.  The extension segments of
+ * NVM are always mapped at 2MB boundaries, so that DAX can use huge
+ * mappings.
+ *
+ * threadPlacement pins the worker threads to CPUs with a policy and knows
+ * the NUMA node of every worker.  threadMemPools binds the pool and the
+ * extension segments of a worker to its node with mbind.
+ *
+ * A node that is removed from a tree may still be visited by concurrent
+ * threads.  It is retired with retire_node instead of free_node, and goes
+ * to the free list after a grace period of epochManager.
  */
 
 #ifndef _BTREE_MEM_POOL_H
@@ -44,17 +102,20 @@
 #include <malloc.h>
 
 /* -------------------------------------------------------------- */
-/* NVMPOOL_REAL: use pmdk to map NVM
- * undefined:    use memalign to allocate memory to simulate NVM
+/* the NVM backend of threadNVMPools, chosen at run time
+ *
+ * NVM_BACKEND_PMEM: use pmdk to map NVM, persist with clwb and sfence
+ * NVM_BACKEND_FILE: mmap a regular file, persist with msync (see sfence)
+ * NVM_BACKEND_DRAM: use memalign to allocate memory to simulate NVM
  */
-#define NVMPOOL_REAL   // comment this out for using DRAM as NVM
+#define NVM_BACKEND_PMEM   0
+#define NVM_BACKEND_FILE   1
+#define NVM_BACKEND_DRAM   2
 
-#ifdef NVMPOOL_REAL
 // use 
 // PMEM_MMAP_HINT=desired_address
 // to map to a desired address
 #include <libpmem.h>
-#endif
 
 /* -------------------------------------------------------------- */
 
@@ -62,6 +123,286 @@
 #define MB	(1024*1024)
 #endif
 
+/* pages of the memory pools (see threadMemPools::init) */
+#define MEMPOOL_PAGE_4KB        0   /* memalign */
+#define MEMPOOL_PAGE_THP        1   /* transparent huge pages */
+#define MEMPOOL_PAGE_2MB        2   /* hugetlbfs 2MB pages */
+#define MEMPOOL_PAGE_1GB        3   /* hugetlbfs 1GB pages */
+
+#define MEMPOOL_HUGE_PAGE_SIZE  (2*MB)
+
+/**
+ * nvmPoolHeader: the persistent header in the first 8KB of the NVM mapping
+ */
+#define NVMPOOL_MAGIC         0x4d42545245454e59ULL  /* "YNEERTBM" */
+#define NVMPOOL_HEADER_SIZE   8192
+#define NVMPOOL_MAX_SEGMENTS  64      /* extension segments */
+#define NVMPOOL_MAX_FILES     8       /* files given to nvmpool */
+#define NVMPOOL_PATH_SIZE     240
+#define NVMPOOL_LINE_SIZE     64      /* a bit in the allocation bitmap */
+
+/* the size of the allocation bitmap of a mapping of s bytes */
+#define NVMPOOL_BITMAP_SIZE(s)  \
+   ((((s)/NVMPOOL_LINE_SIZE/8) + 4095) / 4096 * 4096)
+
+typedef struct nvmPoolSegment {
+    char *              base;          /* mapping address */
+    long long           size;
+    long long           file;          /* created next to files[file] */
+} nvmPoolSegment;
+
+typedef struct nvmPoolFile {
+    char *              base;          /* mapping address */
+    long long           size;
+    char                path[NVMPOOL_PATH_SIZE];
+} nvmPoolFile;
+
+typedef struct nvmPoolWorker {
+    char *              start;         /* the slice of the pool */
+    long long           size;
+    char *              hwm;           /* high water mark of the pool */
+    char *              pending;       /* the last node from alloc_node */
+} nvmPoolWorker;
+
+typedef struct nvmPoolHeader {
+    unsigned long long  magic;
+    char *              base;          /* mapping address */
+    long long           size;          /* total size of the mapping */
+    long long           num_workers;
+    char *              root;          /* root page of the tree */
+    long long           num_segments;  /* extension segments */
+    nvmPoolSegment      segments[NVMPOOL_MAX_SEGMENTS];
+    long long           num_files;     /* files[0] is this mapping */
+    nvmPoolFile         files[NVMPOOL_MAX_FILES];
+    long long           node_size;     /* the size of alloc_node nodes */
+    struct valueChunk * value_chunks;  /* the list of value chunks */
+    nvmPoolWorker       worker[1];     /* worker[0..num_workers-1] */
+} nvmPoolHeader;
+
+#define NVMPOOL_MAX_WORKERS   \
+   ((int)((NVMPOOL_HEADER_SIZE - sizeof(nvmPoolHeader))/sizeof(nvmPoolWorker)) + 1)
+
+/**
+ * epochManager: epoch-based reclamation of retired nodes
+ *
+ * A worker announces the global epoch in its slot while it may hold node
+ * pointers (see epochGuard), and is quiescent (0) otherwise.  The global
+ * epoch advances from e to e+1 only when every announced epoch is e.  So
+ * when the global epoch reaches e+2, no worker can still hold a pointer to
+ * a node that was retired in epoch e, and the node can be reused.
+ */
+#define EBR_MAX_WORKERS     1024
+#define EBR_ADVANCE_STEP    64   /* retirements between advance attempts */
+#define EBR_LIMBO_NUM       3    /* limbo lists: epoch e, e-1, e-2 */
+
+extern thread_local int worker_id;   /* in Thread Local Storage */
+extern thread_local int epoch_depth; /* nesting of epochGuard */
+
+class epochManager {
+ public:
+   volatile unsigned long long em_global;
+   int em_num_workers;
+
+   struct {
+     volatile unsigned long long epoch;  /* 0: quiescent */
+     char pad[64 - sizeof(unsigned long long)];
+   } em_local[EBR_MAX_WORKERS];
+
+ public:
+   epochManager () {em_global= 1; em_num_workers= 0;}
+
+  /**
+   * register workers 0 .. num_workers-1
+   */
+   void init (int num_workers)
+   {
+      assert(num_workers <= EBR_MAX_WORKERS);
+      if (num_workers > em_num_workers) em_num_workers= num_workers;
+   }
+
+  /**
+   * announce the global epoch before visiting nodes.  Calls may nest.
+   */
+   void enter (void)
+   {
+      if (epoch_depth++ == 0) {
+         em_local[worker_id].epoch= em_global;
+         __sync_synchronize();  // the epoch is visible before any node is read
+      }
+   }
+
+  /**
+   * become quiescent after the outermost enter
+   */
+   void leave (void)
+   {
+      if (--epoch_depth == 0) {
+         asm volatile("" ::: "memory");
+         em_local[worker_id].epoch= 0;
+      }
+   }
+
+  /**
+   * advance the global epoch if every active worker has announced it
+   */
+   void advance (void);
+
+  /**
+   * wait until every worker has left the epoch that it was in, so that no
+   * operation that started before the call is still running.  The caller
+   * must not be in an epoch.
+   */
+   void synchronize (void);
+
+}; // epochManager
+
+extern epochManager the_epochs;
+
+/**
+ * epochGuard: the calling worker may hold node pointers in its lifetime
+ */
+class epochGuard {
+ public:
+   epochGuard ()  {the_epochs.enter();}
+   ~epochGuard () {the_epochs.leave();}
+}; // epochGuard
+
+/* -------------------------------------------------------------- */
+/**
+ * threadPlacement: the CPU and the NUMA node of every worker thread
+ *
+ * The CPUs are those allowed for the process, and their nodes are read
+ * from /sys/devices/system/node.  PLACEMENT_COMPACT assigns the CPUs of
+ * node 0 first, then node 1, and so on.  PLACEMENT_SCATTER assigns
+ * the workers to the nodes round robin.  Workers beyond the number of CPUs
+ * wrap around.  PLACEMENT_NONE neither pins the workers nor binds memory.
+ */
+#define PLACEMENT_NONE      0
+#define PLACEMENT_COMPACT   1
+#define PLACEMENT_SCATTER   2
+
+#define PLACEMENT_MAX_NODES 64
+
+class threadPlacement {
+ private:
+   int   tp_policy;
+   int   tp_num_workers;
+   int * tp_cpu;       /* tp_cpu[worker] */
+   int * tp_node;      /* tp_node[worker] */
+   int   tp_num_nodes;
+
+ public:
+   threadPlacement ()
+   {tp_policy= PLACEMENT_NONE; tp_num_workers= 0;
+    tp_cpu= NULL; tp_node= NULL; tp_num_nodes= 1;
+   }
+
+   ~threadPlacement () {delete[] tp_cpu; delete[] tp_node;}
+
+  /**
+   * assign CPUs to workers 0 .. num_workers-1
+   *
+   * @param num_workers  number of parallel worker threads
+   * @param policy       PLACEMENT_NONE, _COMPACT, or _SCATTER
+   */
+   void init (int num_workers, int policy);
+
+   int get_policy (void) {return tp_policy;}
+   int get_num_nodes (void) {return tp_num_nodes;}
+
+  /**
+   * @return the CPU of the worker, or -1 if it is not pinned
+   */
+   int cpu (int worker)
+   {return ((tp_policy != PLACEMENT_NONE) && (worker < tp_num_workers)
+            ? tp_cpu[worker] : -1);}
+
+  /**
+   * @return the NUMA node of the worker, or -1 if it is not pinned
+   */
+   int node (int worker)
+   {return ((tp_policy != PLACEMENT_NONE) && (worker < tp_num_workers)
+            ? tp_node[worker] : -1);}
+
+  /**
+   * pin the calling thread to the CPU of the worker
+   */
+   void pin (int worker);
+
+  /**
+   * bind the pages of [addr, addr+size) to the NUMA node of the worker
+   * before they are touched
+   */
+   void bind (int worker, char *addr, long long size);
+
+}; // threadPlacement
+
+extern threadPlacement the_placement;
+
+/* -------------------------------------------------------------- */
+
+class mempool;
+
+/**
+ * mempoolSource: provide more segments to a mempool that runs out of space
+ */
+class mempoolSource {
+ public:
+  /**
+   * get a new segment for a pool
+   *
+   * @param pool  the pool
+   * @param size  the size of the segment in bytes
+   * @return      the start address of the segment, or NULL if it fails
+   */
+   virtual char * new_segment (mempool *pool, long long size) = 0;
+
+  /**
+   * the bytes at the start of a new segment that the pool must not use
+   */
+   virtual long long reserved_size (long long size) {return 0;}
+};
+
+/**
+ * mempoolBitmap: record the allocated space of a mempool persistently
+ */
+class mempoolBitmap {
+ public:
+  /**
+   * mark [p, p+size) as allocated and make the marks persistent
+   */
+   virtual void mark_alloc (char *p, long long size) = 0;
+
+  /**
+   * record node p of the pool as pending, then mark it as allocated.
+   * The marks are persistent after the next sfence.
+   */
+   virtual void mark_node (mempool *pool, char *p, long long size) = 0;
+
+  /**
+   * mark node p as free and make the marks persistent
+   */
+   virtual void unmark_node (char *p) = 0;
+};
+
+/**
+ * mempoolSegment: a segment on the chain of a mempool
+ *
+ * The pool and the other pools of the same kind claim MEMPOOL_CHUNK_SIZE
+ * chunks of the segment with fetch-and-add on claimed.  Then a chunk is
+ * used by one pool without synchronization.
+ */
+#define MEMPOOL_CHUNK_SIZE   (1*MB)
+#define MEMPOOL_BATCH_NUM    64     /* free nodes given to another pool */
+
+typedef struct mempoolSegment {
+    char *                  start;
+    long long               size;
+    volatile long long      claimed;    /* bytes claimed from start */
+    int                     extension;  /* allocated by grow() */
+    struct mempoolSegment * next;
+} mempoolSegment;
+
 /**
  * mempool: allocate memory using malloc-like calls then manage the memory
  *          by itself
@@ -69,12 +410,33 @@
 class mempool {
  private:
    long long   mempool_align;
-   long long   mempool_size;
-   char * mempool_start;
-   char * mempool_cur;
+   long long   mempool_size;   /* the size of a segment */
+   char * mempool_cur;         /* the current chunk */
    char * mempool_end;
    char * mempool_free_node;
+   long long mempool_free_num;
    const char * mempool_name;
+   char ** mempool_hwm;   /* persistent high water mark (NVM pools only) */
+
+   mempoolSource *  mempool_source;  /* NULL: the pool cannot grow */
+   mempoolSegment * volatile mempool_segs;  /* the current segment first */
+   long long        mempool_total;   /* the size of all the segments */
+
+   /* the pools of the same kind, which may take chunks and free nodes */
+   mempool *        mempool_peers;
+   int              mempool_num_peers;
+   int              mempool_id;
+   int              mempool_group;   /* NUMA node or NVM file of the pool */
+   char * volatile  mempool_donated; /* a batch of free nodes for the peers */
+
+   mempoolBitmap *  mempool_bitmap;  /* NULL: allocations are not recorded */
+
+   /* retired nodes waiting for a grace period, by epoch % EBR_LIMBO_NUM */
+   char * mempool_limbo[EBR_LIMBO_NUM];
+   char * mempool_limbo_tail[EBR_LIMBO_NUM];
+   long long mempool_limbo_num[EBR_LIMBO_NUM];
+   unsigned long long mempool_limbo_epoch[EBR_LIMBO_NUM];
+   int    mempool_retired;   /* since the last advance attempt */
 
  public:
    // ---
@@ -85,14 +447,40 @@ class mempool {
    * constructor to set all internal states to null
    */
    mempool ()
-   {mempool_start = mempool_cur = mempool_end = NULL;
+   {mempool_cur = mempool_end = NULL;
     mempool_free_node = NULL;
+    mempool_free_num = 0;
+    mempool_hwm = NULL;
+    mempool_source = NULL;
+    mempool_segs = NULL;
+    mempool_total = 0;
+    mempool_peers = NULL;
+    mempool_num_peers = 0;
+    mempool_id = 0;
+    mempool_donated = NULL;
+    mempool_bitmap = NULL;
+    init_limbo ();
+   }
+
+   void init_limbo ()
+   {for (int i=0; i<EBR_LIMBO_NUM; i++) {
+       mempool_limbo[i]= mempool_limbo_tail[i]= NULL;
+       mempool_limbo_num[i]= 0;
+       mempool_limbo_epoch[i]= 0;
+    }
+    mempool_retired= 0;
    }
 
   /**
-   * destructor does nothing
+   * destructor frees the chain of segments (but not their memory)
    */
-   ~mempool () {}
+   ~mempool ()
+   {while (mempool_segs) {
+       mempoolSegment *s= mempool_segs;
+       mempool_segs= s->next;
+       delete s;
+    }
+   }
 
   /**
    * initialize the memory pool.
@@ -105,19 +493,103 @@ class mempool {
    {
       mempool_align = align;
       mempool_size = size;
-      mempool_start = start;
 
-      mempool_cur = mempool_start;
-      mempool_end = mempool_start + size;
+      mempoolSegment *seg= new mempoolSegment;
+      seg->start= start;
+      seg->size= size;
+      seg->claimed= 0;
+      seg->extension= 0;
+      seg->next= NULL;
+      mempool_segs= seg;
+      mempool_total= size;
+
+      mempool_cur = mempool_end = start;  // no chunk yet
       mempool_free_node = NULL;
+      mempool_free_num = 0;
+      init_limbo ();
 
       mempool_name= name;
+      mempool_hwm= NULL;
+      mempool_source= NULL;
+      mempool_peers= NULL;
+      mempool_num_peers= 0;
+      mempool_id= 0;
+      mempool_group= 0;
+      mempool_donated= NULL;
+      mempool_bitmap= NULL;
    }
 
+  /**
+   * let the pool grow with segments from source
+   */
+   void set_source (mempoolSource *source) {mempool_source= source;}
+
+  /**
+   * let the pool take chunks and free nodes from peers[0..num-1] when it
+   * runs dry.  The pool itself is peers[id].  Peers in the same group are
+   * preferred, and free nodes are only taken from them.
+   */
+   void set_peers (mempool *peers, int num, int id, int group)
+   {mempool_peers= peers; mempool_num_peers= num; mempool_id= id;
+    mempool_group= group;}
+
+   int get_id () {return mempool_id;}
+
+   const char * get_name () {return mempool_name;}
+
+  /**
+   * record the allocations of the pool in bitmap
+   */
+   void set_bitmap (mempoolBitmap *bitmap) {mempool_bitmap= bitmap;}
+
+  /**
+   * the segments of the pool, newest first
+   */
+   mempoolSegment * get_segments () {return mempool_segs;}
+
+  /**
+   * get a chunk for an allocation that does not fit in the current chunk:
+   * from the current segment, from the current segment of a peer in the
+   * same group, from a new segment, or from the current segment of a peer
+   * in another group
+   *
+   * @param size  the allocation size
+   * @return      false if the pool cannot grow
+   */
+   bool refill (unsigned long long size);
+
+  /**
+   * claim a chunk from the current segment of a pool (this or a peer)
+   */
+   bool claim (mempool *owner, unsigned long long size);
+
+  /**
+   * get a new segment and make it the current segment
+   */
+   bool grow (unsigned long long size);
+
+  /**
+   * move the persistent high water mark of the pool to end if it is in seg
+   */
+   void advance_hwm (mempoolSegment *seg, char *end);
+
+  /**
+   * keep a persistent high water mark for the memory pool
+   *
+   * @param hwm  the NVM location of the high water mark
+   * @param cur  the first unused address of the memory pool
+   */
+   void set_hwm (char **hwm, char *cur);
+
   /**
    * obtain the starting address of the memory pool
    */
-   char * get_base ()  {return mempool_start;}
+   char * get_base ()  {return mempool_segs->start;}
+
+  /**
+   * obtain the alignment of the memory pool
+   */
+   long long get_align ()  {return mempool_align;}
 
   /**
    * print all the parameters and addresses of the memory pool 
@@ -127,21 +599,35 @@ class mempool {
 	fprintf (fp, "%s\n", mempool_name);
 	fprintf (fp, "mempool_align=%lld\n", mempool_align);
 	fprintf (fp, "mempool_size=%lld\n", mempool_size);
-	fprintf (fp, "mempool_start=%p\n", mempool_start);
+	for (mempoolSegment *s= mempool_segs; s; s= s->next)
+	  fprintf (fp, "segment=%p size=%lld claimed=%lld\n",
+	           s->start, s->size, s->claimed);
 	fprintf (fp, "mempool_cur=%p\n", mempool_cur);
 	fprintf (fp, "mempool_end=%p\n", mempool_end);
+	fprintf (fp, "mempool_total=%lld\n", mempool_total);
+	if (mempool_hwm)
+	  fprintf (fp, "mempool_hwm=%p\n", *mempool_hwm);
 	fprintf (fp, "mempool_free_node=%p\n\n", mempool_free_node);
    }
 
    void print_usage ()
    {
-       long long  used= (mempool_cur - mempool_start);
+       // the chunks claimed by this pool and its peers
+       long long  used= 0;
+       for (mempoolSegment *s= mempool_segs; s; s= s->next)
+           used += ((s->claimed < s->size) ? s->claimed : s->size);
        long long  ff= 0;
        for(char *p = mempool_free_node; p; p= *((char **)p))
            ff ++;
+       long long  rr= 0;
+       for (int i=0; i<EBR_LIMBO_NUM; i++)
+         for(char *p = mempool_limbo[i]; p; p= *((char **)p))
+           rr ++;
 
-       printf("%s: total %.1lfMB, use %.1lfMB, among which %lld free nodes\n",
-               mempool_name, ((double)mempool_size)/MB, ((double)used)/MB, ff);
+       printf("%s: total %.1lfMB, use %.1lfMB, among which %lld free nodes, "
+              "%lld retired nodes\n",
+               mempool_name, ((double)mempool_total)/MB, ((double)used)/MB,
+               ff, rr);
    }
 
  public:
@@ -159,13 +645,34 @@ class mempool {
    * Make sure the size is aligned.  The code will not check this.
    */
    void * alloc (unsigned long long size)
+   {
+       char *p= alloc_space (size);
+       if (mempool_bitmap) mempool_bitmap->mark_alloc (p, size);
+       return (void *) p;
+   }
+
+  /**
+   * allocate space whose contents are not needed after a restart, such as
+   * a log buffer.  It is not marked in the allocation bitmap, so it becomes
+   * free space at recovery.
+   */
+   void * alloc_transient (unsigned long long size)
+   {
+       return (void *) alloc_space (size);
+   }
+
+  /**
+   * bump-allocate from the current chunk, and get a new chunk if necessary
+   */
+   char * alloc_space (unsigned long long size)
    {
        if (mempool_cur + size <= mempool_end) {
          register char *p;
          p = mempool_cur;
          mempool_cur += size;
-         return (void *) p;
+         return p;
        }
+       if (refill (size)) return alloc_space (size);
        fprintf (stderr, "%s alloc - run out of memory!\n", mempool_name);
        exit (1);
    }
@@ -189,15 +696,28 @@ class mempool {
    */
    void * alloc_node (int size)
    {
+	if (mempool_free_node == NULL) {
+	  reclaim (the_epochs.em_global);
+
+	  // the pool is dry: no free node, and no space in the current chunk
+	  // or the current segment
+	  if ((mempool_free_node == NULL) && (mempool_cur + size > mempool_end)
+	      && (mempool_segs->claimed + size > mempool_segs->size))
+	    steal_nodes ();
+	}
+
+	register char *p;
 	if (mempool_free_node) {
-	  register char *p;
 	  p = mempool_free_node;
 	  mempool_free_node = *((char **)p);
-	  return (void *) p;
+	  mempool_free_num --;
 	}
 	else {
-	  return alloc (size);
+	  p = alloc_space (size);
 	}
+
+	if (mempool_bitmap) mempool_bitmap->mark_node (this, p, size);
+	return (void *) p;
    }
 
   /**
@@ -206,9 +726,113 @@ class mempool {
    * @param p btree node to free
    */
    void free_node (void *p)
+   {
+	if (mempool_bitmap) mempool_bitmap->unmark_node ((char *)p);
+	put_free_node (p);
+   }
+
+  /**
+   * append an unused node into the free linked list
+   */
+   void put_free_node (void *p)
    {
 	*((char **)p) = mempool_free_node;
 	mempool_free_node = (char *)p;
+	mempool_free_num ++;
+
+	if ((mempool_free_num >= 2*MEMPOOL_BATCH_NUM) && (mempool_donated == NULL))
+	  donate_nodes ();
+   }
+
+  /**
+   * give MEMPOOL_BATCH_NUM free nodes to the peers.  Only the owner puts a
+   * batch in mempool_donated, and a peer takes it with an atomic exchange.
+   */
+   void donate_nodes (void)
+   {
+	char *head= mempool_free_node, *tail= head;
+	for (int i=1; i<MEMPOOL_BATCH_NUM; i++) tail= *((char **)tail);
+
+	mempool_free_node= *((char **)tail);
+	mempool_free_num -= MEMPOOL_BATCH_NUM;
+	*((char **)tail)= NULL;
+
+	asm volatile("" ::: "memory");
+	mempool_donated= head;
+   }
+
+  /**
+   * take a batch of free nodes donated by a peer in the same group
+   *
+   * @return true if a batch is appended into the free linked list
+   */
+   bool steal_nodes (void)
+   {
+	for (int k=1; k<mempool_num_peers; k++) {
+	  mempool *peer= &(mempool_peers[(mempool_id + k) % mempool_num_peers]);
+	  if (peer->mempool_group != mempool_group) continue;
+	  if (peer->mempool_donated == NULL) continue;
+
+	  char *head= __sync_lock_test_and_set(&(peer->mempool_donated),
+	                                       (char *)NULL);
+	  if (head == NULL) continue;
+
+	  char *tail= head;
+	  long long n= 1;
+	  while (*((char **)tail)) { tail= *((char **)tail); n++; }
+
+	  *((char **)tail)= mempool_free_node;
+	  mempool_free_node= head;
+	  mempool_free_num += n;
+	  return true;
+	}
+	return false;
+   }
+
+  /**
+   * retire a btree node that has been removed from the tree.  It is
+   * appended into the free linked list after a grace period.
+   *
+   * @param p btree node to retire
+   */
+   void retire_node (void *p)
+   {
+	// the node is no longer reachable after a restart
+	if (mempool_bitmap) mempool_bitmap->unmark_node ((char *)p);
+
+	unsigned long long e= the_epochs.em_global;
+	reclaim (e);
+
+	// the list of epoch e is empty or holds nodes of epoch e
+	int i= e % EBR_LIMBO_NUM;
+	*((char **)p) = mempool_limbo[i];
+	mempool_limbo[i] = (char *)p;
+	if (mempool_limbo_tail[i] == NULL) mempool_limbo_tail[i]= (char *)p;
+	mempool_limbo_num[i] ++;
+	mempool_limbo_epoch[i]= e;
+
+	if (++mempool_retired >= EBR_ADVANCE_STEP) {
+	  mempool_retired= 0;
+	  the_epochs.advance ();
+	}
+   }
+
+  /**
+   * move the retired nodes of epochs <= e-2 to the free linked list
+   *
+   * @param e  the global epoch
+   */
+   void reclaim (unsigned long long e)
+   {
+	for (int i=0; i<EBR_LIMBO_NUM; i++) {
+	  if (mempool_limbo[i] && (mempool_limbo_epoch[i] + 2 <= e)) {
+	    *((char **)mempool_limbo_tail[i]) = mempool_free_node;
+	    mempool_free_node = mempool_limbo[i];
+	    mempool_free_num += mempool_limbo_num[i];
+	    mempool_limbo[i] = mempool_limbo_tail[i] = NULL;
+	    mempool_limbo_num[i] = 0;
+	  }
+	}
    }
 
   /**
@@ -230,18 +854,164 @@ class mempool {
 
 /* -------------------------------------------------------------- */
 
+/**
+ * nvmValue: a variable-size value record in the NVM value heap
+ *
+ * A record is a slot of a value chunk.  The slots of a chunk have the same
+ * size: a power of two from 16B to 16KB (the size class of the chunk), or
+ * the whole chunk for VALUE_LARGE_CLASS.  The header locates the chunk of
+ * a record.  The data of a free record holds the free list pointer.
+ */
+typedef struct nvmValue {
+    unsigned int    len;      /* length of the value in bytes */
+    unsigned short  sclass;   /* the size class of the slot */
+    unsigned short  slot;     /* the slot in its chunk */
+    char            data[0];
+} nvmValue;
+
+#define VALUE_MIN_CLASS     4                     /* 16B slots */
+#define VALUE_LARGE_CLASS   15                    /* a slot per chunk */
+#define VALUE_CHUNK_SIZE    (64*1024)
+#define VALUE_CHUNK_HEADER  1024
+#define VALUE_CHUNK_PAYLOAD (VALUE_CHUNK_SIZE - VALUE_CHUNK_HEADER)
+#define VALUE_MAX_LEN       ((int)(VALUE_CHUNK_PAYLOAD - sizeof(nvmValue)))
+#define VALUE_CHUNK_MAGIC   0x4b4e484345554c41ULL  /* "ALUECHNK" */
+
+#define VALUE_SLOT_SIZE(c)  \
+   ((c) < VALUE_LARGE_CLASS ? (1<<(c)) : VALUE_CHUNK_PAYLOAD)
+#define VALUE_BITMAP_WORDS  \
+   ((VALUE_CHUNK_PAYLOAD/(1<<VALUE_MIN_CLASS) + 63) / 64)
+
+/**
+ * valueChunk: the persistent header of a chunk of value records
+ *
+ * The chunks are on a persistent list that starts at the pool header.  A
+ * chunk is linked after its header is persistent, and the lines of the
+ * chunk are marked in the allocation bitmap after it is linked, so that a
+ * crash leaves no chunk that is marked but not on the list.  The bitmap
+ * has a bit per slot, which is set while the record is in use.
+ */
+typedef struct valueChunk {
+    unsigned long long  magic;
+    struct valueChunk * next;
+    unsigned int        sclass;
+    unsigned int        num;      /* the number of slots */
+    unsigned long long  bitmap[VALUE_BITMAP_WORDS];
+} valueChunk;
+
+class threadNVMPools;
+
+/**
+ * valueHeap: allocate value records for a worker
+ *
+ * The heap takes value chunks from the worker's NVM mempool, and keeps the
+ * free records of every size class on a DRAM free list.  alloc sets the
+ * bit of the record and flushes it, and the caller persists the record
+ * with an sfence before publishing it.  A record that is removed from the
+ * tree is retired: its bit is cleared at once, so a clean shutdown leaves
+ * exact bitmaps, but it goes to the free list only after a grace period of
+ * epochManager, because concurrent gets may still copy it.  The retired
+ * records wait in DRAM arrays, so their data is not overwritten.
+ *
+ * After a crash, the tree rebuilds the bitmaps from the records that its
+ * leaves point to (see threadNVMPools::recover_value).  Then
+ * threadNVMPools::rebuild_free_lists releases the empty chunks and gives
+ * the free records of the others to the heaps.
+ */
+class valueHeap {
+ private:
+   threadNVMPools * vh_nvm;
+   mempool *        vh_pool;
+   nvmValue *       vh_free[VALUE_LARGE_CLASS+1];
+
+   /* retired records waiting for a grace period, by epoch % EBR_LIMBO_NUM */
+   nvmValue **         vh_limbo[EBR_LIMBO_NUM];
+   int                 vh_limbo_num[EBR_LIMBO_NUM];
+   int                 vh_limbo_cap[EBR_LIMBO_NUM];
+   unsigned long long  vh_limbo_epoch[EBR_LIMBO_NUM];
+   int                 vh_retired;   /* since the last advance attempt */
+
+   static nvmValue * & nextFree (nvmValue *v)
+   { return *((nvmValue **)(v->data)); }
+
+   void put_free (nvmValue *v)
+   {
+       nextFree(v)= vh_free[v->sclass];
+       vh_free[v->sclass]= v;
+   }
+
+   void reclaim (unsigned long long e);
+
+ public:
+   valueHeap ()
+   {vh_nvm= NULL; vh_pool= NULL;
+    for (int c=0; c<=VALUE_LARGE_CLASS; c++) vh_free[c]= NULL;
+    for (int i=0; i<EBR_LIMBO_NUM; i++) {
+       vh_limbo[i]= NULL; vh_limbo_num[i]= vh_limbo_cap[i]= 0;
+       vh_limbo_epoch[i]= 0;
+    }
+    vh_retired= 0;
+   }
+
+   ~valueHeap ()
+   {for (int i=0; i<EBR_LIMBO_NUM; i++) if (vh_limbo[i]) ::free(vh_limbo[i]);}
+
+   void init (threadNVMPools *nvm, mempool *pool) {vh_nvm= nvm; vh_pool= pool;}
+
+  /**
+   * the chunk of a record
+   */
+   static valueChunk * chunkOf (nvmValue *v)
+   {
+       return (valueChunk *)((char *)v - VALUE_CHUNK_HEADER
+                             - (long long)(v->slot) * VALUE_SLOT_SIZE(v->sclass));
+   }
+
+  /**
+   * set or clear the bit of a record and flush it
+   */
+   static void mark (nvmValue *v, bool used);
+
+  /**
+   * allocate a record for a value
+   *
+   * @param len  the length of the value (0 .. VALUE_MAX_LEN)
+   * @return     the record with len, sclass, and slot set
+   */
+   nvmValue * alloc (int len);
+
+  /**
+   * free a record that has never been published
+   */
+   void free (nvmValue *v);
+
+  /**
+   * retire a record that has been removed from the tree
+   */
+   void retire (nvmValue *v);
+
+  /**
+   * put the free slots of a chunk into the free list
+   */
+   void add_chunk (valueChunk *ch);
+
+}; // valueHeap
+
+/* -------------------------------------------------------------- */
+
 /**
  * threadMemPools allocates a pool of memory from OS.  It divides the
  * memory into num workers's sub pools.  Then it uses mempool to manage
  * the sub pool.
  */
-class threadMemPools {
+class threadMemPools: public mempoolSource {
  public:
     mempool  *tm_pools;       /* pools[0..num_workers-1] */
     int       tm_num_workers;
 
     char *    tm_buf;         /* start address of allocated memory */
     long long tm_size;        /* tm_buf size */
+    int       tm_page;        /* MEMPOOL_PAGE_* */
 
  public:
    /** 
@@ -250,23 +1020,14 @@ class threadMemPools {
     threadMemPools()
     {tm_pools= NULL; tm_num_workers= 0;
      tm_buf= NULL;   tm_size= 0;
+     tm_page= MEMPOOL_PAGE_4KB;
     }
 
    /**
     * Destructor frees memory if exists.
     */
-    ~threadMemPools()
-    {if(tm_buf) {
-         free(tm_buf);
-         tm_buf= NULL;
-     }
-     if(tm_pools) {
-         delete[] tm_pools;
-         tm_pools= NULL;
-     }
-    }
+    ~threadMemPools();
 
-    
   /**
    * Initialize the memory pools
    * allocate memory from OS and initialize all per-worker mempool.
@@ -274,8 +1035,15 @@ class threadMemPools {
    * @param num_workers  number of parallel worker threads 
    * @param size         the total memory pool size in bytes
    * @param align        alignment in bytes
+   * @param page         MEMPOOL_PAGE_4KB, _THP, _2MB, or _1GB
    */
-   void init (int num_workers, long long size=20*MB, long long align=4096);
+   void init (int num_workers, long long size=20*MB, long long align=4096,
+              int page=MEMPOOL_PAGE_4KB);
+
+  /**
+   * allocate a DRAM segment when a pool runs out of space
+   */
+   char * new_segment (mempool *pool, long long size);
 
   /**
    * print information about memory pool for debugging purpose.
@@ -295,7 +1063,7 @@ class threadMemPools {
  * threadNVMPools allocates a contiguous region of NVM then divides it
  * among threads' individual mempools.
  */
-class threadNVMPools {
+class threadNVMPools: public mempoolSource, public mempoolBitmap {
  public:
     mempool     *tm_pools;       /* pools[0..num_workers-1] */
     int          tm_num_workers;
@@ -304,6 +1072,22 @@ class threadNVMPools {
     long long    tm_size;        /* tm_buf size */
 
     const char * tn_nvm_file;
+    int          tn_backend;     /* NVM_BACKEND_* */
+    nvmPoolHeader * tn_header;   /* the first 8KB of tm_buf */
+    int *        tn_worker_file; /* the file of every pool */
+
+    valueHeap *  tn_value_heaps; /* value heaps[0..num_workers-1] */
+
+    volatile int tn_seg_lock;    /* protects the segment table in the header */
+    volatile int tn_value_lock;  /* protects the list of value chunks */
+
+    /* recovery: the pending nodes and the used range of every pool */
+    char **      tn_pending;
+    int          tn_num_pending;
+    char **      tn_used_end;
+    long long    tn_old_segments;
+    valueChunk **tn_value_chunks;  /* sorted, while the values are recovered */
+    long long    tn_num_value_chunks;
 
  public:
   /**
@@ -313,6 +1097,15 @@ class threadNVMPools {
    {tm_pools= NULL; tm_num_workers= 0;
     tm_buf= NULL;   tm_size= 0;
     tn_nvm_file=NULL;
+    tn_backend= NVM_BACKEND_PMEM;
+    tn_header= NULL;
+    tn_worker_file= NULL;
+    tn_value_heaps= NULL;
+    tn_seg_lock= 0;
+    tn_value_lock= 0;
+    tn_pending= NULL; tn_num_pending= 0;
+    tn_used_end= NULL; tn_old_segments= 0;
+    tn_value_chunks= NULL; tn_num_value_chunks= 0;
    }
 
   /**
@@ -325,10 +1118,129 @@ class threadNVMPools {
    * allocate NVM and initialize all per-worker mempool.
    *
    * @param num_workers  number of parallel worker threads 
-   * @param num_file     the nvm file name to map
+   * @param nvm_file     the nvm file name to map, or "<file0>,<file1>,..."
+   *                     to map a file per NUMA node
    * @param size         the total memory pool size in bytes, must be multiple of 4KB
+   * @param recover      open an existing pool instead of creating a new one
+   * @param page         MEMPOOL_PAGE_4KB, or huge pages to make the pools
+   *                     multiples of 2MB
+   * @param backend      NVM_BACKEND_PMEM, _FILE, or _DRAM
+   *
+   * When recover is true, the file must have been created by init with the
+   * same size, and must be mapped at the same address (see PMEM_MMAP_HINT;
+   * NVM_BACKEND_FILE maps it at the recorded address).  NVM_BACKEND_DRAM
+   * cannot recover.
+   * The pool contents are preserved.  num_workers can be different.
+   * Only the first file needs to be given, the header records the others.
+   */
+   void init (int num_workers, const char * nvm_file, long long size=20*MB,
+              bool recover=false, int page=MEMPOOL_PAGE_4KB,
+              int backend=NVM_BACKEND_PMEM);
+
+  /**
+   * the end of the header and the allocation bitmap of file f
+   */
+   char * meta_end (int f);
+
+  /**
+   * get the root page of the tree
+   *
+   * The root page is allocated from worker 0's pool when it is first
+   * requested on a new pool.  On a recovered pool, the same page is returned.
+   *
+   * @param size  the size of the root page
+   */
+   char * get_root (long long size);
+
+  /**
+   * map the file of a new extension segment when a pool runs out of space
+   */
+   char * new_segment (mempool *pool, long long size);
+
+  /**
+   * an extension segment starts with its allocation bitmap
+   */
+   long long reserved_size (long long size) {return NVMPOOL_BITMAP_SIZE(size);}
+
+  /**
+   * set the size of the nodes from alloc_node.  A tree calls this before
+   * freeing nodes.
+   */
+   void set_node_size (long long size);
+
+  /**
+   * find the allocation bitmap that covers p and the line index of p
+   */
+   unsigned long long * find_bitmap (char *p, long long *line);
+
+  /**
+   * set or clear the allocation bits of the lines of [p, p+size)
    */
-   void init (int num_workers, const char * nvm_file, long long size=20*MB);
+   void set_bits (char *p, long long size, bool used);
+
+   void mark_alloc (char *p, long long size);
+   void mark_node (mempool *pool, char *p, long long size);
+   void unmark_node (char *p);
+
+  /**
+   * get the pending nodes of a recovered pool.  A pending node that is not
+   * reachable was not published, and must be released before the free
+   * lists are rebuilt.
+   *
+   * @param nodes  the returned nodes, at most NVMPOOL_MAX_WORKERS
+   * @return       the number of nodes
+   */
+   int get_pending (char *nodes[]);
+
+  /**
+   * mark an unreachable node of a recovered pool as free
+   */
+   void release_node (char *p) {unmark_node(p);}
+
+  /**
+   * mark [p, p+size) as free and make the marks persistent.  The space is
+   * reused after restart.
+   */
+   void free_region (char *p, long long size);
+
+  /**
+   * put the nodes in a region that free_region has freed into the free list
+   * of pool, so that it is reused without a restart
+   */
+   void put_free_region (mempool *pool, char *p, long long size);
+
+  /**
+   * allocate a value chunk from pool, and link it to the list of chunks
+   *
+   * @param sclass  the size class of its slots
+   */
+   valueChunk * new_value_chunk (mempool *pool, int sclass);
+
+  /**
+   * rebuild the bitmaps of the value chunks after a crash: clear them,
+   * call recover_value for every record that the tree points to, then
+   * end_value_recovery makes them persistent.
+   *
+   * @return false if there is no value chunk
+   */
+   bool begin_value_recovery (void);
+   void recover_value (void *p);
+   void end_value_recovery (void);
+
+  /**
+   * the number of records in use
+   */
+   long long count_values (void);
+
+  /**
+   * turn the unused lines of a recovered pool into free nodes
+   *
+   * The pools scan their used ranges in parallel.  The unused part of an
+   * extension segment is given to the pools in turn.  Before that, the
+   * empty value chunks are released, and the free records of the other
+   * chunks are given to the value heaps in turn.
+   */
+   void rebuild_free_lists (void);
 
    void print(void);
 
@@ -344,7 +1256,6 @@ class threadNVMPools {
  * (2) In each thread that wants to use the mempool,
  *     set worker_id 
  */
-extern thread_local int worker_id;  /* in Thread Local Storage */
 
 extern threadMemPools   the_thread_mempools;
 extern threadNVMPools   the_thread_nvmpools;
@@ -354,12 +1265,20 @@ extern threadNVMPools   the_thread_nvmpools;
 #define mempool_free        the_mempool.free
 #define mempool_alloc_node  the_mempool.alloc_node
 #define mempool_free_node   the_mempool.free_node
+#define mempool_retire_node the_mempool.retire_node
 
 #define the_nvmpool        (the_thread_nvmpools.tm_pools[worker_id])
 #define nvmpool_alloc       the_nvmpool.alloc
+#define nvmpool_alloc_transient the_nvmpool.alloc_transient
 #define nvmpool_free        the_nvmpool.free
 #define nvmpool_alloc_node  the_nvmpool.alloc_node
 #define nvmpool_free_node   the_nvmpool.free_node
+#define nvmpool_retire_node the_nvmpool.retire_node
+
+#define the_value_heap     (the_thread_nvmpools.tn_value_heaps[worker_id])
+#define nvmvalue_alloc      the_value_heap.alloc
+#define nvmvalue_free       the_value_heap.free
+#define nvmvalue_retire     the_value_heap.retire
 
 /* -------------------------------------------------------------- */
 #endif /* _BTREE_MEM_POOL_H */
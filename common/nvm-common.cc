@@ -12,8 +12,86 @@
  * initliaze per-worker log
  */
 
+#include <sys/mman.h>
+#include <time.h>
 #include "nvm-common.h"
 
+bool nvm_flush_msync= false;
+
+/* -------------------------------------------------------------- */
+// the pages that clwb recorded for the next sfence, as page ranges
+
+#define NVM_MSYNC_RANGES  16
+
+static thread_local struct {
+    unsigned long long start, end;
+} msync_range[NVM_MSYNC_RANGES];
+static thread_local int msync_num= 0;
+
+void nvmMsyncRecord(void *addr)
+{
+    unsigned long long page= ((unsigned long long)addr) & ~4095ULL;
+    for (int i=msync_num-1; i>=0; i--) {
+       if (page >= msync_range[i].start && page < msync_range[i].end) return;
+       if (page == msync_range[i].end) {msync_range[i].end += 4096; return;}
+    }
+    if (msync_num == NVM_MSYNC_RANGES) nvmMsyncDrain();
+    msync_range[msync_num].start= page;
+    msync_range[msync_num].end= page + 4096;
+    msync_num ++;
+}
+
+void nvmMsyncDrain(void)
+{
+    for (int i=0; i<msync_num; i++) {
+       msync((void *)msync_range[i].start,
+             msync_range[i].end - msync_range[i].start, MS_SYNC);
+    }
+    msync_num= 0;
+}
+
+/* -------------------------------------------------------------- */
+
+unsigned long long nvm_emu_wb_cycles= 0;
+unsigned long long nvm_emu_fence_cycles= 0;
+unsigned long long nvm_emu_read_cycles= 0;
+
+static double nvm_emu_cycles_per_ns= 0;
+
+/**
+ * set the emulated NVM latencies
+ *
+ * The TSC rate is calibrated against CLOCK_MONOTONIC at the first call.
+ *
+ * @param wb_ns     write back latency per line in clwb
+ * @param fence_ns  drain cost of every sfence
+ * @param read_ns   read penalty at the first touch of a leaf
+ */
+void nvmEmuInit(int wb_ns, int fence_ns, int read_ns)
+{
+    if (nvm_emu_cycles_per_ns == 0) {
+      struct timespec t0, t1;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      unsigned long long c0= __builtin_ia32_rdtsc();
+      do {
+         clock_gettime(CLOCK_MONOTONIC, &t1);
+      } while ((t1.tv_sec-t0.tv_sec)*1000000000LL
+               + (t1.tv_nsec-t0.tv_nsec) < 20000000LL);   // 20ms
+      unsigned long long c1= __builtin_ia32_rdtsc();
+      nvm_emu_cycles_per_ns= (double)(c1 - c0) /
+                 ((t1.tv_sec-t0.tv_sec)*1000000000LL + (t1.tv_nsec-t0.tv_nsec));
+    }
+
+    nvm_emu_wb_cycles= (unsigned long long)(wb_ns * nvm_emu_cycles_per_ns);
+    nvm_emu_fence_cycles= (unsigned long long)(fence_ns * nvm_emu_cycles_per_ns);
+    nvm_emu_read_cycles= (unsigned long long)(read_ns * nvm_emu_cycles_per_ns);
+
+    printf("nvmemu: wb=%dns fence=%dns read=%dns (%.2f cycles/ns)\n",
+           wb_ns, fence_ns, read_ns, nvm_emu_cycles_per_ns);
+}
+
+/* -------------------------------------------------------------- */
+
 NvmLog *the_nvm_logs;
 
 void nvmLogInit(int num_workers)
@@ -44,6 +44,54 @@
 #endif
 
 
+/* -------------------------------------------------------------- */
+// NVM_BACKEND_FILE (see threadNVMPools::init) sets nvm_flush_msync.
+// Then clwb records the page of the line, and sfence msyncs the recorded
+// pages of the calling thread.
+
+extern bool nvm_flush_msync;
+
+void nvmMsyncRecord(void *addr);
+void nvmMsyncDrain(void);
+
+/* -------------------------------------------------------------- */
+// NVM latency emulation on DRAM (see nvmEmuInit), off if all are 0.
+// clwb spins nvm_emu_wb_cycles per line, sfence spins
+// nvm_emu_fence_cycles, and LEAF_PREF_NVM spins nvm_emu_read_cycles
+// at the first touch of a leaf in an operation.
+
+extern unsigned long long nvm_emu_wb_cycles;
+extern unsigned long long nvm_emu_fence_cycles;
+extern unsigned long long nvm_emu_read_cycles;
+
+void nvmEmuInit(int wb_ns, int fence_ns, int read_ns);
+
+/**
+ * busy wait for the given number of TSC cycles
+ *
+ * No pause: it may abort RTM, and the leaf read spins run in transactions.
+ */
+static inline
+void nvmEmuSpin(unsigned long long cycles)
+{
+  unsigned long long end= __builtin_ia32_rdtsc() + cycles;
+  while (__builtin_ia32_rdtsc() < end)
+    ;
+}
+
+/**
+ * prefetch an NVM leaf that an operation touches for the first time
+ *
+ * @param leaf  the leaf node
+ */
+static inline
+void LEAF_PREF_NVM(void *leaf)
+{
+  LEAF_PREF(leaf);
+  if (__builtin_expect(nvm_emu_read_cycles != 0, 0))
+    nvmEmuSpin(nvm_emu_read_cycles);
+}
+
 /* -------------------------------------------------------------- */
 #if   defined(NVMFLUSH_REAL)
 /* -------------------------------------------------------------- */
@@ -56,7 +104,12 @@
  */
 static inline
 void clwb(void * addr)
-{ asm volatile("clwb %0": :"m"(*((char *)addr))); } 
+{
+  if (__builtin_expect(nvm_flush_msync, 0)) {nvmMsyncRecord(addr); return;}
+  asm volatile("clwb %0": :"m"(*((char *)addr)));
+  if (__builtin_expect(nvm_emu_wb_cycles != 0, 0))
+    nvmEmuSpin(nvm_emu_wb_cycles);
+}
 
 /**
  * flush [start, end]
@@ -93,7 +146,12 @@ void clwbmore(void *start, void *end)
  */
 static inline
 void sfence(void)
-{ asm volatile("sfence"); }
+{
+  asm volatile("sfence");
+  if (__builtin_expect(nvm_flush_msync, 0)) nvmMsyncDrain();
+  if (__builtin_expect(nvm_emu_fence_cycles != 0, 0))
+    nvmEmuSpin(nvm_emu_fence_cycles);
+}
 
 /* -------------------------------------------------------------- */
 #elif defined(NVMFLUSH_STAT)
@@ -279,7 +337,8 @@ class NvmLog_Log {
     void initLog()
     {
       // 1. allocate log buffer from NVM
-      nl_log_area_= (char *) nvmpool_alloc(NVM_LOG_SIZE);
+      //    (a new log buffer is allocated after restart)
+      nl_log_area_= (char *) nvmpool_alloc_transient(NVM_LOG_SIZE);
 
       if (!isaligned_atline(nl_log_area_)) {
         fprintf(stderr, "NvmLog error: log area is not aligned!\n");
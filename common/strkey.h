@@ -0,0 +1,208 @@
+/**
+ * @file strkey.h
+ * @author  Shimin Chen <shimin.chen@gmail.com>, Jihang Liu, Leying Chen
+ * @version 1.0
+ *
+ * @section LICENSE
+ *
+ * TBD
+ *
+ * @section DESCRIPTION
+ *
+ * strKey defines variable-length string keys (e.g. URLs).
+ *
+ * A string key is an 8B pointer to a key blob: a 4B length followed by
+ * the bytes of the key.  Keys are compared with memcmp, and a key that is
+ * a prefix of another key is smaller.  The tree stores the pointers in
+ * its nodes, and copies a key blob when it stores the key.
+ */
+
+#ifndef _BTREE_STRKEY_H
+#define _BTREE_STRKEY_H
+/* ---------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+/* ---------------------------------------------------------------------- */
+
+// the maximum length of a key
+#define STR_KEY_MAX_LEN     1024
+
+// the size of a key blob of len bytes (8B aligned)
+#define strKeyBlobSize(len) ((sizeof(unsigned int) + (len) + 7) & ~7UL)
+
+struct strKey {
+    const unsigned char * p;   /* the key blob */
+
+    unsigned int len(void) const { return *(const unsigned int *)p; }
+    const unsigned char * data(void) const { return p + sizeof(unsigned int); }
+
+    // the empty key is the min key.  The max key is longer than any key
+    // and consists of 0xff bytes.
+    static strKey minKey(void)
+    {
+        static const unsigned int blob[2]= {0, 0};
+        strKey k; k.p= (const unsigned char *)blob;
+        return k;
+    }
+
+    static strKey maxKey(void)
+    {
+        static unsigned int blob[strKeyBlobSize(STR_KEY_MAX_LEN+1)/4];
+        static bool done= false;
+        if (!done) {
+            memset(blob, 0xff, sizeof(blob));
+            blob[0]= STR_KEY_MAX_LEN+1;
+            done= true;
+        }
+        strKey k; k.p= (const unsigned char *)blob;
+        return k;
+    }
+
+    // compare: <0, 0, >0
+    int cmp(const strKey &o) const
+    {
+        unsigned int l1= len(), l2= o.len();
+        int r= memcmp(data(), o.data(), ((l1 < l2) ? l1 : l2));
+        if (r != 0) return r;
+        return ((l1 < l2) ? -1 : ((l1 > l2) ? 1 : 0));
+    }
+
+    bool operator== (const strKey &o) const
+    {
+        if (p == o.p) return true;
+        return (len() == o.len()) && (memcmp(data(), o.data(), len()) == 0);
+    }
+    bool operator!= (const strKey &o) const { return !(*this == o); }
+    bool operator<  (const strKey &o) const { return cmp(o) < 0; }
+    bool operator<= (const strKey &o) const { return cmp(o) <= 0; }
+    bool operator>  (const strKey &o) const { return cmp(o) > 0; }
+    bool operator>= (const strKey &o) const { return cmp(o) >= 0; }
+
+}; // strKey
+
+/**
+ * write a key blob
+ *
+ * @param mem  the memory of strKeyBlobSize(len) bytes for the blob
+ * @param s    the bytes of the key
+ * @param len  the length of the key
+ * @return     the key
+ */
+static inline strKey strKeyWrite(void *mem, const void *s, unsigned int len)
+{
+    assert(len <= STR_KEY_MAX_LEN);
+    *(unsigned int *)mem= len;
+    memcpy((char *)mem + sizeof(unsigned int), s, len);
+
+    strKey k; k.p= (const unsigned char *)mem;
+    return k;
+}
+
+/**
+ * the length of the shortest prefix of right that is larger than left
+ *
+ * The prefix is a separator s with left < s <= right (left < right).
+ */
+static inline unsigned int strKeySeparatorLen(const strKey &left,
+                                              const strKey &right)
+{
+    unsigned int l1= left.len(), l2= right.len();
+    unsigned int l= 0;
+    while (l < l1 && l < l2 && left.data()[l] == right.data()[l]) l++;
+    return ((l < l2) ? l+1 : l2);
+}
+
+/**
+ * allocate memory for key blobs in DRAM (from per-thread chunks that are
+ * never freed)
+ *
+ * @param size  the size of the blob (8B aligned, < STR_KEY_CHUNK_SIZE)
+ */
+#define STR_KEY_CHUNK_SIZE  (1024*1024)
+
+static inline void * strKeyAlloc(unsigned long size)
+{
+    static thread_local char *cur= NULL, *end= NULL;
+    if (end - cur < (long)size) {
+        cur= (char *)malloc(STR_KEY_CHUNK_SIZE);
+        if (!cur) {perror("malloc"); exit(1);}
+        end= cur + STR_KEY_CHUNK_SIZE;
+    }
+    void *p= cur;
+    cur += size;
+    return p;
+}
+
+/**
+ * map an 8B integer x >= 0 to a string key, preserving the key order
+ *
+ * The driver programs generate 8B keys.  The string is "key:", a letter
+ * for the number of hex digits, then the hex digits of x, so the keys
+ * share a prefix and have different lengths.
+ *
+ * @param buf  the memory for the blob (STR_KEY_BUF_SIZE bytes)
+ */
+#define STR_KEY_BUF_SIZE    strKeyBlobSize(24)
+
+static inline strKey strKeyFromInt(long long x, void *buf)
+{
+    char s[32];
+    int n= sprintf(s+5, "%llx", (unsigned long long)x);
+    memcpy(s, "key:", 4);
+    s[4]= 'a' + n;
+    return strKeyWrite(buf, s, 5+n);
+}
+
+// the record pointer of a key generated by strKeyFromInt in tests
+static inline void * strKeyToPtr(const strKey &k)
+{
+    unsigned long long x= 0;
+    for (unsigned int i=5; i<k.len(); i++) {
+        unsigned char c= k.data()[i];
+        x= (x << 4) | ((c <= '9') ? (c - '0') : (c - 'a' + 10));
+    }
+    return (void *)x;
+}
+
+// the smallest key that is larger than k (in a per-thread buffer that is
+// overwritten by the next call)
+static inline strKey strKeyNext(const strKey &k)
+{
+    static thread_local unsigned int buf[strKeyBlobSize(STR_KEY_MAX_LEN+1)/4];
+    strKey n= strKeyWrite(buf, k.data(), k.len());
+    ((unsigned char *)buf)[sizeof(unsigned int) + k.len()]= 0;
+    buf[0]= k.len() + 1;
+    return n;
+}
+
+// 1B fingerprint: FNV-1a of the bytes, folded to 1B
+static inline unsigned char strKeyHash1B(const strKey &k)
+{
+    unsigned long long h= 0xcbf29ce484222325ULL;
+    for (unsigned int i=0; i<k.len(); i++)
+        h= (h ^ k.data()[i]) * 0x100000001b3ULL;
+    h ^= h>>32;
+    h ^= h>>16;
+    h ^= h>>8;
+    return (unsigned char)(h&0x0ffULL);
+}
+
+// print a key, truncated to size-1 characters
+static inline const char * strKeyToStr(const strKey &k, char *buf, int size)
+{
+    int n= ((k.len() < (unsigned int)size) ? k.len() : size-4);
+    for (int i=0; i<n; i++) {
+        unsigned char c= k.data()[i];
+        buf[i]= ((c >= 0x20 && c < 0x7f) ? c : '?');
+    }
+    if (n < (int)k.len()) strcpy(buf+n, "...");
+    else buf[n]= 0;
+    return buf;
+}
+
+/* ---------------------------------------------------------------------- */
+#endif /* _BTREE_STRKEY_H */
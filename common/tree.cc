@@ -12,6 +12,7 @@
  * This file contains the main driver for experiments.
  */
    
+#include <cpuid.h>
 #include "tree.h"
 
 /* ------------------------------------------------------------------------ */
@@ -21,6 +22,8 @@ tree *       the_treep= NULL;
 int          worker_thread_num= 0;
 const char * nvm_file_name= NULL;
 bool         debug_test= false;
+int          cc_mode= (rtmSupported() ? CC_RTM : CC_OLC);
+int          page_mode= MEMPOOL_PAGE_4KB;
 
 #ifdef INSTRUMENT_INSERTION
 int insert_total;	// insert_total=
@@ -35,29 +38,59 @@ NVMFLUSH_STAT_DEFS;
 #endif
 
 /* ------------------------------------------------------------------------ */
-/*               get keys from a key file of int keys                       */
+/*               check RTM support                                          */
 /* ------------------------------------------------------------------------ */
-static Int64 * getKeys (char *filename, Int64 num)
+bool rtmSupported(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+
+    // ebx bit 11: RTM, edx bit 11: RTM_ALWAYS_ABORT (TSX disabled)
+    return ((ebx & (1<<11)) != 0) && ((edx & (1<<11)) == 0);
+}
+
+static const char * cc_mode_name[]= {"rtm", "lock", "olc"};
+static const char * page_mode_name[]= {"4kb", "thp", "2mb", "1gb"};
+static const char * placement_name[]= {"none", "compact", "scatter"};
+static const char * backend_name[]= {"pmem", "file", "dram"};
+
+/* ------------------------------------------------------------------------ */
+/*               get keys from a key file of key_file_type records          */
+/* ------------------------------------------------------------------------ */
+static key_type * getKeys (char *filename, Int64 num)
 {
     int fd;
-    Int64 *p;
+    key_file_type *p;
    fd = open (filename, 0, 0600);
    if (fd == -1) {
      perror (filename); exit(1);
    }
 
-   p = (Int64 *) malloc ((num+1) * sizeof(Int64));	
+   p = (key_file_type *) malloc ((num+1) * sizeof(key_file_type));	
    if (p == NULL) {
      printf ("malloc error\n"); exit (1);
    }
    // we allocate one more element at the end so that key[num] does not
    // cause segfault.  This simplifies our program in main()
 
-   if (read (fd, p, num*sizeof(Int64)) != num * sizeof(Int64))
+   if (read (fd, p, num*sizeof(key_file_type)) != num * sizeof(key_file_type))
      {perror ("read"); exit (1);}
 
    close (fd);
+
+#ifdef KEY_STRING
+   // map the records to string keys
+   key_type *keys = (key_type *) malloc ((num+1) * sizeof(key_type));
+   if (keys == NULL) {
+     printf ("malloc error\n"); exit (1);
+   }
+   for (Int64 i=0; i<num; i++) keys[i]= fileKey(p[i]);
+   keys[num]= MAX_KEY;
+   free (p);
+   return keys;
+#else
    return p;
+#endif
 }
 
 /* ------------------------------------------------------------------------ */
@@ -71,16 +104,50 @@ static void usage (char *cmd)
         "[Initialization]\n"
         " thread must be the first command, followed by mempool and nvmpool.\n\n"
         "   thread  <worker_thread_num>\n"
+        "   pin <none|compact|scatter>\n"
+        "     (pin the worker threads to CPUs, must precede mempool: fill the\n"
+        "      NUMA nodes one by one, or round robin; a DRAM pool is bound to\n"
+        "      the node of its worker)\n"
+        "   hugepage <4kb|thp|2mb|1gb>\n"
+        "     (pages of the pools, must precede mempool and nvmpool: DRAM pools\n"
+        "      use transparent huge pages, or hugetlbfs pages of 2MB or 1GB if\n"
+        "      they are reserved; NVM pools become multiples of 2MB)\n"
         "   mempool <size(MB)>\n"
-        "   nvmpool <filename> <size(MB)>\n"
+        "   nvmpool <filename> <size(MB)> [pmem|file|dram]\n"
+        "   nvmpool_open <filename> <size(MB)> [pmem|file]\n"
+        "     (use nvmpool_open instead of nvmpool to recover the tree in an\n"
+        "      existing NVM file, which must be mapped at the same address.\n"
+        "      A pool that is full grows by the per-worker size.  NVM pools grow\n"
+        "      with the files <filename>.1, <filename>.2, ...)\n"
+        "     (<filename> can be <file0>,<file1>,... to put the pool of a worker\n"
+        "      in the file of its NUMA node, e.g. one per namespace.  nvmpool_open\n"
+        "      finds the other files from <file0>)\n"
+        "     (the NVM backend: libpmem DAX mapping with clwb (default), a\n"
+        "      regular file with msync at every sfence, or DRAM without a file)\n"
+        "   ccmode <rtm|lock|olc>\n"
+        "     (concurrency control: RTM with lock fallback, global lock only, or\n"
+        "      optimistic version locks; the default is rtm if RTM is available)\n"
+        "   nvmemu <wb(ns)> <fence(ns)> <read(ns)>\n"
+        "     (emulate NVM latencies on DRAM: per line write back in clwb, drain\n"
+        "      at every sfence, read penalty at the first touch of a leaf in an\n"
+        "      operation; nvmemu 0 0 0 turns it off)\n"
         "--------------------------------------------------\n"
         "[Debugging]\n"
         " use these commands to test the correctness of the implementation\n\n"
         "   debug_bulkload <key_num> <fill_factor>\n"
         "   debug_randomize <key_num> <fill_factor>\n"
         "   debug_lookup <key_num> <fill_factor>\n"
+        "   debug_lookup_batch <key_num> <fill_factor>\n"
+        "   debug_scan <key_num> <fill_factor>\n"
         "   debug_insert <key_num>\n"
+        "   debug_insert_batch <key_num>\n"
         "   debug_del <key_num>\n"
+        "   debug_put <key_num>\n"
+        "   debug_update <key_num> <fill_factor>\n"
+        "   debug_cas <key_num>\n"
+        "   debug_merge <key_num>\n"
+        "   debug_mix <key_num>\n"
+        "   debug_checkpoint <key_num>\n"
         "--------------------------------------------------\n"
         "[Test Preparation]\n"
         " prepare a tree before performance tests\n\n"
@@ -91,13 +158,20 @@ static void usage (char *cmd)
         "[Performance Tests]\n"
         " measure performance of various tree operations\n\n"
         "   lookup <key_num> <key_file>\n"
+        "   lookup_batch <key_num> <key_file> <batch_size>\n"
+        "   scan <key_num> <key_file> <len>\n"
         "   insert <key_num> <key_file>\n"
+        "   insert_batch <key_num> <key_file> <batch_size>\n"
         "   del <key_num> <key_file>\n"
         "--------------------------------------------------\n"
         "[Misc]\n"
         " helper commands. debug_test enables correctness check for performance tests.\n\n"
         "   print_tree\n"
         "   check_tree\n"
+        "   checkpoint\n"
+        "   check_put <key_num>\n"
+        "   crash\n"
+        "   print_stats\n"
         "   print_mem\n"
         "   debug_test\n"
         "   sleep <seconds>\n"
@@ -108,17 +182,105 @@ static void usage (char *cmd)
 
 int compar_void_ptr(const void *p1, const void *p2)
 {
-	long *v1 = (long *)p1;
-	long *v2 = (long *)p2;
-        long t= (*v1 - *v2);
+	long v1 = *(long *)p1;
+	long v2 = *(long *)p2;
+
+	return (v1>v2 ? 1 : (v1<v2 ? -1 : 0));
+}
+
+// the batch size of debug_insert_batch
+#define DEBUG_BATCH_SIZE   100
+
+/**
+ * insert keys[2*ii+off] for ii in [start, end) in debug_insert,
+ * one at a time or in batches
+ */
+static void debugInsertKeys(key_type keys[], int off, int start, int end,
+                            bool batch)
+{
+       if (! batch) {
+          for (int ii=start; ii<end; ii++) {
+             key_type kk= keys[2*ii+off];
+             the_treep->insert (kk, keyToPtr(kk));
+          }
+          return;
+       }
+
+       key_type kk[DEBUG_BATCH_SIZE+1];
+       void *   pp[DEBUG_BATCH_SIZE+1];
+
+       for (int ii=start; ii<end; ii+=DEBUG_BATCH_SIZE) {
+          int num= min(DEBUG_BATCH_SIZE, end-ii);
+
+          // reverse the order and repeat a key to exercise the sorting
+          for (int jj=0; jj<num; jj++) {
+             kk[jj]= keys[2*(ii+num-1-jj)+off];
+             pp[jj]= keyToPtr(kk[jj]);
+          }
+          kk[num]= kk[0]; pp[num]= pp[0];
+
+          the_treep->insertBatch (kk, pp, num+1);
+       }
+}
+
+/**
+ * the value of the ii-th key in debug_put: mostly 1 .. 300 bytes, and
+ * some larger values up to VALUE_MAX_LEN, derived from ii
+ */
+static int debugValue(int ii, unsigned char *buf)
+{
+       int len= 1 + (ii*7) % 300;
+       if (ii % 31 == 0) len= 300 + (ii*13) % 8000;
+       if (ii % 997 == 0) len= VALUE_MAX_LEN - ii % 100;
+       for (int jj=0; jj<len; jj++) buf[jj]= (unsigned char)(ii + jj);
+       return len;
+}
+
+/**
+ * the value of the ii-th key at the end of debug_put
+ *
+ * @return the length of the value, or -1 if the key has been removed
+ */
+static int debugPutValue(int ii, unsigned char *buf)
+{
+       if (ii % 3 == 0) return debugValue(ii + 2, buf);  // replaced
+       if (ii % 6 == 1) return -1;                       // removed
+       if (ii % 6 == 4) return debugValue(ii + 3, buf);  // removed, put again
+       return debugValue(ii, buf);
+}
+
+/**
+ * the number of records in the value heaps at the end of debug_put
+ *
+ * @param num  the number of keys with values
+ */
+static long long debugPutRecords(long long num)
+{
+#ifdef KEY_STRING
+       return 2*num + 1;  // and the key records of the keys and key 0
+#else
+       return num;
+#endif
+}
 
-	return (t>0 ? 1 : (t<0 ? -1 : 0));
+/**
+ * check the value of the ii-th key in debug_put and check_put
+ *
+ * @param len  the expected length, or -1 if the key must not be found
+ * @param val  the expected value
+ * @param buf  a buffer of VALUE_MAX_LEN bytes
+ */
+static bool checkValue(key_type key, int len, unsigned char *val,
+                       unsigned char *buf)
+{
+       int n= the_treep->get (key, buf, VALUE_MAX_LEN);
+       return (n == len) && ((len < 0) || (memcmp (val, buf, len) == 0));
 }
 
 /**
  * The test run for lookup operations
  */
-static inline int lookupTest(Int64 key[], int start, int end)
+static inline int lookupTest(key_type key[], int start, int end)
 {
        int found= 0;
 
@@ -131,7 +293,7 @@ static inline int lookupTest(Int64 key[], int start, int end)
           if (debug_test) {
             if (pos >= 0) { // found
                void * recptr = the_treep->get_recptr (p, pos);
-               assert ((key_type)recptr == key[ii]); // ptr == key in test prep
+               assert (recptr == keyToPtr(key[ii])); // ptr == key in test prep
                found ++;
             }
           }
@@ -141,18 +303,112 @@ static inline int lookupTest(Int64 key[], int start, int end)
        return found;
 }
 
+/**
+ * The test run for batched lookup operations
+ */
+static inline int lookupBatchTest(key_type key[], int start, int end, int batch)
+{
+       int found= 0;
+
+       void ** leaves= new void *[batch];
+       int *   pos= new int[batch];
+
+       for (int ii=start; ii<end; ii+=batch) {
+
+          int num= min(batch, end-ii);
+          the_treep->lookupBatch (&(key[ii]), num, leaves, pos);
+
+          if (debug_test) {
+            for (int jj=0; jj<num; jj++) {
+               if (pos[jj] >= 0) { // found
+                  void * recptr = the_treep->get_recptr (leaves[jj], pos[jj]);
+                  assert (recptr == keyToPtr(key[ii+jj])); // ptr == key in test prep
+                  found ++;
+               }
+            }
+          }
+
+       } // end of for
+
+       delete[] leaves;
+       delete[] pos;
+
+       return found;
+}
+
+/**
+ * The test run for scan operations
+ */
+static inline int scanTest(key_type key[], int start, int end, int len)
+{
+       int good= 0;
+
+       key_type * keys= new key_type[len];
+       void **    ptrs= new void *[len];
+
+       for (int ii=start; ii<end; ii++) {
+
+          int num= the_treep->scan (key[ii], len, keys, ptrs);
+
+          if (debug_test) {
+            // keys are in the tree, so len entries must be returned
+            bool ok= ((num == len) && (keys[0] == key[ii]));
+            for (int jj=0; ok && jj<num; jj++) {
+               ok= ((ptrs[jj] == keyToPtr(keys[jj]))  // ptr == key in test prep
+                    && (jj == 0 || keys[jj-1] < keys[jj]));
+            }
+            good += ok;
+          }
+
+       } // end of for
+
+       delete[] keys;
+       delete[] ptrs;
+
+       return good;
+}
+
 /**
  * The test run for insert operations
  */
-static inline int insertTest(Int64 key[], int start, int end)
+static inline int insertTest(key_type key[], int start, int end)
 {
        int found= 0;
 
        for (int ii=start; ii<end; ii++) {
           key_type kk= key[ii];
-          the_treep->insert (kk, (void *) kk);
+          the_treep->insert (kk, keyToPtr(kk));
+       } // end of for
+
+       if (debug_test) {
+          for (int ii=start; ii<end; ii++) {
+             void *p;
+             int pos;
+             p = the_treep->lookup (key[ii], &pos);
+             found += (pos >= 0);
+          }
+       }
+
+       return found;
+}
+
+/**
+ * The test run for batched insert operations
+ */
+static inline int insertBatchTest(key_type key[], int start, int end, int batch)
+{
+       int found= 0;
+
+       void ** ptrs= new void *[batch];
+
+       for (int ii=start; ii<end; ii+=batch) {
+          int num= min(batch, end-ii);
+          for (int jj=0; jj<num; jj++) ptrs[jj]= keyToPtr(key[ii+jj]);
+          the_treep->insertBatch (&(key[ii]), ptrs, num);
        } // end of for
 
+       delete[] ptrs;
+
        if (debug_test) {
           for (int ii=start; ii<end; ii++) {
              void *p;
@@ -168,7 +424,7 @@ static inline int insertTest(Int64 key[], int start, int end)
 /**
  * The test run for deletion operations
  */
-static inline int delTest(Int64 key[], int start, int end)
+static inline int delTest(key_type key[], int start, int end)
 {
        int found= 0;
 
@@ -212,6 +468,7 @@ int parse_command (int argc, char **argv)
             worker_id= 0; // the main thread will use worker[0]'s mem/nvm pool
 
 	    printf("number of worker threads is %d\n", worker_thread_num);
+	    printf("concurrency control: %s\n", cc_mode_name[cc_mode]);
 	    argc -= 2; argv += 2;
 	  }
 
@@ -231,37 +488,130 @@ int parse_command (int argc, char **argv)
             }
 
             // initialize mempool per worker thread
-            the_thread_mempools.init(worker_thread_num, size, 4096);
+            the_thread_mempools.init(worker_thread_num, size, 4096, page_mode);
           }
 
 	  // ---
-	  // nvmpool <filename> <size(MB)>
+	  // nvmpool <filename> <size(MB)> [pmem|file|dram]
+	  // nvmpool_open <filename> <size(MB)> [pmem|file]
 	  // ---
-	  else if(strcmp(argv[0], "nvmpool") == 0){
+	  else if((strcmp(argv[0], "nvmpool") == 0)
+	        ||(strcmp(argv[0], "nvmpool_open") == 0)){
             // get params
 	    if(argc < 3) usage(cmd);
+	    bool recover= (strcmp(argv[0], "nvmpool_open") == 0);
 	    nvm_file_name = argv[1];
 	    long long size = atoi(argv[2]);
 	    size *= MB;
 	    argc -= 3; argv += 3;
 
+            int backend= NVM_BACKEND_PMEM;
+            for (int m=0; (argc > 0) && (m<3); m++) {
+               if (strcmp(argv[0], backend_name[m]) == 0) {
+                  backend= m;
+                  argc --; argv ++;
+                  break;
+               }
+            }
+
             if (worker_thread_num <= 0) {
                 fprintf(stderr, "need to set worker_thread_num first!\n");
                 exit(1);
             }
 
             // initialize nvm pool and log per worker thread
-            the_thread_nvmpools.init(worker_thread_num, nvm_file_name, size);
+            the_thread_nvmpools.init(worker_thread_num, nvm_file_name, size,
+                                     recover, page_mode, backend);
 
-            // allocate a 4KB page for the tree in worker 0's pool
-            char *nvm_addr= (char *)nvmpool_alloc(4*KB);
-            the_treep= initTree(nvm_addr, false);
+            // the 4KB root page for the tree in worker 0's pool
+            // (allocated for a new pool, or found in an existing pool)
+            char *nvm_addr= the_thread_nvmpools.get_root(4*KB);
+            the_treep= initTree(nvm_addr, recover);
+
+            // the unused NVM lines of an existing pool become free nodes
+            if (recover) the_thread_nvmpools.rebuild_free_lists();
 
             // log may not be necessary for some tree implementations
             // For simplicity, we just initialize logs.  This cost is low.
             nvmLogInit(worker_thread_num);
 	  }
 
+	  // ---
+	  // pin <none|compact|scatter>
+	  // ---
+	  else if(strcmp(argv[0], "pin") == 0){
+            // get params
+	    if(argc < 2) usage(cmd);
+	    const char *policy= argv[1];
+	    argc -= 2; argv += 2;
+
+            int m;
+            for (m=0; m<3; m++) {
+               if (strcmp(policy, placement_name[m]) == 0) break;
+            }
+            if (m == 3) usage(cmd);
+
+            if (worker_thread_num <= 0) {
+                fprintf(stderr, "need to set worker_thread_num first!\n");
+                exit(1);
+            }
+            the_placement.init(worker_thread_num, m);
+	  }
+
+	  // ---
+	  // hugepage <4kb|thp|2mb|1gb>
+	  // ---
+	  else if(strcmp(argv[0], "hugepage") == 0){
+            // get params
+	    if(argc < 2) usage(cmd);
+	    const char *mode= argv[1];
+	    argc -= 2; argv += 2;
+
+            int m;
+            for (m=0; m<4; m++) {
+               if (strcmp(mode, page_mode_name[m]) == 0) break;
+            }
+            if (m == 4) usage(cmd);
+            page_mode= m;
+	  }
+
+	  // ---
+	  // ccmode <rtm|lock|olc>
+	  // ---
+	  else if(strcmp(argv[0], "ccmode") == 0){
+            // get params
+	    if(argc < 2) usage(cmd);
+	    const char *mode= argv[1];
+	    argc -= 2; argv += 2;
+
+            int m;
+            for (m=0; m<3; m++) {
+               if (strcmp(mode, cc_mode_name[m]) == 0) break;
+            }
+            if (m == 3) usage(cmd);
+            if ((m == CC_RTM) && !rtmSupported()) {
+                fprintf(stderr, "RTM is not supported on this CPU!\n");
+                exit(1);
+            }
+            cc_mode= m;
+            printf("concurrency control: %s\n", cc_mode_name[cc_mode]);
+	  }
+
+	  // ---
+	  // nvmemu <wb(ns)> <fence(ns)> <read(ns)>
+	  // ---
+	  else if(strcmp(argv[0], "nvmemu") == 0){
+            // get params
+	    if(argc < 4) usage(cmd);
+	    int wb_ns= atoi(argv[1]);
+	    int fence_ns= atoi(argv[2]);
+	    int read_ns= atoi(argv[3]);
+	    argc -= 4; argv += 4;
+
+            if ((wb_ns < 0) || (fence_ns < 0) || (read_ns < 0)) usage(cmd);
+            nvmEmuInit(wb_ns, fence_ns, read_ns);
+	  }
+
           // *****************************************************************
           // Misc
           // *****************************************************************
@@ -276,6 +626,26 @@ int parse_command (int argc, char **argv)
 	    the_treep->print ();
           }
 
+          // ---
+          // print_stats
+          // ---
+          else if (strcmp (argv[0], "print_stats") == 0) {
+            // get params
+            argc -= 1; argv += 1;
+
+            the_treep->print_stats ();
+          }
+
+          // ---
+          // checkpoint
+          // ---
+          else if (strcmp (argv[0], "checkpoint") == 0) {
+            // get params
+            argc -= 1; argv += 1;
+
+            the_treep->checkpoint (false);
+          }
+
           // ---
           // check_tree
           // ---
@@ -288,6 +658,15 @@ int parse_command (int argc, char **argv)
             printf("Check tree structure OK\n");
           }
 
+          // ---
+          // crash
+          // ---
+          else if (strcmp (argv[0], "crash") == 0) {
+            // exit without the shutdown checkpoint, as if the process crashed
+            fflush (stdout);
+            _exit (0);
+          }
+
           // ---
           // print_mem
           // ---
@@ -388,10 +767,13 @@ int parse_command (int argc, char **argv)
 
           // ---
           // debug_lookup <key_num> <fill_factor>
+          // debug_lookup_batch <key_num> <fill_factor>
           // ---
-          else if (strcmp (argv[0], "debug_lookup") == 0) {
+          else if ((strcmp (argv[0], "debug_lookup") == 0)
+                 ||(strcmp (argv[0], "debug_lookup_batch") == 0)) {
             // get params
             if (argc < 3) usage (cmd);
+            bool batch= (strcmp (argv[0], "debug_lookup_batch") == 0);
             int keynum = atoi (argv[1]);
             float bfill; sscanf (argv[2], "%f", &bfill);
             argc -= 3; argv += 3;
@@ -409,30 +791,106 @@ int parse_command (int argc, char **argv)
 	    assert ((start == input->keys[1]) 
 		 && (end == input->keys[2*keynum-1]));
 
+	    // check batched look up: every odd key is in the tree
+	    if (batch) {
+	       void ** leaves= new void *[2*keynum];
+	       int *   pos= new int[2*keynum];
+
+	       int found= the_treep->lookupBatch (input->keys, 2*keynum,
+	                                          leaves, pos);
+	       assert (found == keynum);
+
+	       for (int ii=0; ii<2*keynum; ii++) {
+	          if (ii & 1)
+	            assert (the_treep->get_recptr (leaves[ii], pos[ii])
+	                    == keyToPtr(input->keys[ii]));
+	          else
+	            assert (pos[ii] < 0);
+	       }
+
+	       delete[] leaves;
+	       delete[] pos;
+	    }
+
 	    // check look up
-	    for (int ii=0; ii<keynum; ii++) {
+	    else for (int ii=0; ii<keynum; ii++) {
 	       void *p;
 	       int pos;
 
-               Int64 kk= input->keys[2*ii];
+               key_type kk= input->keys[2*ii];
 	       p = the_treep->lookup (kk, &pos);
 	       if (pos >= 1)
-	         assert ((key_type)(the_treep->get_recptr (p, pos)) != kk);
+	         assert (the_treep->get_recptr (p, pos) != keyToPtr(kk));
 
                kk= input->keys[2*ii+1];
 	       p = the_treep->lookup (kk, &pos);
-	       assert ((key_type)(the_treep->get_recptr (p, pos)) == kk);
+	       assert (the_treep->get_recptr (p, pos) == keyToPtr(kk));
 	    }
 
             printf ("lookup is good!\n");
           }
 
+          // ---
+          // debug_scan <key_num> <fill_factor>
+          // ---
+          else if (strcmp (argv[0], "debug_scan") == 0) {
+            // get params
+            if (argc < 3) usage (cmd);
+            int keynum = atoi (argv[1]);
+            float bfill; sscanf (argv[2], "%f", &bfill);
+            argc -= 3; argv += 3;
+
+            // initiate keys
+	    inMemKeyInput *input = new inMemKeyInput(2*keynum, 1, 2);
+
+            // bulkload odd keys then check
+            int level = the_treep->bulkload (keynum, input, bfill);
+            the_treep->randomize();
+
+            key_type start, end;
+            the_treep->check (&start, &end);
+
+            const int len= 50;
+            key_type keys[len];
+            void *   ptrs[len];
+
+	    // scan from every even key (not in the tree)
+	    for (int ii=0; ii<keynum; ii++) {
+	       int expect= min(len, keynum-ii);
+
+	       key_type kk= input->keys[2*ii];
+	       int num= the_treep->scan (kk, len, keys, ptrs);
+	       assert (num == expect);
+	       for (int jj=0; jj<num; jj++) {
+	          assert ((keys[jj] == input->keys[2*(ii+jj)+1])
+	               && (ptrs[jj] == keyToPtr(keys[jj])));
+	       }
+
+	       // end key variant: stop before keys[2*(ii+10)]
+	       expect= min(10, keynum-ii);
+	       key_type ekey= ((ii+10 < keynum) ? input->keys[2*(ii+10)]
+	                                        : MAX_KEY);
+	       num= the_treep->scan (kk, ekey, len, keys, ptrs);
+	       assert (num == expect);
+	       for (int jj=0; jj<num; jj++) {
+	          assert (keys[jj] == input->keys[2*(ii+jj)+1]);
+	       }
+	    }
+
+            delete input;
+
+            printf ("scan is good!\n");
+          }
+
           // ---
           // debug_insert <key_num>
+          // debug_insert_batch <key_num>
           // ---
-          else if (strcmp (argv[0], "debug_insert") == 0) {
+          else if ((strcmp (argv[0], "debug_insert") == 0)
+                 ||(strcmp (argv[0], "debug_insert_batch") == 0)) {
             // get params
             if (argc < 2) usage (cmd);
+            bool batch= (strcmp (argv[0], "debug_insert_batch") == 0);
             int keynum = atoi (argv[1]);
             float bfill=1.0;
             argc -= 2; argv += 2;
@@ -453,13 +911,11 @@ int parse_command (int argc, char **argv)
 	    for (int t=0; t<worker_thread_num; t++){
 		threads[t] = std::thread ( [=](){
                      worker_id= t;
+                     the_placement.pin(t);
                      int start= 1 + keys_per_thread*t;
                      int end= ((t < worker_thread_num-1)
                                ? start+keys_per_thread : keynum);
-                     for (int ii=start; ii<end; ii++) {
-                        key_type kk= input->keys[2*ii+1];
-                        the_treep->insert (kk, (void *) kk);
-		     }
+                     debugInsertKeys (input->keys, 1, start, end, batch);
 		});
 	    }
 	    for (int t=0; t<worker_thread_num; t++) threads[t].join();
@@ -478,11 +934,11 @@ int parse_command (int argc, char **argv)
 	       kk= input->keys[2*ii];
                p = the_treep->lookup (kk, &pos);
 	       if (pos >= 1)
-               assert ((key_type)(the_treep->get_recptr (p, pos)) != kk);
+               assert (the_treep->get_recptr (p, pos) != keyToPtr(kk));
 
 	       kk= input->keys[2*ii+1];
                p = the_treep->lookup (kk, &pos);
-               assert ((key_type)(the_treep->get_recptr (p, pos)) == kk);
+               assert (the_treep->get_recptr (p, pos) == keyToPtr(kk));
             }
 
 	    delete input;
@@ -510,13 +966,11 @@ int parse_command (int argc, char **argv)
 	    for (int t=0; t<worker_thread_num; t++){
 		threads[t] = std::thread ( [=](){
                      worker_id= t;
+                     the_placement.pin(t);
                      int start= keys_per_thread*t;
                      int end= ((t < worker_thread_num-1)
                                ? start+keys_per_thread : keynum);
-                     for (int ii=start; ii<end; ii++) {
-                        key_type kk= input->keys[2*ii];
-                        the_treep->insert (kk, (void *) kk);
-		     }
+                     debugInsertKeys (input->keys, 0, start, end, batch);
 		});
 	    }
 	    for (int t=0; t<worker_thread_num; t++) threads[t].join();
@@ -531,13 +985,11 @@ int parse_command (int argc, char **argv)
 	    for (int t=0; t<worker_thread_num; t++){
 		threads[t] = std::thread ( [=](){
                      worker_id= t;
+                     the_placement.pin(t);
                      int start= keys_per_thread*t;
                      int end= ((t < worker_thread_num-1)
                                ? start+keys_per_thread : keynum);
-                     for (int ii=start; ii<end; ii++) {
-                        key_type kk= input->keys[2*ii];
-                        the_treep->insert (kk, (void *) kk);
-		     }
+                     debugInsertKeys (input->keys, 0, start, end, batch);
 		});
 	    }
 	    for (int t=0; t<worker_thread_num; t++) threads[t].join();
@@ -556,11 +1008,11 @@ int parse_command (int argc, char **argv)
 
 	       kk= input->keys[2*ii];
                p = the_treep->lookup (kk, &pos);
-               assert ((key_type)(the_treep->get_recptr (p, pos)) == kk);
+               assert (the_treep->get_recptr (p, pos) == keyToPtr(kk));
 
 	       kk= input->keys[2*ii+1];
                p = the_treep->lookup (kk, &pos);
-               assert ((key_type)(the_treep->get_recptr (p, pos)) == kk);
+               assert (the_treep->get_recptr (p, pos) == keyToPtr(kk));
             }
             }
 
@@ -568,69 +1020,361 @@ int parse_command (int argc, char **argv)
           }
 
           // ---
-          // debug_del <key_num>
+          // debug_put <key_num>
           // ---
-          else if (strcmp (argv[0], "debug_del") == 0) {
+          else if (strcmp (argv[0], "debug_put") == 0) {
             // get params
             if (argc < 2) usage (cmd);
             int keynum = atoi (argv[1]);
-            float bfill=1.0;
             argc -= 2; argv += 2;
 
-	    if (keynum < 10) keynum = 10;
-
             // initiate keys
-	    inMemKeyInput *input = new inMemKeyInput(keynum, 0, 1);
-
-            // bulkload
-            int level = the_treep->bulkload (keynum, input, bfill);
+	    inMemKeyInput *input = new inMemKeyInput(keynum+1, 0, 1);
 
-            // randomize the leaf nodes
-	    the_treep->randomize();
+            // bulkload 1 key
+            the_treep->bulkload (1, input, 1.0);
 
-            // delete half of the keys
-	    {int range= floor(keynum, worker_thread_num);
-             if (range % 2 ==1) range=range-1;  // ensure range is even number
+            // put keys 1 .. keynum with values, then put them again
+            int keys_per_thread= floor(keynum, worker_thread_num);
 
-             std::thread threads[worker_thread_num];
-	     for (int t=0; t<worker_thread_num; t++){
+            // the values are out of range
+            unsigned char *val= new unsigned char[VALUE_MAX_LEN+1];
+            unsigned char *buf= new unsigned char[VALUE_MAX_LEN];
+            assert (! the_treep->put (input->keys[1], val, VALUE_MAX_LEN+1));
+            assert (! the_treep->put (input->keys[1], val, -1));
+
+            // round 2: replace the values of ii%3==0, and remove ii%3==1
+            //          while getting the keys of the next thread
+            // round 3: the removed keys are not found, and ii%6==4 are put
+            //          again
+            for (int round=0; round<4; round++) {
+	      std::thread threads[worker_thread_num];
+	      for (int t=0; t<worker_thread_num; t++){
 		threads[t] = std::thread ( [=](){
                      worker_id= t;
-                     int start= range*t;
-                     int end= ((t < worker_thread_num-1) ? start+range: keynum);
-                     for (int ii=start; ii<end; ii+=2) {
-	                key_type kk= input->keys[ii];
-	                the_treep->del (kk);
-		     }
+                     the_placement.pin(t);
+                     int start= 1 + keys_per_thread*t;
+                     int end= ((t < worker_thread_num-1)
+                               ? start+keys_per_thread : keynum+1);
+                     unsigned char *val= new unsigned char[VALUE_MAX_LEN];
+                     unsigned char *buf= new unsigned char[VALUE_MAX_LEN];
+                     for (int ii=start; ii<end; ii++) {
+                        key_type kk= input->keys[ii];
+                        if (round < 2) {
+                           int len= debugValue(ii + round, val);
+                           bool ok= the_treep->put (kk, val, len);
+                           assert (ok == (round == 0));
+                        }
+                        else if (round == 2) {
+                           if (ii % 3 == 0) {
+                              int len= debugValue(ii + 2, val);
+                              assert (the_treep->replace (kk, val, len));
+                           }
+                           else if (ii % 3 == 1) {
+                              assert (the_treep->remove (kk));
+                           }
+
+                           // the old or the new value of another key
+                           int jj= ii + keys_per_thread;
+                           if (jj > keynum) jj -= keynum;
+                           int n= the_treep->get (input->keys[jj], buf,
+                                                  VALUE_MAX_LEN);
+                           int len= debugValue(jj, val);
+                           bool ok= (n == len) && (memcmp (val, buf, len) == 0);
+                           if ((! ok) && (jj % 3 == 0)) {
+                              len= debugValue(jj + 2, val);
+                              ok= (n == len) && (memcmp (val, buf, len) == 0);
+                           }
+                           if ((! ok) && (jj % 3 == 1)) ok= (n < 0);
+                           assert (ok);
+                        }
+                        else if (ii % 3 == 1) {
+                           assert (! the_treep->remove (kk));
+                           assert (! the_treep->replace (kk, val, 1));
+                           if (ii % 6 == 4) {
+                              int len= debugValue(ii + 3, val);
+                              assert (the_treep->put (kk, val, len));
+                           }
+                        }
+                     }
+                     delete[] val;
+                     delete[] buf;
 		});
-	     }
-	     for (int t=0; t<worker_thread_num; t++) threads[t].join();
+	      }
+	      for (int t=0; t<worker_thread_num; t++) threads[t].join();
             }
 
+	    // check
             key_type start, end;
             the_treep->check (&start, &end);
-
-            // duplicate deletions: do the same deletions again
-	    {int range= floor(keynum, worker_thread_num);
-             if (range % 2 ==1) range=range-1;  // ensure range is even number
-
-             std::thread threads[worker_thread_num];
-	     for (int t=0; t<worker_thread_num; t++){
-		threads[t] = std::thread ( [=](){
-                     worker_id= t;
-                     int start= range*t;
-                     int end= ((t < worker_thread_num-1) ? start+range: keynum);
-                     for (int ii=start; ii<end; ii+=2) {
-	                key_type kk= input->keys[ii];
-	                the_treep->del (kk);
-		     }
-		});
-	     }
-	     for (int t=0; t<worker_thread_num; t++) threads[t].join();
+	    assert ((start == input->keys[0])
+		 && (end == input->keys[keynum]));
+
+            long long num= 0;
+            for (int ii=1; ii<=keynum; ii++) {
+               int len= debugPutValue(ii, val);
+               assert (checkValue (input->keys[ii], len, val, buf));
+               if (len >= 0) num ++;
             }
+            assert (the_treep->get (nextKey(input->keys[keynum]), NULL, 0) < 0);
 
-            start, end;
-            the_treep->check (&start, &end);
+            // the removed and the replaced records are free
+            assert (the_thread_nvmpools.count_values() == debugPutRecords(num));
+
+            delete[] val;
+            delete[] buf;
+	    delete input;
+
+            printf ("put is good!\n");
+          }
+
+          // ---
+          // check_put <key_num>
+          // ---
+          else if (strcmp (argv[0], "check_put") == 0) {
+            // get params
+            if (argc < 2) usage (cmd);
+            int keynum = atoi (argv[1]);
+            argc -= 2; argv += 2;
+
+            // the keys of debug_put
+	    inMemKeyInput *input = new inMemKeyInput(keynum+1, 0, 1);
+
+            // the values at the end of debug_put, and no other record
+            unsigned char *val= new unsigned char[VALUE_MAX_LEN];
+            unsigned char *buf= new unsigned char[VALUE_MAX_LEN];
+            long long num= 0;
+            for (int ii=1; ii<=keynum; ii++) {
+               int len= debugPutValue(ii, val);
+               assert (checkValue (input->keys[ii], len, val, buf));
+               if (len >= 0) num ++;
+            }
+            assert (the_thread_nvmpools.count_values() == debugPutRecords(num));
+
+            // replace every value with a copy from the rebuilt value heaps
+            for (int ii=1; ii<=keynum; ii++) {
+               int len= debugPutValue(ii, val);
+               if (len >= 0) {
+                  assert (the_treep->replace (input->keys[ii], val, len));
+                  assert (checkValue (input->keys[ii], len, val, buf));
+               }
+            }
+            assert (the_thread_nvmpools.count_values() == debugPutRecords(num));
+
+            delete[] val;
+            delete[] buf;
+	    delete input;
+
+            printf ("values are good!\n");
+          }
+
+          // ---
+          // debug_update <key_num> <fill_factor>
+          // ---
+          else if (strcmp (argv[0], "debug_update") == 0) {
+            // get params
+            if (argc < 3) usage (cmd);
+            int keynum = atoi (argv[1]);
+            float bfill = atof (argv[2]);
+            argc -= 3; argv += 3;
+
+            // initiate keys: bulkload the odd keys
+	    inMemKeyInput *input = new inMemKeyInput(2*keynum, 1, 2);
+            the_treep->bulkload (keynum, input, bfill);
+
+            int keys_per_thread= floor(keynum, worker_thread_num);
+
+            // 1. update the odd keys to ptr+1, the even keys are not found
+            // 2. upsert all keys back to ptr: insert the even keys
+            for (int round=0; round<2; round++) {
+	      std::thread threads[worker_thread_num];
+	      for (int t=0; t<worker_thread_num; t++){
+		threads[t] = std::thread ( [=](){
+                     worker_id= t;
+                     the_placement.pin(t);
+                     int start= keys_per_thread*t;
+                     int end= ((t < worker_thread_num-1)
+                               ? start+keys_per_thread : keynum);
+                     for (int ii=start; ii<end; ii++) {
+                        key_type ko= input->keys[2*ii+1];
+                        key_type ke= input->keys[2*ii];
+                        if (round == 0) {
+                           bool ok= the_treep->update (ko, (char *)keyToPtr(ko)+1);
+                           assert (ok);
+                           ok= the_treep->update (ke, keyToPtr(ke));
+                           assert (!ok);
+                        }
+                        else {
+                           bool ins= the_treep->upsert (ke, keyToPtr(ke));
+                           assert (ins);
+                           ins= the_treep->upsert (ko, keyToPtr(ko));
+                           assert (!ins);
+                        }
+                     }
+		});
+	      }
+	      for (int t=0; t<worker_thread_num; t++) threads[t].join();
+
+              for (int ii=0; ii<keynum; ii++) {
+                 void *p;
+                 int pos;
+                 key_type kk;
+
+                 kk= input->keys[2*ii+1];
+                 p = the_treep->lookup (kk, &pos);
+                 assert (the_treep->get_recptr (p, pos)
+                         == (char *)keyToPtr(kk) + (1-round));
+
+                 kk= input->keys[2*ii];
+                 p = the_treep->lookup (kk, &pos);
+                 assert ((round == 0) ? (pos < 0)
+                         : (the_treep->get_recptr (p, pos) == keyToPtr(kk)));
+              }
+            }
+
+	    // check
+            key_type start, end;
+            the_treep->check (&start, &end);
+	    assert ((start == input->keys[0])
+		 && (end == input->keys[2*keynum-1]));
+
+	    delete input;
+
+            printf ("update is good!\n");
+          }
+
+          // ---
+          // debug_cas <key_num>
+          // ---
+          else if (strcmp (argv[0], "debug_cas") == 0) {
+            // get params
+            if (argc < 2) usage (cmd);
+            int keynum = atoi (argv[1]);
+            argc -= 2; argv += 2;
+
+            // initiate keys: bulkload the odd keys
+	    inMemKeyInput *input = new inMemKeyInput(2*keynum, 1, 2);
+            the_treep->bulkload (keynum, input, 1.0);
+
+            // 1. every thread adds 1 to every key
+            // 2. every thread tries to change every key from ptr+threads
+            //    to its own value, only one of them succeeds per key
+            std::atomic<long long> num_swapped(0);
+            long long T= worker_thread_num;
+
+            for (int round=0; round<2; round++) {
+	      std::thread threads[worker_thread_num];
+	      for (int t=0; t<worker_thread_num; t++){
+		threads[t] = std::thread ( [&, t, round](){
+                     worker_id= t;
+                     the_placement.pin(t);
+                     for (int ii=0; ii<keynum; ii++) {
+                        key_type kk= input->keys[2*ii+1];
+                        long long base= (long long)keyToPtr(kk);
+                        long long old;
+                        if (round == 0) {
+                           bool ok= the_treep->fetch_add (kk, 1, &old);
+                           assert (ok && old >= base && old < base+T);
+                        }
+                        else if (the_treep->cas (kk, (void *)(base+T),
+                                                 (void *)(base+T+1+t)))
+                           num_swapped ++;
+                     }
+                     key_type ke= input->keys[0];
+                     assert (! the_treep->fetch_add (ke, 1, NULL));
+                     assert (! the_treep->cas (ke, NULL, NULL));
+		});
+	      }
+	      for (int t=0; t<worker_thread_num; t++) threads[t].join();
+            }
+            assert (num_swapped == keynum);
+
+            for (int ii=0; ii<keynum; ii++) {
+               void *p;
+               int pos;
+               key_type kk= input->keys[2*ii+1];
+               long long base= (long long)keyToPtr(kk);
+
+               p = the_treep->lookup (kk, &pos);
+               long long v= (long long)the_treep->get_recptr (p, pos);
+               assert (v > base+T && v <= base+2*T);
+            }
+
+	    // check
+            key_type start, end;
+            the_treep->check (&start, &end);
+
+	    delete input;
+
+            printf ("cas is good!\n");
+          }
+
+          // ---
+          // debug_del <key_num>
+          // ---
+          else if (strcmp (argv[0], "debug_del") == 0) {
+            // get params
+            if (argc < 2) usage (cmd);
+            int keynum = atoi (argv[1]);
+            float bfill=1.0;
+            argc -= 2; argv += 2;
+
+	    if (keynum < 10) keynum = 10;
+
+            // initiate keys
+	    inMemKeyInput *input = new inMemKeyInput(keynum, 0, 1);
+
+            // bulkload
+            int level = the_treep->bulkload (keynum, input, bfill);
+
+            // randomize the leaf nodes
+	    the_treep->randomize();
+
+            // delete half of the keys
+	    {int range= floor(keynum, worker_thread_num);
+             if (range % 2 ==1) range=range-1;  // ensure range is even number
+
+             std::thread threads[worker_thread_num];
+	     for (int t=0; t<worker_thread_num; t++){
+		threads[t] = std::thread ( [=](){
+                     worker_id= t;
+                     the_placement.pin(t);
+                     int start= range*t;
+                     int end= ((t < worker_thread_num-1) ? start+range: keynum);
+                     for (int ii=start; ii<end; ii+=2) {
+	                key_type kk= input->keys[ii];
+	                the_treep->del (kk);
+		     }
+		});
+	     }
+	     for (int t=0; t<worker_thread_num; t++) threads[t].join();
+            }
+
+            key_type start, end;
+            the_treep->check (&start, &end);
+
+            // duplicate deletions: do the same deletions again
+	    {int range= floor(keynum, worker_thread_num);
+             if (range % 2 ==1) range=range-1;  // ensure range is even number
+
+             std::thread threads[worker_thread_num];
+	     for (int t=0; t<worker_thread_num; t++){
+		threads[t] = std::thread ( [=](){
+                     worker_id= t;
+                     the_placement.pin(t);
+                     int start= range*t;
+                     int end= ((t < worker_thread_num-1) ? start+range: keynum);
+                     for (int ii=start; ii<end; ii+=2) {
+	                key_type kk= input->keys[ii];
+	                the_treep->del (kk);
+		     }
+		});
+	     }
+	     for (int t=0; t<worker_thread_num; t++) threads[t].join();
+            }
+
+            start, end;
+            the_treep->check (&start, &end);
 
 	    // delete almost all the keys 
             // from right
@@ -647,6 +1391,7 @@ int parse_command (int argc, char **argv)
                 for (int t=0; t<worker_thread_num; t++){
                    threads[t] = std::thread ( [=](){
                         worker_id= t;
+                        the_placement.pin(t);
                         int end= ekey - range*t;
                         int start= ((t < worker_thread_num-1) ? ekey-range: skey);
                         for (int ii=end; ii>start; ii-=2) {
@@ -676,6 +1421,7 @@ int parse_command (int argc, char **argv)
                 for (int t=0; t<worker_thread_num; t++){
                    threads[t] = std::thread ( [=](){
                         worker_id= t;
+                        the_placement.pin(t);
                         int start= skey + range*t;
                         int end= ((t < worker_thread_num-1) ? start+range: ekey);
                         for (int ii=start; ii<end; ii+=2) {
@@ -696,6 +1442,226 @@ int parse_command (int argc, char **argv)
             printf ("delete is good!\n");
           }
 
+          // ---
+          // debug_merge <key_num>
+          // ---
+          else if (strcmp (argv[0], "debug_merge") == 0) {
+            // get params
+            if (argc < 2) usage (cmd);
+            int keynum = atoi (argv[1]);
+            argc -= 2; argv += 2;
+
+	    if (keynum < 16) keynum = 16;
+
+            // initiate keys
+	    inMemKeyInput *input = new inMemKeyInput(keynum, 0, 1);
+
+            // bulkload full leaves
+            int level = the_treep->bulkload (keynum, input, 1.0);
+	    the_treep->randomize();
+
+            // delete 7 out of every 8 keys in two rounds, so that leaves
+            // underflow next to both full and sparse siblings
+            key_type start, end;
+            for (int round=0; round<2; round++) {
+	     int range= floor(keynum, worker_thread_num);
+             std::thread threads[worker_thread_num];
+	     for (int t=0; t<worker_thread_num; t++){
+		threads[t] = std::thread ( [=](){
+                     worker_id= t;
+                     the_placement.pin(t);
+                     int start= range*t;
+                     int end= ((t < worker_thread_num-1) ? start+range: keynum);
+                     for (int ii=start; ii<end; ii++) {
+                        if ((ii % 8 == 0) || ((ii % 2) != round)) continue;
+	                the_treep->del (input->keys[ii]);
+		     }
+		});
+	     }
+	     for (int t=0; t<worker_thread_num; t++) threads[t].join();
+
+             the_treep->check (&start, &end);
+            }
+
+            // check look up
+	    for (int ii=0; ii<keynum; ii++) {
+	       void *p;
+	       int pos;
+
+               key_type kk= input->keys[ii];
+	       p = the_treep->lookup (kk, &pos);
+	       if (ii % 8 == 0)
+	         assert (the_treep->get_recptr (p, pos) == keyToPtr(kk));
+	       else if (pos >= 1)
+	         assert (the_treep->get_recptr (p, pos) != keyToPtr(kk));
+	    }
+
+	    delete input;
+
+            printf ("merge is good!\n");
+          }
+
+          // ---
+          // debug_checkpoint <key_num>
+          // ---
+          else if (strcmp (argv[0], "debug_checkpoint") == 0) {
+            // get params
+            if (argc < 2) usage (cmd);
+            int keynum = atoi (argv[1]);
+            argc -= 2; argv += 2;
+
+            if (worker_thread_num < 2) {
+               fprintf (stderr, "debug_checkpoint needs 2 threads or more\n");
+               exit (1);
+            }
+
+            // initiate keys, and bulkload the even keys
+	    inMemKeyInput *input = new inMemKeyInput(2*keynum, 0, 2);
+            the_treep->bulkload (keynum, input, 0.7);
+
+            // round 0: threads 1 .. T-1 insert the odd keys, which splits
+            //          leaves, while thread 0 takes checkpoints
+            // round 1: threads 1 .. T-1 look up the keys, while thread 0
+            //          takes checkpoints, which stay valid
+            std::atomic<int> running;
+            for (int round=0; round<2; round++) {
+              running= worker_thread_num - 1;
+	      std::thread threads[worker_thread_num];
+	      for (int t=0; t<worker_thread_num; t++){
+		threads[t] = std::thread ( [=, &running](){
+                     worker_id= t;
+                     the_placement.pin(t);
+                     if (t == 0) {
+                        while (running.load() > 0) {
+                           the_treep->checkpoint (false);
+                           usleep (2000);
+                        }
+                        return;
+                     }
+
+                     int T= worker_thread_num - 1;
+                     for (int ii=t-1; ii<keynum; ii+=T) {
+                        key_type kk= input->keys[2*ii+1];
+                        if (round == 0) {
+                           bool ok= the_treep->insert (kk, keyToPtr(kk));
+                           assert (ok);
+                        }
+                        else {
+                           int pos;
+                           void *p= the_treep->lookup (kk, &pos);
+                           assert ((pos >= 0)
+                                   && (the_treep->get_recptr (p, pos) == keyToPtr(kk)));
+                        }
+                     }
+                     running --;
+		});
+	      }
+	      for (int t=0; t<worker_thread_num; t++) threads[t].join();
+            }
+
+	    // check
+            key_type start, end;
+            the_treep->check (&start, &end);
+	    assert ((start == input->keys[0])
+		 && (end == input->keys[2*keynum-1]));
+
+	    delete input;
+
+            printf ("checkpoint is good!\n");
+          }
+
+          // ---
+          // debug_mix <key_num>
+          // ---
+          else if (strcmp (argv[0], "debug_mix") == 0) {
+            // get params
+            if (argc < 2) usage (cmd);
+            int keynum = atoi (argv[1]);
+            argc -= 2; argv += 2;
+
+	    if (keynum < 16) keynum = 16;
+
+            // initiate keys
+	    inMemKeyInput *input = new inMemKeyInput(keynum, 0, 1);
+
+            // bulkload full leaves
+            int level = the_treep->bulkload (keynum, input, 1.0);
+	    the_treep->randomize();
+
+            // thread t owns keys[t], keys[t+T], ..., so every leaf is
+            // changed by all the threads.  A thread deletes and reinserts
+            // its keys, looks up the keys of the other threads, which may
+            // be missing but never belong to another key, and scans while
+            // leaves are split and merged.
+            key_type start, end;
+            for (int round=0; round<4; round++) {
+             std::thread threads[worker_thread_num];
+	     for (int t=0; t<worker_thread_num; t++){
+		threads[t] = std::thread ( [=](){
+                     worker_id= t;
+                     the_placement.pin(t);
+                     int T= worker_thread_num;
+                     for (int ii=t; ii<keynum; ii+=T) {
+                        void *p;
+                        int pos;
+                        key_type kk= input->keys[ii];
+
+                        // delete the key half of the time in round 0
+                        if ((round > 0) || (ii/T % 2 == 0)) {
+                           the_treep->del (kk);
+                           p = the_treep->lookup (kk, &pos);
+                           assert (pos < 0);
+                           bool ok= the_treep->insert (kk, keyToPtr(kk));
+                           assert (ok);
+                        }
+                        assert (! the_treep->insert (kk, keyToPtr(kk)));
+
+                        key_type ko= input->keys[(ii + 1 + round) % keynum];
+                        p = the_treep->lookup (ko, &pos);
+                        if (pos >= 0)
+                          assert (the_treep->get_recptr (p, pos) == keyToPtr(ko));
+
+                        // scan from the key: the keys are in order with
+                        // their values, and no key of this thread is missed
+                        if (ii/T % 16 == 0) {
+                          epochGuard guard;  // the keys of sk[] are not reused
+                          const int len= 40;
+                          key_type sk[len];
+                          void *   sp[len];
+                          int num= the_treep->scan (kk, len, sk, sp);
+                          assert ((num > 0) && (sk[0] == kk));
+                          for (int n=1; n<num; n++) assert (sk[n-1] < sk[n]);
+                          for (int n=0; n<num; n++) assert (sp[n] == keyToPtr(sk[n]));
+
+                          int n= 0;
+                          for (int jj=ii; (jj<keynum) && (input->keys[jj] <= sk[num-1]); jj+=T) {
+                            while (sk[n] < input->keys[jj]) n++;
+                            assert (sk[n] == input->keys[jj]);
+                          }
+                        }
+		     }
+		});
+	     }
+	     for (int t=0; t<worker_thread_num; t++) threads[t].join();
+
+             the_treep->check (&start, &end);
+            }
+
+            // check look up
+	    for (int ii=0; ii<keynum; ii++) {
+	       void *p;
+	       int pos;
+
+               key_type kk= input->keys[ii];
+	       p = the_treep->lookup (kk, &pos);
+	       assert ((pos >= 0) && (the_treep->get_recptr (p, pos) == keyToPtr(kk)));
+	    }
+
+	    delete input;
+
+            printf ("mix is good!\n");
+          }
+
           // *****************************************************************
           // Test Preparation
           // *****************************************************************
@@ -773,13 +1739,14 @@ int parse_command (int argc, char **argv)
             for (int t=0; t<worker_thread_num; t++){
                 threads[t] = std::thread ( [=](){
                      worker_id= t;
+                     the_placement.pin(t);
                      int start= bulkload_num + range*t;
                      int end= ((t<worker_thread_num-1)? start+range: keynum);
                      
                      keyInput *cursor= input->openCursor(start, end-start);
                      for (int ii=start; ii<end; ii++) {
                         key_type kk= cursor->get_key(ii);
-                        the_treep->insert (kk, (void *) kk);
+                        the_treep->insert (kk, keyToPtr(kk));
                      }
                      input->closeCursor(cursor);
                 });
@@ -813,7 +1780,7 @@ int parse_command (int argc, char **argv)
             printf ("-- lookup %d %s\n", keynum, keyfile);
 
             // load keys from the file into an array in memory
-            Int64 * key = getKeys (keyfile, keynum);
+            key_type * key = getKeys (keyfile, keynum);
 
             // test
             unsigned long long total_us= 0;
@@ -830,6 +1797,7 @@ int parse_command (int argc, char **argv)
                   for (int t=0; t<worker_thread_num; t++) {
                       threads[t] = std::thread ( [=, &found](){
                            worker_id= t;
+                           the_placement.pin(t);
                            int start= range*t;
                            int end= ((t < worker_thread_num-1) ? start+range: keynum);
                            int th_found= lookupTest(key, start, end);
@@ -853,6 +1821,121 @@ int parse_command (int argc, char **argv)
             free (key);
           }
 
+          // ---
+          // lookup_batch <key_num> <key_file> <batch_size>
+          // ---
+          else if (strcmp (argv[0], "lookup_batch") == 0) {
+            // get params
+            if (argc < 4) usage (cmd);
+            int keynum = atoi (argv[1]);
+            char *keyfile = argv[2];
+            int batch = atoi (argv[3]);
+            argc -= 4; argv += 4;
+            if (batch <= 0) usage (cmd);
+
+            printf ("-- lookup_batch %d %s %d\n", keynum, keyfile, batch);
+
+            // load keys from the file into an array in memory
+            key_type * key = getKeys (keyfile, keynum);
+
+            // test
+            unsigned long long total_us= 0;
+
+	    std::thread threads[worker_thread_num];
+            int range= floor(keynum, worker_thread_num);
+            std::atomic<int> found;
+            found= 0;
+
+            clear_cache ();
+
+            TEST_PERFORMANCE(total_us, do {
+                if (worker_thread_num > 1) {
+                  for (int t=0; t<worker_thread_num; t++) {
+                      threads[t] = std::thread ( [=, &found](){
+                           worker_id= t;
+                           the_placement.pin(t);
+                           int start= range*t;
+                           int end= ((t < worker_thread_num-1) ? start+range: keynum);
+                           int th_found= lookupBatchTest(key, start, end, batch);
+                           if (debug_test) found.fetch_add(th_found);
+                      });
+                  }
+                  for (int t=0; t<worker_thread_num; t++) threads[t].join();
+                } // end worker_thread_num > 1
+
+                // worker_thread_num == 1
+                else {
+                  found= lookupBatchTest(key, 0, keynum, batch);
+                }
+            }while(0))
+
+	    if (debug_test) {
+	      printf ("lookup is good!\n");
+              printf("found %d keys\n", found.load());
+	    }
+
+            free (key);
+          }
+
+          // ---
+          // scan <key_num> <key_file> <len>
+          // ---
+          else if (strcmp (argv[0], "scan") == 0) {
+            // get params
+            if (argc < 4) usage (cmd);
+            int keynum = atoi (argv[1]);
+            char *keyfile = argv[2];
+            int len = atoi (argv[3]);
+            argc -= 4; argv += 4;
+
+            printf ("-- scan %d %s %d\n", keynum, keyfile, len);
+
+            // load start keys from the file into an array in memory
+            key_type * key = getKeys (keyfile, keynum);
+
+            // test
+            unsigned long long total_us= 0;
+
+	    std::thread threads[worker_thread_num];
+            int range= floor(keynum, worker_thread_num);
+            std::atomic<int> good;
+            good= 0;
+
+            clear_cache ();
+
+            TEST_PERFORMANCE(total_us, do {
+                if (worker_thread_num > 1) {
+                  for (int t=0; t<worker_thread_num; t++) {
+                      threads[t] = std::thread ( [=, &good](){
+                           worker_id= t;
+                           the_placement.pin(t);
+                           int start= range*t;
+                           int end= ((t < worker_thread_num-1) ? start+range: keynum);
+                           int th_good= scanTest(key, start, end, len);
+                           if (debug_test) good.fetch_add(th_good);
+                      });
+                  }
+                  for (int t=0; t<worker_thread_num; t++) threads[t].join();
+                } // end worker_thread_num > 1
+
+                // worker_thread_num == 1
+                else {
+                  good= scanTest(key, 0, keynum, len);
+                }
+            }while(0))
+
+	    if (debug_test) {
+              if (good.load() == keynum) {
+                  printf ("scan is good!\n");
+              }
+              else {
+                  printf ("%d scans are not correct!\n", keynum - good.load());
+              }
+	    }
+
+            free (key);
+          }
+
           // ---
           // insert <key_num> <key_file>
           // ---
@@ -866,7 +1949,7 @@ int parse_command (int argc, char **argv)
             printf ("-- insert %d %s\n", keynum, keyfile);
 
             // get keys from the file
-            Int64 * key = getKeys (keyfile, keynum);
+            key_type * key = getKeys (keyfile, keynum);
 
             // test
             unsigned long long total_us= 0;
@@ -887,6 +1970,7 @@ int parse_command (int argc, char **argv)
                   for (int t=0; t<worker_thread_num; t++) {
                       threads[t] = std::thread ( [=, &found](){
                            worker_id= t;
+                           the_placement.pin(t);
                            int start= range*t;
                            int end= ((t < worker_thread_num-1) ? start+range: keynum);
                            int th_found= insertTest(key, start, end);
@@ -902,6 +1986,80 @@ int parse_command (int argc, char **argv)
                 }
             }while(0))
 
+#ifdef NVMFLUSH_STAT
+	    NVMFLUSH_STAT_print();
+#endif
+
+            if (debug_test) {
+
+              printf ("Insert %d keys / %d keys\n", found.load(), keynum);
+
+              key_type start, end;
+              the_treep->check (&start, &end);
+
+              if (found.load() == keynum) {
+                  printf ("Insertion is good!\n");
+              }
+              else {
+                  printf ("%d keys are not successfully inserted!\n", keynum - found.load());
+              }
+            }
+
+            free (key);
+          }
+
+          // ---
+          // insert_batch <key_num> <key_file> <batch_size>
+          // ---
+          else if (strcmp (argv[0], "insert_batch") == 0) {
+            // get params
+            if (argc < 4) usage (cmd);
+            int keynum = atoi (argv[1]);
+            char *keyfile = argv[2];
+            int batch = atoi (argv[3]);
+            argc -= 4; argv += 4;
+            if (batch <= 0) usage (cmd);
+
+            printf ("-- insert_batch %d %s %d\n", keynum, keyfile, batch);
+
+            // get keys from the file
+            key_type * key = getKeys (keyfile, keynum);
+
+            // test
+            unsigned long long total_us= 0;
+
+            std::thread threads[worker_thread_num];
+            int range= floor(keynum, worker_thread_num);
+            std::atomic<int> found;
+            found= 0;
+
+            clear_cache ();
+
+#ifdef NVMFLUSH_STAT
+	    NVMFLUSH_STAT_init();
+#endif
+
+            TEST_PERFORMANCE(total_us, do {
+                if (worker_thread_num > 1) {
+                  for (int t=0; t<worker_thread_num; t++) {
+                      threads[t] = std::thread ( [=, &found](){
+                           worker_id= t;
+                           the_placement.pin(t);
+                           int start= range*t;
+                           int end= ((t < worker_thread_num-1) ? start+range: keynum);
+                           int th_found= insertBatchTest(key, start, end, batch);
+                           if (debug_test) found.fetch_add(th_found);
+                      });
+                  }
+                  for (int t=0; t<worker_thread_num; t++) threads[t].join();
+                } // end worker_thread_num > 1
+
+                // worker_thread_num == 1
+                else {
+                  found= insertBatchTest(key, 0, keynum, batch);
+                }
+            }while(0))
+
 #ifdef NVMFLUSH_STAT
 	    NVMFLUSH_STAT_print();
 #endif
@@ -937,7 +2095,7 @@ int parse_command (int argc, char **argv)
             printf ("-- del %d %s\n", keynum, keyfile);
 
             // get keys from the file
-            Int64 * key = getKeys (keyfile, keynum);
+            key_type * key = getKeys (keyfile, keynum);
 
             // test
             unsigned long long total_us= 0;
@@ -958,6 +2116,7 @@ int parse_command (int argc, char **argv)
                   for (int t=0; t<worker_thread_num; t++) {
                       threads[t] = std::thread ( [=, &found](){
                            worker_id= t;
+                           the_placement.pin(t);
                            int start= range*t;
                            int end= ((t < worker_thread_num-1) ? start+range: keynum);
                            int th_found= delTest(key, start, end);
@@ -999,6 +2158,9 @@ int parse_command (int argc, char **argv)
 	  }
 	} // end of while
 
+	// save the non-leaf nodes for fast restart
+	if (the_treep) the_treep->checkpoint (true);
+
 	return 0;
 }
 
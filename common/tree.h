@@ -31,7 +31,9 @@
 
 // the size of a tree node
 #define NONLEAF_LINE_NUM        4    // 256B
-#define LEAF_LINE_NUM           4    // 256B
+#ifndef LEAF_LINE_NUM
+#define LEAF_LINE_NUM           4    // 256B, or 8 (512B), 16 (1KB)
+#endif
 
 // the number of leaf nodes to prefetch ahead in jump pointer array 
 // prefetching
@@ -47,14 +49,101 @@
 #define NONLEAF_SIZE    (CACHE_LINE_SIZE * NONLEAF_LINE_NUM)
 #define LEAF_SIZE       (CACHE_LINE_SIZE * LEAF_LINE_NUM)
 
-// key size and pointer size: 8B
-typedef long long key_type;
+/* key size: 8B (default), 16B, or 32B.  Compile with -DKEY_SIZE=16 or 32
+ * for fixed-width keys (see fixedkey.h), and with -DKEY_UNSIGNED for
+ * unsigned 8B keys.  Compile with -DKEY_STRING for variable-length string
+ * keys (see strkey.h): a key in a node is then an 8B pointer to a key blob.
+ * Pointer/value size: 8B.
+ *
+ * makeKey() maps an 8B integer to a key in the same order (used by the
+ * driver to generate keys), keyToPtr() gives the record pointer of such a
+ * key in tests, nextKey() returns the successor of a key, and keyToStr()
+ * prints a key into a buffer of KEY_STR_SIZE bytes.  A key file contains
+ * key_file_type records, and fileKey() maps a record to a key.
+ */
+#ifndef KEY_SIZE
 #define KEY_SIZE             8   /* size of a key in tree node */
+#endif
 #define POINTER_SIZE         8   /* size of a pointer/value in node */
 #define ITEM_SIZE            8   /* key size or pointer size */
 
+#ifdef KEY_STRING
+#if (KEY_SIZE != 8) || defined(KEY_UNSIGNED)
+#error "KEY_STRING keys are 8B blob pointers.  Do not set KEY_SIZE or KEY_UNSIGNED."
+#endif
+#include "strkey.h"
+
+typedef strKey key_type;
+#define MAX_KEY		(key_type::maxKey())
+#define MIN_KEY		(key_type::minKey())
+
+#define KEY_STR_SIZE    64
+
+// the blobs of the driver keys are never freed
+static inline key_type makeKey(long long x)
+{ return strKeyFromInt(x, strKeyAlloc(STR_KEY_BUF_SIZE)); }
+static inline void * keyToPtr(const key_type &k) { return strKeyToPtr(k); }
+static inline key_type nextKey(const key_type &k) { return strKeyNext(k); }
+static inline const char * keyToStr(const key_type &k, char *buf)
+{ return strKeyToStr(k, buf, KEY_STR_SIZE); }
+
+typedef long long key_file_type;
+static inline key_type fileKey(key_file_type x) { return makeKey(x); }
+
+#elif KEY_SIZE == 8
+#ifndef KEY_UNSIGNED
+typedef long long key_type;
 #define MAX_KEY		((key_type)(0x7fffffffffffffffULL))
 #define MIN_KEY		((key_type)(0x8000000000000000ULL))
+#else
+typedef unsigned long long key_type;
+#define MAX_KEY		((key_type)(0xffffffffffffffffULL))
+#define MIN_KEY		((key_type)0)
+#endif
+
+#define KEY_STR_SIZE    24
+
+static inline key_type makeKey(long long x) { return (key_type)x; }
+static inline void * keyToPtr(key_type k) { return (void *)k; }
+static inline key_type nextKey(key_type k) { return k+1; }
+static inline const char * keyToStr(key_type k, char *buf)
+{
+#ifndef KEY_UNSIGNED
+    sprintf(buf, "%lld", k);
+#else
+    sprintf(buf, "%llu", k);
+#endif
+    return buf;
+}
+
+typedef key_type key_file_type;
+static inline key_type fileKey(key_file_type x) { return x; }
+
+#elif (KEY_SIZE == 16) || (KEY_SIZE == 32)
+#ifdef KEY_UNSIGNED
+#error "KEY_UNSIGNED is for 8B keys.  16B and 32B keys are always unsigned."
+#endif
+#include "fixedkey.h"
+
+#define KEY_WORDS       (KEY_SIZE/8)
+typedef fixedKey<KEY_WORDS> key_type;
+#define MAX_KEY		(key_type::maxKey())
+#define MIN_KEY		(key_type::minKey())
+
+#define KEY_STR_SIZE    (17*KEY_WORDS)
+
+static inline key_type makeKey(long long x) { return fixedKeyFromInt<KEY_WORDS>(x); }
+static inline void * keyToPtr(const key_type &k) { return fixedKeyToPtr(k); }
+static inline key_type nextKey(const key_type &k) { return fixedKeyNext(k); }
+static inline const char * keyToStr(const key_type &k, char *buf)
+{ return fixedKeyToStr(k, buf); }
+
+typedef key_type key_file_type;
+static inline key_type fileKey(const key_file_type &x) { return x; }
+
+#else
+#error "KEY_SIZE must be 8, 16, or 32."
+#endif
 
 #include "keyinput.h"
 #include "nodepref.h"
@@ -79,12 +168,23 @@ Returns the number of 1-bits in x.
 #define bitScan(x)  __builtin_ffs(x)
 #define countBit(x) __builtin_popcount(x)
 
+// the 1B fingerprint of a key
+#ifdef KEY_STRING
+static inline unsigned char hashcode1B(const key_type &x) {
+    return strKeyHash1B(x);
+}
+#elif KEY_SIZE == 8
 static inline unsigned char hashcode1B(key_type x) {
     x ^= x>>32;
     x ^= x>>16;
     x ^= x>>8;
     return (unsigned char)(x&0x0ffULL);
 }
+#else
+static inline unsigned char hashcode1B(const key_type &x) {
+    return fixedKeyHash1B(x);
+}
+#endif
 
 static inline unsigned long long rdtsc(void)
 {
@@ -145,6 +245,23 @@ class tree {
 	return NULL;
    }
 
+  /**
+   * look up a batch of search keys
+   *
+   * @param keys    the search keys
+   * @param n       the number of search keys
+   * @param leaves  return the leaf nodes as in lookup()
+   * @param pos     return the positions as in lookup()
+   * @return        the number of keys found
+   */
+   virtual int lookupBatch (const key_type keys[], int n,
+                            void *leaves[], int pos[])
+   {
+	fprintf (stderr, "Not implemented!\n");
+	exit (1);
+	return 0;
+   }
+
   /**
    * obtain the record pointer
    *
@@ -159,13 +276,190 @@ class tree {
 	return NULL;
    }
 
+  /**
+   * range scan: return index entries with keys >= start_key in key order
+   *
+   * @param start_key  the start key of the scan
+   * @param max_keys   the maximum number of index entries to return
+   * @param keys       return the keys (sorted in ascending order)
+   * @param ptrs       return the associated record pointers
+   * @return           the number of index entries returned
+   *
+   * With KEY_STRING, the keys point to the blobs in the leaves, which are
+   * reclaimed after the keys are deleted.  Hold an epochGuard while the
+   * keys are used if other threads may delete them.
+   */
+   virtual int scan (key_type start_key, int max_keys,
+                     key_type keys[], void *ptrs[])
+   {
+	fprintf (stderr, "Not implemented!\n");
+	exit (1);
+	return 0;
+   }
+
+  /**
+   * range scan: return index entries in [start_key, end_key] in key order
+   *
+   * @param start_key  the start key of the scan
+   * @param end_key    the end key of the scan (inclusive)
+   * @param max_keys   the maximum number of index entries to return
+   * @param keys       return the keys (sorted in ascending order)
+   * @param ptrs       return the associated record pointers
+   * @return           the number of index entries returned
+   *
+   * With KEY_STRING, the keys point to the blobs in the leaves, which are
+   * reclaimed after the keys are deleted.  Hold an epochGuard while the
+   * keys are used if other threads may delete them.
+   */
+   virtual int scan (key_type start_key, key_type end_key, int max_keys,
+                     key_type keys[], void *ptrs[])
+   {
+	fprintf (stderr, "Not implemented!\n");
+	exit (1);
+	return 0;
+   }
+
   /**
    * insert an index entry
    *
    * @param key   the index key
    * @param ptr   the record pointer
+   * @return      false if the key already exists (nothing is changed)
+   */
+   virtual bool insert (key_type key, void * ptr)
+   {
+       fprintf (stderr, "Not implemented!\n");
+       exit (1);
+       return false;
+   }
+
+  /**
+   * overwrite the record pointer of an existing key
+   *
+   * @param key   the index key
+   * @param ptr   the new record pointer
+   * @return      false if the key is not found (nothing is changed)
+   */
+   virtual bool update (key_type key, void * ptr)
+   {
+       fprintf (stderr, "Not implemented!\n");
+       exit (1);
+       return false;
+   }
+
+  /**
+   * update the key if it exists, otherwise insert it
+   *
+   * @param key   the index key
+   * @param ptr   the record pointer
+   * @return      true if the key is inserted, false if it is updated
+   */
+   virtual bool upsert (key_type key, void * ptr)
+   {
+       fprintf (stderr, "Not implemented!\n");
+       exit (1);
+       return false;
+   }
+
+  /**
+   * compare-and-swap the record pointer of an existing key
+   *
+   * @param key       the index key
+   * @param expected  the expected record pointer
+   * @param desired   the new record pointer
+   * @return          true if the key is found and its pointer was expected
+   */
+   virtual bool cas (key_type key, void *expected, void *desired)
+   {
+       fprintf (stderr, "Not implemented!\n");
+       exit (1);
+       return false;
+   }
+
+  /**
+   * add delta to the 8B value of an existing key (used as a counter)
+   *
+   * @param key    the index key
+   * @param delta  the value to add
+   * @param old    return the value before the addition (if not NULL)
+   * @return       false if the key is not found
+   */
+   virtual bool fetch_add (key_type key, long long delta, long long *old)
+   {
+       fprintf (stderr, "Not implemented!\n");
+       exit (1);
+       return false;
+   }
+
+  /**
+   * insert a key with a value that is copied into the NVM value heap
+   *
+   * @param key   the index key
+   * @param val   the value
+   * @param len   the length of the value in bytes (<= VALUE_MAX_LEN)
+   * @return      false if the key already exists or len is out of range
+   *              (nothing is changed)
+   */
+   virtual bool put (key_type key, const void *val, int len)
+   {
+       fprintf (stderr, "Not implemented!\n");
+       exit (1);
+       return false;
+   }
+
+  /**
+   * copy the value of a key inserted by put
+   *
+   * @param key   the index key
+   * @param buf   the buffer to return the value
+   * @param size  the size of buf in bytes
+   * @return      the length of the value, or -1 if the key is not found.
+   *              At most size bytes are copied.
+   */
+   virtual int get (key_type key, void *buf, int size)
+   {
+       fprintf (stderr, "Not implemented!\n");
+       exit (1);
+       return -1;
+   }
+
+  /**
+   * replace the value of a key inserted by put
+   *
+   * @param key   the index key
+   * @param val   the new value
+   * @param len   the length of the value in bytes (<= VALUE_MAX_LEN)
+   * @return      false if the key is not found or len is out of range
+   *              (nothing is changed)
+   */
+   virtual bool replace (key_type key, const void *val, int len)
+   {
+       fprintf (stderr, "Not implemented!\n");
+       exit (1);
+       return false;
+   }
+
+  /**
+   * delete a key inserted by put, and free its value
+   *
+   * @param key   the index key
+   * @return      false if the key is not found
    */
-   virtual void insert (key_type key, void * ptr)
+   virtual bool remove (key_type key)
+   {
+       fprintf (stderr, "Not implemented!\n");
+       exit (1);
+       return false;
+   }
+
+  /**
+   * insert a batch of index entries
+   *
+   * @param keys  the index keys
+   * @param ptrs  the record pointers
+   * @param n     the number of index entries
+   */
+   virtual void insertBatch (const key_type keys[], void *ptrs[], int n)
    {
        fprintf (stderr, "Not implemented!\n");
        exit (1);
@@ -182,6 +476,26 @@ class tree {
 	exit (1);
    }
 
+  /**
+   * save the non-leaf nodes to NVM for fast restart
+   *
+   * @param shutdown  true if this is the last checkpoint before exit
+   */
+   virtual void checkpoint (bool shutdown)
+   {
+	fprintf (stderr, "Not implemented!\n");
+	exit (1);
+   }
+
+  /**
+   * print statistics of concurrency control
+   */
+   virtual void print_stats ()
+   {
+	fprintf (stderr, "Not implemented!\n");
+	exit (1);
+   }
+
   /**
    * print the tree structure
    */
@@ -215,10 +529,30 @@ class tree {
 
 }; // tree
 
+/* ---------------------------------------------------------------------- */
+/*                       Concurrency Control Modes                        */
+/* ---------------------------------------------------------------------- */
+
+// CC_RTM: RTM transactions, falling back to a global lock after
+//         RTM_MAX_RETRY aborts
+// CC_LOCK: always use the global lock (the fallback path of CC_RTM)
+// CC_OLC: optimistic lock coupling using the node lock words as versions
+#define CC_RTM    0
+#define CC_LOCK   1
+#define CC_OLC    2
+
+#ifndef RTM_MAX_RETRY
+#define RTM_MAX_RETRY   16
+#endif
+
+// return true if the CPU supports RTM and RTM is not always aborting
+extern bool rtmSupported(void);
+
 /* ---------------------------------------------------------------------- */
 extern tree * the_treep;
 extern int    worker_thread_num;
 extern const char * nvm_file_name;
+extern int    cc_mode;
 
 extern int parse_command (int argc, char **argv);
 
@@ -1,6 +1,6 @@
 #!/bin/bash 
 
-keys="dbg-k50k dbg-search500 dbg-insert500 dbg-delete500 k50m search500k insert500k delete500k"
+keys="dbg-k50k dbg-search500 dbg-insert500 dbg-delete500 dbg-scan500 k50m search500k insert500k delete500k scan500k"
 
 echo "rm -f ${keys}"
 rm -f ${keys}
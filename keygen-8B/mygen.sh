@@ -14,6 +14,9 @@
 # delete keys are randomly ordered and must be in bulkload keys
 ./getdelete 50000 dbg-k50k 500 dbg-delete500
 
+# scan start keys are in bulkload keys, at least 100 keys from the end
+./getscan 50000 dbg-k50k 500 100 dbg-scan500
+
 
 # ----------------------------------------------------------------------
 # the following is for experiments
@@ -28,3 +31,6 @@
 
 # delete keys are randomly ordered and must be in bulkload keys
 #./getdelete 50000000 k50m 500000 delete500k
+
+# scan start keys are in bulkload keys, at least 100 keys from the end
+#./getscan 50000000 k50m 500000 100 scan500k
@@ -25,29 +25,357 @@ static int last_slot_in_line[LEAF_KEY_NUM];
 
 static void initUseful(void)
 {
-    // line 0
-    last_slot_in_line[0]= 2;
-    last_slot_in_line[1]= 2;
-    last_slot_in_line[2]= 2;
-
-    // line 1
-    last_slot_in_line[3]= 6;
-    last_slot_in_line[4]= 6;
-    last_slot_in_line[5]= 6;
-    last_slot_in_line[6]= 6;
-
-    // line 2
-    last_slot_in_line[7]= 10;
-    last_slot_in_line[8]= 10;
-    last_slot_in_line[9]= 10;
-    last_slot_in_line[10]=10;
-
-    // line 3
-    last_slot_in_line[11]=13;
-    last_slot_in_line[12]=13;
-    last_slot_in_line[13]=13;
+    // the last slot that is in the cache line(s) of a slot
+    for (int slot=0; slot<LEAF_KEY_NUM; slot++) {
+        int last= slot;
+        while (last+1 < LEAF_KEY_NUM
+               && LEAF_SLOT_END_LINE(last+1) == LEAF_SLOT_END_LINE(slot))
+            last ++;
+        last_slot_in_line[slot]= last;
+    }
+}
+
+// flush the cache line(s) of a slot in a leaf (a 16B or 32B key may
+// make an entry span two lines)
+static inline void clwbLeafSlot(void *lp, int slot)
+{
+    for (int l=LEAF_SLOT_LINE(slot); l<=LEAF_SLOT_END_LINE(slot); l++)
+       clwb((char *)lp + l*CACHE_LINE_SIZE);
+}
+
+/* ----------------------------------------------------------------- *
+ string keys
+ * ----------------------------------------------------------------- */
+
+/* KEY_STRING: a leaf entry holds an 8B pointer to a key blob in NVM, and
+ * the 1B fingerprints in the leaf header filter the blobs to compare.  An
+ * inserted key is copied to NVM and flushed before the leaf entry is
+ * written, and the caller issues one sfence (keyFence) after the keys of
+ * an operation are flushed, because an entry in line 0 shares the cache
+ * line with the bitmap, so the bitmap never exposes a blob that is not
+ * persistent.  bulkload writes leaves that are not reachable until
+ * setFirstLeaf, whose sfence orders the flushes.
+ *
+ * A key blob is the data of a record in the worker's value heap, so a
+ * deleted key is retired like a value, and recoverValues rebuilds the
+ * bitmaps of the key records after a crash.
+ *
+ * A non-leaf node holds suffix-truncated separators in DRAM: the shortest
+ * prefix of the right key that is larger than the left key.  They are
+ * allocated from per-worker size classes, and a separator that is removed
+ * from a node is retired until a grace period of epochManager has passed,
+ * because concurrent searches may still compare with it.
+ *
+ * The other key types are stored in place, and the functions return the
+ * key or do nothing.
+ */
+#ifdef KEY_STRING
+#define KEY_CHUNK_SIZE   (64*1024)  /* keeps the pools node-aligned */
+#define KEY_MIN_CLASS    4          /* 16B separators */
+#define KEY_MAX_CLASS    11         /* strKeyBlobSize(STR_KEY_MAX_LEN) */
+
+typedef struct keyHeap {
+    char *  cur;                        /* the current chunk */
+    char *  end;
+    void *  free[KEY_MAX_CLASS+1];      /* free separators by size class */
+
+    /* retired separators waiting for a grace period, by epoch % EBR_LIMBO_NUM */
+    void ** limbo[EBR_LIMBO_NUM];
+    int     limbo_num[EBR_LIMBO_NUM];
+    int     limbo_cap[EBR_LIMBO_NUM];
+    unsigned long long limbo_epoch[EBR_LIMBO_NUM];
+    int     retired;                    /* since the last advance attempt */
+} keyHeap;
+
+static keyHeap separator_heaps[EBR_MAX_WORKERS];
+
+static inline int keyClass(unsigned long size)
+{
+    int c= KEY_MIN_CLASS;
+    while ((1UL << c) < size) c++;
+    return c;
+}
+
+// move the separators retired in epochs <= e-2 to the free lists
+static void reclaimSeparators(keyHeap &h, unsigned long long e)
+{
+    for (int i=0; i<EBR_LIMBO_NUM; i++) {
+       if (h.limbo_num[i] && (h.limbo_epoch[i] + 2 <= e)) {
+          for (int j=0; j<h.limbo_num[i]; j++) {
+             void *p= h.limbo[i][j];
+             int c= keyClass(strKeyBlobSize(*(unsigned int *)p));
+             *((void **)p)= h.free[c];
+             h.free[c]= p;
+          }
+          h.limbo_num[i]= 0;
+       }
+    }
+}
+
+static void * allocSeparator(unsigned long size)
+{
+    keyHeap &h= separator_heaps[worker_id];
+    int c= keyClass(size);
+
+    if (h.free[c] == NULL) reclaimSeparators(h, the_epochs.em_global);
+    void *p= h.free[c];
+    if (p) {h.free[c]= *((void **)p); return p;}
+
+    // the rest of the old chunk is not used
+    if (h.end - h.cur < (1L << c)) {
+        h.cur= (char *)mempool_alloc(KEY_CHUNK_SIZE);
+        h.end= h.cur + KEY_CHUNK_SIZE;
+    }
+    p= h.cur;
+    h.cur += (1L << c);
+    return p;
+}
+
+// a separator that has been removed from a non-leaf node.  It is not
+// written until it is reused, so concurrent searches see the key.
+static void retireSeparator(const key_type &key)
+{
+    keyHeap &h= separator_heaps[worker_id];
+    unsigned long long e= the_epochs.em_global;
+    reclaimSeparators(h, e);
+
+    // the array of epoch e is empty or holds separators of epoch e
+    int i= e % EBR_LIMBO_NUM;
+    if (h.limbo_num[i] == h.limbo_cap[i]) {
+       h.limbo_cap[i]= (h.limbo_cap[i] ? 2*h.limbo_cap[i] : 256);
+       h.limbo[i]= (void **)realloc(h.limbo[i], h.limbo_cap[i]*sizeof(void *));
+       if (h.limbo[i] == NULL) {perror("realloc"); exit(1);}
+    }
+    h.limbo[i][h.limbo_num[i]++]= (void *)(key.p);
+    h.limbo_epoch[i]= e;
+
+    if (++h.retired >= EBR_ADVANCE_STEP) {
+       h.retired= 0;
+       the_epochs.advance();
+    }
+}
+
+// the value record that holds a key blob
+static inline nvmValue * keyRecord(const key_type &key)
+{ return (nvmValue *)(key.p - sizeof(nvmValue)); }
+
+// copy a key to NVM and flush it.  The caller calls keyFence before it
+// writes the leaf entry.
+static inline key_type persistKey(const key_type &key)
+{
+    unsigned long size= strKeyBlobSize(key.len());
+    nvmValue *v= nvmvalue_alloc(size);
+    key_type nk= strKeyWrite(v->data, key.data(), key.len());
+    clwbmore(v, v->data + size - 1);
+    return nk;
+}
+
+static inline void keyFence(void) { sfence(); }
+
+// retire the key of a leaf entry that has been deleted
+static inline void retireKey(const key_type &key)
+{ nvmvalue_retire(keyRecord(key)); }
+
+// a separator s in DRAM with left < s <= right
+static inline key_type nonleafKey(const key_type &left, const key_type &right)
+{
+    unsigned int len= strKeySeparatorLen(left, right);
+    void *p= allocSeparator(strKeyBlobSize(len));
+    return strKeyWrite(p, right.data(), len);
+}
+
+#else
+static inline const key_type & persistKey(const key_type &key)
+{ return key; }
+
+static inline void keyFence(void) { }
+
+static inline void retireKey(const key_type &key) { }
+
+static inline const key_type & nonleafKey(const key_type &left,
+                                          const key_type &right)
+{ return right; }
+
+static inline void retireSeparator(const key_type &key) { }
+#endif
+
+/* ----------------------------------------------------------------- *
+ concurrency control
+ * ----------------------------------------------------------------- */
+
+/* CC_RTM and CC_LOCK: Part 1 of an operation runs in an RTM transaction.
+ * After RTM_MAX_RETRY aborts (other than aborts due to lock bits), or in
+ * CC_LOCK mode, Part 1 runs non-transactionally while holding a global
+ * fallback lock instead.  Transactions read the fallback lock so that they
+ * abort when a thread takes the lock.  Part 2 and Part 3 are protected by
+ * the lock bits in nodes in both cases.
+ */
+typedef struct alignas(CACHE_LINE_SIZE) fallbackLock {
+    std::atomic<int>  locked;
+} fallbackLock;
+
+static fallbackLock the_fallback_lock;
+
+#define XABORT_FALLBACK   0xff
+
+// per worker thread statistics
+static txStats * tx_stats= NULL;
+
+#ifndef NO_TX_STAT
+#define TX_STAT(op, outcome)    (tx_stats[worker_id].count[op][outcome]++)
+#else
+#define TX_STAT(op, outcome)
+#endif
+
+// _xabort codes 1..11: the operation and the type of the lock bit
+#define TX_ABORT_CODE_NUM   12
+
+static const int abort_op[TX_ABORT_CODE_NUM]= {0,
+    TX_OP_LOOKUP, TX_OP_LOOKUP, TX_OP_INSERT, TX_OP_INSERT,
+    TX_OP_DEL, TX_OP_DEL, TX_OP_DEL, TX_OP_SCAN, TX_OP_SCAN,
+    TX_OP_UPDATE, TX_OP_UPDATE};
+static const int abort_lock[TX_ABORT_CODE_NUM]= {0,
+    TX_LOCK_NONLEAF, TX_LOCK_LEAF, TX_LOCK_NONLEAF, TX_LOCK_LEAF,
+    TX_LOCK_NONLEAF, TX_LOCK_LEAF, TX_LOCK_SIBLING, TX_LOCK_NONLEAF,
+    TX_LOCK_LEAF, TX_LOCK_NONLEAF, TX_LOCK_LEAF};
+
+/**
+ * start Part 1 of an operation
+ *
+ * @param retries  number of aborts so far
+ * @param op       the operation (TX_OP_*) for statistics
+ * @retval true if in an RTM transaction, false if holding the fallback lock
+ *
+ * This must be inlined because aborted transactions restart at _xbegin().
+ */
+static inline __attribute__((always_inline)) bool txBegin(int &retries, int op)
+{
+    if (cc_mode == CC_RTM) {
+       while (retries < RTM_MAX_RETRY) {
+          unsigned int status= _xbegin();
+          if (status == _XBEGIN_STARTED) {
+             if (the_fallback_lock.locked.load(std::memory_order_relaxed) == 0)
+                return true;
+             _xabort(XABORT_FALLBACK);
+          }
+
+          // lock bits are set: retry without counting the abort
+          if (status & _XABORT_EXPLICIT) {
+             int code= _XABORT_CODE(status);
+             if (code != XABORT_FALLBACK) {
+                TX_STAT(op, ((code < TX_ABORT_CODE_NUM) ? abort_lock[code]
+                                                        : TX_OTHER));
+                continue;
+             }
+             TX_STAT(op, TX_LOCK_FALLBACK);
+          }
+          else if (status & _XABORT_CAPACITY) TX_STAT(op, TX_CAPACITY);
+          else if (status & _XABORT_CONFLICT) TX_STAT(op, TX_CONFLICT);
+          else if (status & _XABORT_RETRY)    TX_STAT(op, TX_RETRY);
+          else                                TX_STAT(op, TX_OTHER);
+
+          retries= ((status & _XABORT_CAPACITY) ? RTM_MAX_RETRY : retries+1);
+
+          while (the_fallback_lock.locked.load(std::memory_order_relaxed))
+             _mm_pause();
+       }
+    }
+
+    // take the fallback lock
+    while (the_fallback_lock.locked.exchange(1, std::memory_order_acquire)) {
+       while (the_fallback_lock.locked.load(std::memory_order_relaxed))
+          _mm_pause();
+    }
+    TX_STAT(op, TX_FALLBACK);
+    return false;
+}
+
+/**
+ * end Part 1 of an operation
+ */
+static inline __attribute__((always_inline)) void txEnd(bool in_tx, int op)
+{
+    if (in_tx) {
+       _xend();
+       TX_STAT(op, TX_COMMIT);
+    }
+    else the_fallback_lock.locked.store(0, std::memory_order_release);
+}
+
+// abort Part 1 because of a lock bit, the caller then restarts Part 1
+#define TX_ABORT(in_tx, code)                                       \
+    { if (in_tx) _xabort(code);                                     \
+      else {TX_STAT(abort_op[code], abort_lock[code]);              \
+            txEnd(false, abort_op[code]);}                          \
+    }
+
+void lbtree::initTxStats(void)
+{
+    if (tx_stats) return;
+
+    tx_stats= (txStats *) memalign(CACHE_LINE_SIZE,
+                                   sizeof(txStats) * worker_thread_num);
+    if (!tx_stats) {perror("memalign"); exit(1);}
+    clearTxStats();
 }
 
+void lbtree::clearTxStats(void)
+{
+    memset(tx_stats, 0, sizeof(txStats) * worker_thread_num);
+}
+
+/**
+ * sum up the statistics of all worker threads
+ *
+ * @param total  return the counters of every operation and outcome
+ */
+void lbtree::getTxStats(txStats *total)
+{
+    memset(total, 0, sizeof(txStats));
+    for (int w=0; w<worker_thread_num; w++)
+       for (int op=0; op<TX_OP_NUM; op++)
+          for (int k=0; k<TX_STAT_NUM; k++)
+             total->count[op][k] += tx_stats[w].count[op][k];
+}
+
+void lbtree::print_stats(void)
+{
+#ifdef NO_TX_STAT
+    printf("RTM statistics are disabled by NO_TX_STAT\n");
+#else
+    static const char *op_name[TX_OP_NUM]= {"lookup", "insert", "del", "scan",
+                                            "update"};
+    static const char *stat_name[TX_STAT_NUM]= {"commit", "conflict",
+        "capacity", "retry", "other", "fallback", "nonleaf-lk", "leaf-lk",
+        "sibling-lk", "fallback-lk"};
+
+    txStats total;
+    getTxStats(&total);
+
+    printf("RTM statistics (RTM_MAX_RETRY= %d)\n", RTM_MAX_RETRY);
+    printf("%-8s", "");
+    for (int k=0; k<TX_STAT_NUM; k++) printf(" %12s", stat_name[k]);
+    printf("\n");
+
+    for (int op=0; op<TX_OP_NUM; op++) {
+       printf("%-8s", op_name[op]);
+       for (int k=0; k<TX_STAT_NUM; k++) printf(" %12lld", total.count[op][k]);
+       printf("\n");
+    }
+#endif
+}
+
+/* CC_OLC: readers record the versions of the nodes on the path, and
+ * validate the version of a node after reading it.  Writers set the lock
+ * bits with compare-and-swap from the recorded versions.  The lock word of
+ * a non-leaf node is a version.  The version of a leaf is its counter in
+ * leaf_versions[] (see bleaf::lockVersion).  A reader gets the counter
+ * before it checks the lock bit in word 0.
+ */
+#define olc_barrier()   asm volatile("" ::: "memory")
+
+leafVersion leaf_versions[LEAF_VERSION_NUM];
+
 /* ----------------------------------------------------------------- *
  bulk load
  * ----------------------------------------------------------------- */
@@ -124,7 +452,7 @@ int lbtree::bulkloadSubtree(
     int nodenum= n_nodes[0];
 
     bleafMeta leaf_meta;
-    leaf_meta.v.bitmap= ( ((1<<leaf_fill_num)-1)
+    leaf_meta.v.bitmap= ( ((leafBit(leaf_fill_num))-1)
                          <<(LEAF_KEY_NUM-leaf_fill_num));
     leaf_meta.v.lock= 0;
     leaf_meta.v.alt= 0;
@@ -139,7 +467,7 @@ int lbtree::bulkloadSubtree(
            fillnum= num_key - (nodenum-1)*leaf_fill_num;
            assert(fillnum>=1 && fillnum<=leaf_fill_num);
 
-           leaf_meta.v.bitmap= ( ((1<<fillnum)-1)
+           leaf_meta.v.bitmap= ( ((leafBit(fillnum))-1)
                                 <<(LEAF_KEY_NUM-fillnum));
         }
 
@@ -147,12 +475,12 @@ int lbtree::bulkloadSubtree(
         for (int j=LEAF_KEY_NUM-fillnum; j<LEAF_KEY_NUM; j++) {
 
             // get key from input
-            key_type mykey= (key_type)(input->get_key(key_id));
+            key_type mykey= input->get_key(key_id);
             key_id ++;
 
             // entry
-            lp->k(j) = mykey;
-            lp->ch(j) = (void *)mykey;
+            lp->k(j) = persistKey(mykey);
+            lp->ch(j) = keyToPtr(mykey);
 
             // hash 
             leaf_meta.v.fgpt[j]= hashcode1B(mykey);
@@ -170,6 +498,7 @@ int lbtree::bulkloadSubtree(
         // populate nonleaf node
         Pointer8B child= lp;
         key_type  left_key= lp->k(LEAF_KEY_NUM-fillnum);
+        if (i > 0) left_key= nonleafKey(leaf[i-1].k(LEAF_KEY_NUM-1), left_key);
 
         // append (left_key, child) to level ll node
         // child is the level ll-1 node to be appended.
@@ -343,8 +672,8 @@ bool free_above_level_nodes)
 
 typedef struct BldThArgs {
 
-    key_type start_key; // input
-    key_type num_key;   // input
+    long long start_key; // input
+    long long num_key;   // input
 
     int top_level;  // output
     int n_nodes[32];  // output
@@ -357,6 +686,9 @@ typedef struct BldThArgs {
 //
 int lbtree::bulkload (int keynum, keyInput *input, float bfill)
 {
+    // the leaf list will be replaced
+    tree_meta->newGeneration();
+
     // 1. allocate BldThArgs[]
     int num_threads= ((keynum>worker_thread_num*10) ?  worker_thread_num : 1);
 
@@ -399,6 +731,7 @@ int lbtree::bulkload (int keynum, keyInput *input, float bfill)
     for (int i=0; i<num_threads; i++) {
        threads[i] = std::thread([=](){
                        worker_id= i;
+                       the_placement.pin(i);
                        keyInput *cursor= input->openCursor(
                                        bta[i].start_key, bta[i].num_key);
                        bta[i].top_level= bulkloadSubtree(
@@ -428,6 +761,10 @@ int lbtree::bulkload (int keynum, keyInput *input, float bfill)
     for (int i=0; i<num_threads; i++) {
        bleaf *lp =  bta[i].pfirst[0];
        key_type left_key= lp->k(LEAF_KEY_NUM - lp->num());
+       if (i > 0) {
+          bleaf *prev= (bleaf *)(bta[i-1].pfirst[0]) + bta[i-1].n_nodes[0] - 1;
+          left_key= nonleafKey(prev->k(LEAF_KEY_NUM-1), left_key);
+       }
        getKeyPtrLevel(bta[i].pfirst[bta[i].top_level], 
                       bta[i].top_level, left_key,
                       level, top_ptrs, top_keys, num_nodes, true);
@@ -456,341 +793,2151 @@ int lbtree::bulkload (int keynum, keyInput *input, float bfill)
 
 
 /* ----------------------------------------------------------------- *
- look up
+ recovery
  * ----------------------------------------------------------------- */
 
-/* leaf is level 0, root is level depth-1 */
+// fill factor of the rebuilt non-leaf nodes, leaving room for insertions
+#define RECOVER_NONLEAF_BFILL   0.7
 
-void * lbtree::lookup (key_type key, int *pos)
+/**
+ * rebuild the DRAM non-leaf nodes from the NVM leaf nodes after restart
+ *
+ * The leaf nodes are visited in key order by following the sibling
+ * pointers from first_leaf.  The lock bits that were set at the time of
+ * the crash are cleared.  Then the non-leaf levels are built on top of
+ * the leaf nodes in the same way as bulkload.
+ */
+void lbtree::recoverTree(void)
 {
-    bnode *p;
-    bleaf *lp;
-    int i,t,m,b;
-    key_type r;
-    
-    unsigned char key_hash= hashcode1B(key);
-    int ret_pos;
-    
-Again1:
-    // 1. RTM begin
-    if(_xbegin() != _XBEGIN_STARTED) goto Again1;
-
-    // 2. search nonleaf nodes
-    p = tree_meta->tree_root;
-    
-    for (i=tree_meta->root_level; i>0; i--) {
-        
-        // prefetch the entire node
-        NODE_PREF(p);
+    // 0. skip the leaf list scan if the checkpoint is still valid
+    if (loadCheckpoint()) return;
+
+    // 1. collect the leaf nodes in the sibling linked list
+    int cap= 1024;
+    int n= 0;
+    Pointer8B *ptrs= (Pointer8B *) malloc(cap * sizeof(Pointer8B));
+    if (!ptrs) {perror("malloc"); exit(1);}
+
+    for (bleaf *lp= *(tree_meta->first_leaf); lp; lp= lp->nextSibling()) {
+       if (n == cap) {
+          cap *= 2;
+          ptrs= (Pointer8B *) realloc(ptrs, cap * sizeof(Pointer8B));
+          if (!ptrs) {perror("realloc"); exit(1);}
+       }
+       ptrs[n++]= lp;
+    }
 
-        // if the lock bit is set, abort
-        if (p->lock()) {_xabort(1); goto Again1;}
-        
-        // binary search to narrow down to at most 8 entries
-        b=1; t=p->num();
-        while (b+7<=t) {
-            m=(b+t) >>1;
-            r= key - p->k(m);
-            if (r>0) b=m+1;
-            else if (r<0) t = m-1;
-            else {p=p->ch(m); goto inner_done;}
-        }
-        
-        // sequential search (which is slightly faster now)
-        for (; b<=t; b++)
-            if (key < p->k(b)) break;
-        p = p->ch(b-1);
-        
-    inner_done: ;
+    if (n == 0) {
+       printf("recovered an empty tree\n");
+       free(ptrs);
+       return;
     }
-    
-    // 3. search leaf node
-    lp= (bleaf *)p;
 
-    // prefetch the entire node
-    LEAF_PREF (lp);
+    key_type *keys= (key_type *) malloc(n * sizeof(key_type));
+    if (!keys) {perror("malloc"); exit(1);}
 
-    // if the lock bit is set, abort
-    if (lp->lock) {_xabort(2); goto Again1;}
+    // 2. compute start and number of leaves for each thread
+    int num_threads= ((n>worker_thread_num*10) ?  worker_thread_num : 1);
 
-    // SIMD comparison
-       // a. set every byte to key_hash in a 16B register 
-    __m128i key_16B = _mm_set1_epi8((char)key_hash);
+    BldThArgs *bta= new BldThArgs[num_threads];
+    if (!bta) {perror("malloc"); exit(1);}
 
-       // b. load meta into another 16B register
-    __m128i fgpt_16B= _mm_load_si128((const __m128i*)lp);
+    int ln_per_thread= floor(n, num_threads);
+    for (int i=0; i<num_threads; i++) {
+       bta[i].start_key= i*ln_per_thread;
+       bta[i].num_key= ((i<num_threads-1)? ln_per_thread
+                                         : n-(num_threads-1)*ln_per_thread);
+    }
 
-       // c. compare them
-    __m128i cmp_res = _mm_cmpeq_epi8(key_16B, fgpt_16B);
+    // 3. clear the lock bits and get the left key of every leaf,
+    //    then build the non-leaf nodes above the leaves of every thread
+    std::thread threads[num_threads];
+    for (int i=0; i<num_threads; i++) {
+       threads[i] = std::thread([=](){
+                       worker_id= i;
+                       the_placement.pin(i);
+                       int start= bta[i].start_key;
+                       int end= start + bta[i].num_key;
+                       key_type min_key, max_key, prev_max;
+
+                       if (start > 0) getMinMaxKey(ptrs[start-1], min_key, prev_max);
+                       for (int j=start; j<end; j++) {
+                          bleaf *lp= ptrs[j];
+                          if (lp->lock) {lp->lock= 0; clwb(lp);}
+                          getMinMaxKey(lp, min_key, max_key);
+                          keys[j]= ((j > 0) ? nonleafKey(prev_max, min_key)
+                                            : min_key);
+                          prev_max= max_key;
+                       }
+                       sfence();
+
+                       if (n == 1) return;  // the leaf is the root
+                       bta[i].top_level= bulkloadToptree(
+                               ptrs+start, keys+start, bta[i].num_key,
+                               RECOVER_NONLEAF_BFILL, 0, 31,
+                               bta[i].pfirst, bta[i].n_nodes);
+                    });
+    }
+    for (int i=0; i<num_threads; i++) threads[i].join();
 
-       // d. generate a mask
-    unsigned int mask= (unsigned int)
-                        _mm_movemask_epi8(cmp_res);  // 1: same; 0: diff
+    // 4. a single leaf or a single thread
+    if (n == 1) {
+        tree_meta->root_level= 0;
+        tree_meta->tree_root= ptrs[0];
+    }
+    else if (num_threads == 1) {
+        tree_meta->root_level=  bta[0].top_level;
+        tree_meta->tree_root=   bta[0].pfirst[tree_meta->root_level];
+        assert(bta[0].n_nodes[bta[0].top_level] == 1);
+    }
 
-    // remove the lower 2 bits then AND bitmap
-    mask=  (mask >> 2)&((unsigned int)(lp->bitmap));
+    // 5. otherwise, build the top non-leaf nodes as in bulkload
+    else {
+        int level= bta[0].top_level;  // subtree 0 .. num_threads-2
 
-    // search every matching candidate
-    ret_pos= -1;
-    while (mask) {
-        int jj = bitScan(mask)-1;  // next candidate
+        Pointer8B top_ptrs[num_threads*3];  // should be < 2*num_threads
+        key_type  top_keys[num_threads*3];
+        int num_nodes= 0;
 
-        if (lp->k(jj) == key) { // found
-           ret_pos= jj;
-           break;
+        for (int i=0; i<num_threads; i++) {
+           getKeyPtrLevel(bta[i].pfirst[bta[i].top_level],
+                          bta[i].top_level, keys[bta[i].start_key],
+                          level, top_ptrs, top_keys, num_nodes, true);
         }
+        assert(num_nodes <= sizeof(top_keys)/sizeof(key_type));
 
-        mask &= ~(0x1<<jj);  // remove this bit
-    } // end while
+        bta[0].top_level= bulkloadToptree(top_ptrs, top_keys, num_nodes,
+                                          RECOVER_NONLEAF_BFILL, level, 31,
+                                          bta[0].pfirst, bta[0].n_nodes);
 
-    // 4. RTM commit
-    _xend();
+        tree_meta->root_level=  bta[0].top_level;
+        tree_meta->tree_root=   bta[0].pfirst[tree_meta->root_level];
+        assert(bta[0].n_nodes[bta[0].top_level] == 1);
+    }
 
-    *pos=ret_pos;
-    return (void *)lp;
-}
+    printf("recovered %d leaf nodes, root level %d\n",
+           n, tree_meta->root_level);
 
-/* ------------------------------------- *
-   quick sort the keys in leaf node
- * ------------------------------------- */
+    // 6. free the temporary arrays
+    delete[] bta;
+    free(keys);
+    free(ptrs);
+}
 
 
-// pos[] will contain sorted positions
-void lbtree::qsortBleaf(bleaf *p, int start, int end, int pos[])
+// compare two pointers for qsort and bsearch
+static int comparePtr(const void *a, const void *b)
 {
-    if (start >= end) return;
-
-    int pos_start= pos[start];
-    key_type key= p->k(pos_start);  // pivot
-    int l, r;
-        
-    l= start;  r=end;
-    while (l<r) {
-        while ((l<r) && (p->k(pos[r])>key)) r--;
-        if (l<r) {
-            pos[l]= pos[r];
-            l++;
-        }
-        while ((l<r) && (p->k(pos[l])<=key)) l++;
-        if (l<r) {
-            pos[r]= pos[l];
-            r--;
-        }
-    }
-    pos[l]= pos_start;
-    qsortBleaf(p, start, l-1, pos);
-    qsortBleaf(p, l+1, end, pos);
+    char *pa= *(char **)a, *pb= *(char **)b;
+    return ((pa > pb) ? 1 : ((pa < pb) ? -1 : 0));
 }
 
-/* ---------------------------------------------------------- *
- 
- insertion: insert (key, ptr) pair into unsorted_leaf_bmp
- 
- * ---------------------------------------------------------- */
-
-void lbtree::insert (key_type key, void *ptr)
+/**
+ * free the leaf nodes that were being allocated at the time of a crash
+ *
+ * Every NVM pool records the last node from alloc_node before it marks the
+ * node in the allocation bitmap.  Such a leaf is published before the
+ * worker allocates again, unless the tree crashed in between.  So a
+ * pending leaf that is not on the leaf list is marked as free.  After a
+ * clean shutdown, all the pending leaves have been published.
+ */
+void lbtree::releasePendingLeaves(void)
 {
-    // record the path from root to leaf
-    // parray[level] is a node on the path
-    // child ppos[level] of parray[level] == parray[level-1]
-    //
-    Pointer8B parray[32];  // 0 .. root_level will be used
-    short     ppos[32];    // 1 .. root_level will be used
-    bool      isfull[32];  // 0 .. root_level will be used
+    char *pending[NVMPOOL_MAX_WORKERS];
+    int num= the_thread_nvmpools.get_pending(pending);
+    if ((num == 0) || tree_meta->nvm_meta->clean) return;
+
+    // 1. sort the pending nodes and remove duplicates
+    qsort(pending, num, sizeof(char *), comparePtr);
+    int n= 1;
+    for (int i=1; i<num; i++) {
+       if (pending[i] != pending[n-1]) pending[n++]= pending[i];
+    }
+    num= n;
 
-    unsigned char key_hash= hashcode1B(key);
-    volatile long long sum;
+    // 2. find the leaves on the leaf list (pending stays sorted)
+    bool published[NVMPOOL_MAX_WORKERS];
+    for (int i=0; i<num; i++) published[i]= false;
 
-    /* Part 1. get the positions to insert the key */
-  { bnode *p;
-    bleaf *lp;
-    int i,t,m,b;
-    key_type r;
-    
-Again2:
-    // 1. RTM begin
-    if(_xbegin() != _XBEGIN_STARTED) {
-        // random backoff
-        // sum= 0; 
-        // for (int i=(rdtsc() % 1024); i>0; i--) sum += i;
-        goto Again2;
+    for (bleaf *lp= *(tree_meta->first_leaf); lp; lp= lp->nextSibling()) {
+       char **pp= (char **)bsearch(&lp, pending, num, sizeof(char *), comparePtr);
+       if (pp) published[pp - pending]= true;
     }
 
-    // 2. search nonleaf nodes
-    p = tree_meta->tree_root;
-    
-    for (i=tree_meta->root_level; i>0; i--) {
-        
-        // prefetch the entire node
-        NODE_PREF(p);
+    // 3. the others were not published
+    n= 0;
+    for (int i=0; i<num; i++) {
+       if (! published[i]) {
+          the_thread_nvmpools.release_node(pending[i]);
+          n ++;
+       }
+    }
+    if (n > 0) printf("released %d unpublished leaf nodes\n", n);
+}
 
-        // if the lock bit is set, abort
-        if (p->lock()) {_xabort(3); goto Again2;}
+/**
+ * rebuild the bitmaps of the value chunks from the leaf entries
+ *
+ * After a crash, a record may have been allocated but not published, or
+ * retired before its bit was persistent.  So every bit is recomputed from
+ * the records that are reachable, including the key records of KEY_STRING.
+ * After a clean shutdown, the bitmaps are exact.
+ */
+void lbtree::recoverValues(void)
+{
+    if (tree_meta->nvm_meta->clean) return;
+    if (! the_thread_nvmpools.begin_value_recovery()) return;
+
+    for (bleaf *lp= *(tree_meta->first_leaf); lp; lp= lp->nextSibling()) {
+       leafBitmap bmp= lp->bitmap;
+       for (int i=0; i<LEAF_KEY_NUM; i++) {
+          if (bmp & leafBit(i)) {
+             the_thread_nvmpools.recover_value((void *)(lp->ch(i)));
+#ifdef KEY_STRING
+             the_thread_nvmpools.recover_value(keyRecord(lp->k(i)));
+#endif
+          }
+       }
+    }
 
-        parray[i]= p;
-        isfull[i]= (p->num() == NON_LEAF_KEY_NUM);
+    the_thread_nvmpools.end_value_recovery();
+}
 
-        // binary search to narrow down to at most 8 entries
-        b=1; t=p->num();
-        while (b+7<=t) {
-            m=(b+t) >>1;
-            r= key - p->k(m);
-            if (r>0) b=m+1;
-            else if (r<0) t = m-1;
-            else {p=p->ch(m); ppos[i]=m; goto inner_done;}
+/**
+ * count the non-leaf nodes in the subtree rooted at pnode
+ *
+ * @retval -1 if a node has an invalid number of keys, which is possible
+ *         only if the nodes are being changed
+ */
+int lbtree::countNonleaf(Pointer8B pnode, int level)
+{
+    if (level == 0) return 0;
+
+    bnode *p= pnode;
+    int num= 1;
+    if (level > 1) {
+        int n= p->num();
+        if ((unsigned int)n > NON_LEAF_KEY_NUM) return -1;
+        for (int i=0; i<=n; i++) {
+            int c= countNonleaf(p->ch(i), level-1);
+            if (c < 0) return -1;
+            num += c;
         }
-        
-        // sequential search (which is slightly faster now)
-        for (; b<=t; b++)
-            if (key < p->k(b)) break;
-        p = p->ch(b-1); ppos[i]= b-1;
-        
-    inner_done: ;
     }
-    
-    // 3. search leaf node
-    lp= (bleaf *)p;
-
-    // prefetch the entire node
-    LEAF_PREF (lp);
-
-    // if the lock bit is set, abort
-    if (lp->lock) {_xabort(4); goto Again2;}
+    return num;
+}
 
-    parray[0]= lp;
+/**
+ * write the non-leaf nodes to a checkpoint on NVM
+ *
+ * The nodes are copied in breadth-first order.  A child pointer above
+ * level 1 is replaced with the index of the child in the image so that
+ * the image can be loaded at any DRAM address.
+ *
+ * A worker thread may take a checkpoint between its operations while the
+ * other threads keep running.  Setting ckpt_state to CKPT_VALID starts a
+ * new generation: a thread that adds or removes a leaf after that
+ * increments gen (see newGeneration), so the checkpoint becomes invalid.
+ * The operations that started before may still be changing the non-leaf
+ * nodes, so the copy starts after a grace period of epochManager, and it
+ * is discarded if the leaf list changes in the meantime.  So a checkpoint
+ * succeeds while no leaf is split or removed, which is also when it is
+ * useful.  One thread writes a checkpoint at a time, and a concurrent
+ * call returns at once.  There is no timer: the application calls
+ * checkpoint periodically, e.g. from one of its worker threads.
+ *
+ * If the tree has outgrown the region of the old checkpoint, a new region
+ * is allocated.  The old region is freed after the new checkpoint is
+ * written.  prev in the new header records it until then, so that
+ * recovery frees it after a crash.
+ *
+ * @param shutdown  mark the tree as cleanly shut down
+ */
+void lbtree::checkpoint (bool shutdown)
+{
+    nvmTreeMeta *nm= tree_meta->nvm_meta;
 
-    // SIMD comparison
-       // a. set every byte to key_hash in a 16B register 
-    __m128i key_16B = _mm_set1_epi8((char)key_hash);
+    if (tree_meta->tree_root.isNull()) return;  // empty tree
 
-       // b. load meta into another 16B register
-    __m128i fgpt_16B= _mm_load_si128((const __m128i*)lp);
+#ifdef KEY_STRING
+    // the separators are in DRAM, so the non-leaf nodes are always
+    // rebuilt from the leaf nodes after restart
+    if (shutdown) tree_meta->setClean(1);
+    return;
+#endif
 
-       // c. compare them
-    __m128i cmp_res = _mm_cmpeq_epi8(key_16B, fgpt_16B);
+    int busy= 0;
+    if (! tree_meta->ckpt_writer.compare_exchange_strong(busy, 1)) return;
+
+    // 0. the latest checkpoint is still valid
+    if (tree_meta->ckpt_state.load() == CKPT_VALID) {
+        if (shutdown) tree_meta->setClean(1);
+        tree_meta->ckpt_writer= 0;
+        return;
+    }
+
+    // 1. start a new generation, then wait for the operations that may
+    //    have changed the leaf list before
+    while (tree_meta->ckpt_state.load() != CKPT_STALE) _mm_pause();
+    unsigned long long gen= nm->gen;
+    tree_meta->ckpt_state.store(CKPT_VALID);
+    the_epochs.synchronize();
+
+    bool ok= true;
+  {
+    epochGuard guard;
+    int root_level= tree_meta->root_level;
+    Pointer8B root= tree_meta->tree_root;
+
+    // 2. get an NVM region for the checkpoint
+    int num_nodes= countNonleaf(root, root_level);
+    if ((num_nodes < 0) || (tree_meta->ckpt_state.load() != CKPT_VALID)) {
+        num_nodes= 0; ok= false;
+    }
+    long long size= CACHE_LINE_SIZE + sizeof(bnode) * (long long)num_nodes;
+
+    ckptHeader *ck= nm->ckpt;
+    ckptHeader *old= NULL;
+    if (! ok) {
+        ck= NULL;
+    }
+    else if ((ck != NULL) && (ck->size >= size)) {
+        // invalidate the old checkpoint before overwriting it
+        ck->magic= 0;
+        clwb(ck); sfence();
+    }
+    else {
+        // leave some room for the tree to grow, and keep the pool aligned
+        // for leaf nodes
+        old= ck;
+        size= CACHE_LINE_SIZE + sizeof(bnode) * (long long)(num_nodes + num_nodes/8);
+        size= (size + LEAF_SIZE - 1) / LEAF_SIZE * LEAF_SIZE;
+        ck= (ckptHeader *) nvmpool_alloc(size);
+        ck->magic= 0; ck->size= size; ck->prev= old;
+        clwb(ck); sfence();
+
+        nm->ckpt= ck;
+        clwb(&(nm->ckpt)); sfence();
+    }
+
+    // 3. copy the non-leaf nodes level by level
+    //    A node may be changed only if the leaf list is changed, which
+    //    also invalidates the image.  The copy checks the number of keys
+    //    so that it does not follow invalid pointers in the meantime.
+    int n= 0, first= 0;
+    if (ok) {
+        bnode *image= ckptImage(ck);
+        long long cap= (ck->size - CACHE_LINE_SIZE) / sizeof(bnode);
+
+        if (root_level > 0) {
+            image[0]= *((bnode *)root);
+            image[0].lock()= 0;
+            n= 1;
+        }
+        for (int lev=root_level; ok && (lev>1); lev--) {
+            int last= n;  // image[first .. last-1] are at level lev
+            for (int i=first; i<last; i++) {
+                int num= image[i].num();
+                if (((unsigned int)num > NON_LEAF_KEY_NUM) || (n + num + 1 > cap)) {
+                    ok= false; break;
+                }
+                for (int j=0; j<=num; j++) {
+                    image[n]= *((bnode *)(image[i].ch(j)));
+                    image[n].lock()= 0;
+                    image[i].ch(j).value= n;
+                    n ++;
+                }
+            }
+            first= last;
+        }
+        ok= ok && (n == num_nodes)
+               && (tree_meta->ckpt_state.load() == CKPT_VALID);
+
+        if (ok) {
+            if (n > 0) clwbmore(image, (char *)(image + n) - 1);
+            sfence();
+
+            // 4. make the checkpoint valid
+            ck->gen= gen;
+            ck->root_level= root_level;
+            ck->num_nodes= num_nodes;
+            ck->first_level1= first;
+            clwb(ck); sfence();
+
+            ck->magic= CKPT_MAGIC;
+            clwb(ck); sfence();
+        }
+    }
+
+    // 5. free the old region
+    if (old) {
+        the_thread_nvmpools.free_region((char *)old, old->size);
+        ck->prev= NULL;
+        clwb(ck); sfence();
+        the_thread_nvmpools.put_free_region(&the_nvmpool, (char *)old, old->size);
+    }
+
+    if (ok) {
+        printf("checkpoint: %d non-leaf nodes, generation %llu\n",
+               num_nodes, gen);
+    }
+  }
+
+    if (ok) {
+        if (shutdown) tree_meta->setClean(1);
+    }
+    else {
+        // the tree has changed: make sure that the state is stale
+        tree_meta->newGeneration();
+        printf("checkpoint: the leaf list has changed, discarded\n");
+    }
+    tree_meta->ckpt_writer= 0;
+}
+
+/**
+ * load the non-leaf nodes from the checkpoint if it is still valid
+ *
+ * @retval true if the tree is recovered from the checkpoint
+ */
+bool lbtree::loadCheckpoint(void)
+{
+    nvmTreeMeta *nm= tree_meta->nvm_meta;
+    ckptHeader *ck= nm->ckpt;
+
+    // a crash happened before the old region was freed
+    if ((ck != NULL) && (ck->prev != NULL)) {
+        the_thread_nvmpools.free_region((char *)(ck->prev), ck->prev->size);
+        ck->prev= NULL;
+        clwb(ck); sfence();
+    }
+
+    if ((ck == NULL) || (ck->magic != CKPT_MAGIC) || (ck->gen != nm->gen))
+        return false;
+
+    // 1. copy the image to DRAM and turn child indexes into pointers
+    bnode *nodes= NULL;
+
+    if (ck->root_level == 0) {
+        tree_meta->tree_root= *(tree_meta->first_leaf);
+    }
+    else {
+        nodes= (bnode *) mempool_alloc(sizeof(bnode) * ck->num_nodes);
+        memcpy(nodes, ckptImage(ck), sizeof(bnode) * ck->num_nodes);
+
+        for (int i=0; i<ck->first_level1; i++) {
+            for (int j=0; j<=nodes[i].num(); j++)
+                nodes[i].ch(j)= nodes + nodes[i].ch(j).value;
+        }
+        tree_meta->tree_root= nodes;
+    }
+    tree_meta->root_level= ck->root_level;
+
+    // 2. clear the lock bits in the leaf nodes if the tree was not shut
+    //    down cleanly
+    if (! nm->clean) {
+        if (ck->root_level == 0) {
+            bleaf *lp= tree_meta->tree_root;
+            lp->lock= 0;
+            clwb(lp); sfence();
+        }
+        else {
+            int num= ck->num_nodes - ck->first_level1;
+            int num_threads= ((num>worker_thread_num*10) ?  worker_thread_num : 1);
+            int per_thread= floor(num, num_threads);
+
+            std::thread threads[num_threads];
+            for (int i=0; i<num_threads; i++) {
+               threads[i] = std::thread([=](){
+                       int start= ck->first_level1 + i*per_thread;
+                       int end= ((i<num_threads-1) ? start+per_thread
+                                                   : ck->num_nodes);
+                       for (int j=start; j<end; j++) {
+                          for (int k=0; k<=nodes[j].num(); k++) {
+                             bleaf *lp= nodes[j].ch(k);
+                             if (lp->lock) {lp->lock= 0; clwb(lp);}
+                          }
+                       }
+                       sfence();
+                    });
+            }
+            for (int i=0; i<num_threads; i++) threads[i].join();
+        }
+    }
+
+    tree_meta->ckpt_state= CKPT_VALID;
+
+    printf("recovered %d non-leaf nodes from checkpoint, root level %d\n",
+           ck->num_nodes, tree_meta->root_level);
+    return true;
+}
+
+
+/* ----------------------------------------------------------------- *
+ look up
+ * ----------------------------------------------------------------- */
+
+/* leaf is level 0, root is level depth-1 */
+
+/* The non-leaf search kernel is chosen at build time.  By default, it is a
+ * binary search down to 8 entries followed by a sequential search.  Define
+ * NONLEAF_SEARCH_AVX2 (needs -mavx2) or NONLEAF_SEARCH_AVX512 (needs
+ * -mavx512f) to compare the search key with all the keys in the node using
+ * SIMD instead, and count the keys <= the search key.  The SIMD kernels
+ * use fewer instructions, but the child pointer then depends on all the
+ * loads of the node.  The branches of the default search let the CPU
+ * speculatively load the child, which is faster in our tests.
+ */
+#if defined(NONLEAF_SEARCH_AVX512) || defined(NONLEAF_SEARCH_AVX2)
+#if (KEY_SIZE != 8) || defined(KEY_STRING)
+#error "SIMD non-leaf search requires 8B integer keys."
+#endif
+#if (NON_LEAF_KEY_NUM+1 > 32) || ((NON_LEAF_KEY_NUM+1) % 4 != 0)
+#error "SIMD non-leaf search requires 4 .. 32 entries (multiple of 4)."
+#endif
+#endif
+
+/**
+ * search a non-leaf node
+ *
+ * @param p    the non-leaf node
+ * @param num  the number of keys in p
+ * @param key  the search key
+ * @retval the position of the child to follow: p->ch(ret)
+ */
+static inline int searchNonleaf(bnode *p, int num, key_type key)
+{
+#if defined(NONLEAF_SEARCH_AVX512) || defined(NONLEAF_SEARCH_AVX2)
+    // bit 2j corresponds to the key of ent[j], keys 1..num are valid
+    unsigned long long le= 0;
+    // (num == 31 would shift by 64)
+    unsigned long long valid= ((num >= 31) ? ~0ULL : ((1ULL << (2*num+2)) - 1))
+                              & 0x5555555555555555ULL & ~1ULL;
+
+#  if defined(NONLEAF_SEARCH_AVX512)
+    // 4 IdxEntry per 64B: keys are the even 8B lanes
+    __m512i key_64B= _mm512_set1_epi64(key);
+    for (int i=0; i<(NON_LEAF_KEY_NUM+1)/4; i++) {
+        __m512i ent_64B= _mm512_loadu_si512((const void *)&(p->ent[4*i]));
+#    ifndef KEY_UNSIGNED
+        unsigned long long m= (unsigned long long)
+                       _mm512_mask_cmple_epi64_mask(0x55, ent_64B, key_64B);
+#    else
+        unsigned long long m= (unsigned long long)
+                       _mm512_mask_cmple_epu64_mask(0x55, ent_64B, key_64B);
+#    endif
+        le |= (m << (8*i));
+    }
+#  else
+    // 2 IdxEntry per 32B: keys are lanes 0 and 2
+    // (unsigned keys: flip the sign bits for the signed comparison)
+#    ifndef KEY_UNSIGNED
+    __m256i key_32B= _mm256_set1_epi64x(key);
+#    else
+    __m256i sign_32B= _mm256_set1_epi64x(0x8000000000000000LL);
+    __m256i key_32B= _mm256_xor_si256(_mm256_set1_epi64x(key), sign_32B);
+#    endif
+    unsigned long long gt= 0;
+    for (int i=0; i<(NON_LEAF_KEY_NUM+1)/2; i++) {
+        __m256i ent_32B= _mm256_loadu_si256((const __m256i *)&(p->ent[2*i]));
+#    ifdef KEY_UNSIGNED
+        ent_32B= _mm256_xor_si256(ent_32B, sign_32B);
+#    endif
+        __m256i cmp_res= _mm256_cmpgt_epi64(ent_32B, key_32B);
+        unsigned long long m= (unsigned long long)
+                       _mm256_movemask_pd(_mm256_castsi256_pd(cmp_res));
+        gt |= (m << (4*i));
+    }
+    le= ~gt;
+#  endif
+
+    return __builtin_popcountll(le & valid);
+
+#else
+    int t,m,b;
 
-       // d. generate a mask
-    unsigned int mask= (unsigned int)
+    // binary search to narrow down to at most 8 entries
+    b=1; t=num;
+    while (b+7<=t) {
+        m=(b+t) >>1;
+        if (key > p->k(m)) b=m+1;
+        else if (key < p->k(m)) t = m-1;
+        else return m;
+    }
+
+    // sequential search (which is slightly faster now)
+    for (; b<=t; b++)
+        if (key < p->k(b)) break;
+    return b-1;
+#endif
+}
+
+/**
+ * compare the fingerprints of a leaf node with the hash of a search key
+ *
+ * @param lp        the leaf node
+ * @param key_hash  the 1B hash of the search key
+ * @retval the bitmap of the valid slots whose fingerprints match key_hash
+ *
+ * The fingerprints start at byte LEAF_BITMAP_SIZE of the leaf.  We load
+ * the entire header (16B, 32B, or 64B) into SIMD registers, compare every
+ * byte with key_hash, then remove the bits of the bitmap word.
+ */
+static inline leafBitmap leafMatch(bleaf *lp, unsigned char key_hash)
+{
+#if LEAF_HEADER_SIZE == 16
+    __m128i key_16B = _mm_set1_epi8((char)key_hash);
+    __m128i fgpt_16B= _mm_load_si128((const __m128i*)lp);
+    __m128i cmp_res = _mm_cmpeq_epi8(key_16B, fgpt_16B);
+    unsigned long long mask= (unsigned int)
                         _mm_movemask_epi8(cmp_res);  // 1: same; 0: diff
+#elif LEAF_HEADER_SIZE == 32
+    __m256i key_32B = _mm256_set1_epi8((char)key_hash);
+    __m256i fgpt_32B= _mm256_load_si256((const __m256i*)lp);
+    __m256i cmp_res = _mm256_cmpeq_epi8(key_32B, fgpt_32B);
+    unsigned long long mask= (unsigned int)
+                        _mm256_movemask_epi8(cmp_res);
+#elif LEAF_HEADER_SIZE == 64
+    __m256i key_32B = _mm256_set1_epi8((char)key_hash);
+    __m256i fgpt_lo = _mm256_load_si256((const __m256i*)lp);
+    __m256i fgpt_hi = _mm256_load_si256((const __m256i*)lp + 1);
+    unsigned long long mask=
+       ((unsigned long long)(unsigned int)
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(key_32B, fgpt_hi)) << 32)
+       | (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(key_32B, fgpt_lo));
+#else
+#error "unsupported leaf header size"
+#endif
+
+    // remove the bits of the bitmap word then AND bitmap
+    return (leafBitmap)(mask >> LEAF_BITMAP_SIZE) & lp->bitmap;
+}
 
-    // remove the lower 2 bits then AND bitmap
-    mask=  (mask >> 2)&((unsigned int)(lp->bitmap));
+/**
+ * search a leaf node
+ *
+ * @param lp   the leaf node
+ * @param key  the search key
+ * @retval the position of the key in lp, or -1 if not found
+ */
+static inline int searchLeaf(bleaf *lp, key_type key)
+{
+    leafBitmap mask= leafMatch(lp, hashcode1B(key));
 
     // search every matching candidate
     while (mask) {
-        int jj = bitScan(mask)-1;  // next candidate
+        int jj = leafBitScan(mask)-1;  // next candidate
 
-        if (lp->k(jj) == key) { // found: do nothing, return
-           _xend();
-           return;
-        }
+        if (lp->k(jj) == key) return jj;  // found
 
-        mask &= ~(0x1<<jj);  // remove this bit
+        mask &= ~leafBit(jj);  // remove this bit
     } // end while
 
-    // 4. set lock bits before exiting the RTM transaction
-    lp->lock= 1;
+    return -1;
+}
 
-    isfull[0]= lp->isFull();
-    if (isfull[0]) {
-        for (i=1; i<=tree_meta->root_level; i++) {
-            p= parray[i];
-            p->lock()= 1;
-            if (! isfull[i]) break;
+/**
+ * CC_OLC: search the tree for the key without locking
+ *
+ * @param key     the search key
+ * @param parray  return the nodes on the path (parray[0] is the leaf)
+ * @param ppos    return the child positions: ch(ppos[i]) of parray[i]
+ * @param vers    return the versions of parray[] (the counter of the leaf)
+ * @retval the root level, or -1 if a node is locked or has changed
+ */
+int lbtree::olcSearch(key_type key, Pointer8B parray[], short ppos[],
+                      unsigned long long vers[])
+{
+    bnode *p;
+    int i,t;
+
+    // 1. get the root and its version, then make sure it is still the root
+    Pointer8B root= tree_meta->tree_root;
+    int level= tree_meta->root_level;
+    olc_barrier();
+
+    unsigned long long v= ((level > 0) ? ((bnode *)root)->getVersion()
+                                       : ((bleaf *)root)->getVersion());
+    olc_barrier();
+    if (!(root == tree_meta->tree_root) || (level != tree_meta->root_level))
+        return -1;
+
+    // 2. search nonleaf nodes
+    p= root;
+    for (i=level; i>0; i--) {
+
+        // prefetch the entire node
+        NODE_PREF(p);
+
+        // if the lock bit is set, restart
+        if (v & 1) return -1;
+
+        parray[i]= p; vers[i]= v;
+
+        // a recycled node may contain garbage
+        t= p->num();
+        if ((unsigned int)t > NON_LEAF_KEY_NUM) return -1;
+
+        ppos[i]= searchNonleaf(p, t, key);
+        Pointer8B child= p->ch(ppos[i]);
+
+        // get the version of the child, then validate the parent
+        olc_barrier();
+        v= ((i > 1) ? ((bnode *)child)->getVersion()
+                    : ((bleaf *)child)->getVersion());
+        olc_barrier();
+        if (p->getVersion() != (int)vers[i]) return -1;
+
+        p= child;
+    }
+
+    // 3. the leaf node
+    olc_barrier();
+    if (((bleaf *)p)->getWord0() & LEAF_LOCK_BIT) return -1;
+    parray[0]= p; vers[0]= v;
+
+    return level;
+}
+
+void * lbtree::lookup (key_type key, int *pos)
+{
+    epochGuard guard;
+    bnode *p;
+    bleaf *lp;
+    int i;
+    int ret_pos;
+
+    bool in_tx;
+    int  retries= 0;
+
+    Pointer8B          parray[32];  // CC_OLC: the path
+    short              ppos[32];
+    unsigned long long vers[32];
+
+    // CC_OLC: search without locking, then validate the leaf
+    if (cc_mode == CC_OLC) {
+    AgainO1:
+        if (olcSearch(key, parray, ppos, vers) < 0) goto AgainO1;
+        lp= parray[0];
+        goto leaf_search;
+    }
+    
+Again1:
+    // 1. RTM begin
+    in_tx= txBegin(retries, TX_OP_LOOKUP);
+
+    // 2. search nonleaf nodes
+    p = tree_meta->tree_root;
+    
+    for (i=tree_meta->root_level; i>0; i--) {
+        
+        // prefetch the entire node
+        NODE_PREF(p);
+
+        // if the lock bit is set, abort
+        if (p->isLocked()) {TX_ABORT(in_tx, 1); goto Again1;}
+        
+        p= p->ch(searchNonleaf(p, p->num(), key));
+    }
+    
+    // 3. search leaf node
+    lp= (bleaf *)p;
+
+    // if the lock bit is set, abort
+    if (lp->lock) {TX_ABORT(in_tx, 2); goto Again1;}
+
+leaf_search:
+    // prefetch the entire node
+    LEAF_PREF_NVM(lp);
+
+    ret_pos= searchLeaf(lp, key);
+
+    // 4. RTM commit, or validate the leaf in CC_OLC mode
+    if (cc_mode == CC_OLC) {
+        olc_barrier();
+        if (lp->getVersion() != vers[0]) goto AgainO1;
+    }
+    else txEnd(in_tx, TX_OP_LOOKUP);
+
+    *pos=ret_pos;
+    return (void *)lp;
+}
+
+/**
+ * look up a batch of keys
+ *
+ * The traversals of a group of keys proceed level by level.  At every
+ * level, the nodes of all the keys in the group are prefetched before any
+ * of them is visited so that the cache misses of different keys overlap.
+ */
+int lbtree::lookupBatch(const key_type keys[], int n, void *leaves[], int pos[])
+{
+    epochGuard guard;
+    int found= 0;
+
+    for (int base=0; base<n; base+=LOOKUP_BATCH_GROUP) {
+        int num= min(n-base, LOOKUP_BATCH_GROUP);
+
+        if (cc_mode == CC_OLC)
+            olcLookupGroup(keys+base, num, leaves+base, pos+base);
+        else
+            txLookupGroup(keys+base, num, leaves+base, pos+base);
+
+        for (int k=base; k<base+num; k++) {
+            if (pos[k] < 0) continue;
+            found ++;
+#ifdef PREFETCH_RECORD
+            // the record fetches overlap with the traversal of the next group
+            _mm_prefetch((char *)(void *)((bleaf *)leaves[k])->ch(pos[k]),
+                         _MM_HINT_T0);
+#endif
         }
     }
 
-    // 5. RTM commit
-    _xend();
+    return found;
+}
 
-  } // end of Part 1
+/**
+ * CC_RTM and CC_LOCK: look up a group of keys in a single Part 1
+ */
+void lbtree::txLookupGroup(const key_type keys[], int num,
+                           void *leaves[], int pos[])
+{
+    Pointer8B p[LOOKUP_BATCH_GROUP];
+    int i, k;
 
-    /* Part 2. leaf node */
-  {
-    bleaf *lp= parray[0];
-    bleafMeta meta= *((bleafMeta *)lp);
+    bool in_tx;
+    int  retries= 0;
 
+Again10:
+    // 1. RTM begin
+    in_tx= txBegin(retries, TX_OP_LOOKUP);
 
-    /* 1. leaf is not full */
-    if (! isfull[0]) {
+    // 2. search nonleaf nodes
+    for (k=0; k<num; k++) p[k]= tree_meta->tree_root;
 
-       meta.v.lock= 0;  // clear lock in temp meta
+    for (i=tree_meta->root_level; i>0; i--) {
 
-       // 1.1 get first empty slot
-       uint16_t bitmap= meta.v.bitmap;
-       int slot= bitScan(~bitmap)-1;
+        // prefetch the nodes of all the keys before visiting any of them
+        for (k=0; k<num; k++) NODE_PREF(p[k]);
+
+        for (k=0; k<num; k++) {
+            bnode *q= p[k];
+
+            // if the lock bit is set, abort
+            if (q->isLocked()) {TX_ABORT(in_tx, 1); goto Again10;}
+
+            p[k]= q->ch(searchNonleaf(q, q->num(), keys[k]));
+        }
+    }
+
+    // 3. search leaf nodes
+    for (k=0; k<num; k++) LEAF_PREF_NVM(p[k]);
+
+    for (k=0; k<num; k++) {
+        bleaf *lp= p[k];
+
+        // if the lock bit is set, abort
+        if (lp->lock) {TX_ABORT(in_tx, 2); goto Again10;}
+
+        leaves[k]= lp;
+        pos[k]= searchLeaf(lp, keys[k]);
+    }
+
+    // 4. RTM commit
+    txEnd(in_tx, TX_OP_LOOKUP);
+}
+
+/**
+ * CC_OLC: look up a group of keys
+ *
+ * Every key advances one level per round as in olcSearch().  A key whose
+ * validation fails restarts from the root without affecting the others.
+ */
+void lbtree::olcLookupGroup(const key_type keys[], int num,
+                            void *leaves[], int pos[])
+{
+    Pointer8B node[LOOKUP_BATCH_GROUP];   // the node to visit next
+    bnode *   parent[LOOKUP_BATCH_GROUP]; // NULL if node is the root
+    int       pver[LOOKUP_BATCH_GROUP];   // the version of parent
+    int       level[LOOKUP_BATCH_GROUP];  // the level of node, -1 if done
+    int k, todo;
+
+#define OLC_RESTART(k)                                           \
+    { node[k]= tree_meta->tree_root; level[k]= tree_meta->root_level; \
+      olc_barrier(); parent[k]= NULL; }
+
+    for (k=0; k<num; k++) OLC_RESTART(k);
+    todo= num;
+
+    while (todo > 0) {
+
+        // prefetch the nodes of all the keys before visiting any of them
+        for (k=0; k<num; k++) {
+            if (level[k] > 0) NODE_PREF(node[k]);
+            else if (level[k] == 0) LEAF_PREF_NVM(node[k]);
+        }
+
+        for (k=0; k<num; k++) {
+            if (level[k] < 0) continue;
+
+            // get the version of the node, then validate the parent
+            unsigned long long v= ((level[k] > 0)
+                                   ? ((bnode *)node[k])->getVersion()
+                                   : ((bleaf *)node[k])->getVersion());
+            olc_barrier();
+            if (parent[k] ? (parent[k]->getVersion() != pver[k])
+                          : (!(node[k] == tree_meta->tree_root)
+                             || (level[k] != tree_meta->root_level))) {
+                OLC_RESTART(k); continue;
+            }
+
+            // a non-leaf node
+            if (level[k] > 0) {
+                bnode *p= node[k];
+                int t= p->num();
+                if ((v & 1) || ((unsigned int)t > NON_LEAF_KEY_NUM)) {
+                    OLC_RESTART(k); continue;
+                }
+                parent[k]= p; pver[k]= (int)v;
+                node[k]= p->ch(searchNonleaf(p, t, keys[k]));
+                level[k] --;
+                olc_barrier();
+                continue;
+            }
+
+            // the leaf node
+            bleaf *lp= node[k];
+            if (lp->getWord0() & LEAF_LOCK_BIT) {OLC_RESTART(k); continue;}
+            int ret_pos= searchLeaf(lp, keys[k]);
+            olc_barrier();
+            if (lp->getVersion() != v) {OLC_RESTART(k); continue;}
+
+            leaves[k]= lp; pos[k]= ret_pos;
+            level[k]= -1; todo --;
+        }
+    }
+
+#undef OLC_RESTART
+}
+
+/* ------------------------------------- *
+   quick sort the keys in leaf node
+ * ------------------------------------- */
+
+
+// pos[] will contain sorted positions
+void lbtree::qsortBleaf(bleaf *p, int start, int end, int pos[])
+{
+    if (start >= end) return;
+
+    int pos_start= pos[start];
+    key_type key= p->k(pos_start);  // pivot
+    int l, r;
+        
+    l= start;  r=end;
+    while (l<r) {
+        while ((l<r) && (p->k(pos[r])>key)) r--;
+        if (l<r) {
+            pos[l]= pos[r];
+            l++;
+        }
+        while ((l<r) && (p->k(pos[l])<=key)) l++;
+        if (l<r) {
+            pos[r]= pos[l];
+            r--;
+        }
+    }
+    pos[l]= pos_start;
+    qsortBleaf(p, start, l-1, pos);
+    qsortBleaf(p, l+1, end, pos);
+}
+
+/* ---------------------------------------------------------- *
+
+ range scan: return entries in [start_key, end_key] in order
+
+ * ---------------------------------------------------------- */
+
+int lbtree::scan (key_type start_key, key_type end_key, int max_keys,
+                  key_type keys[], void *ptrs[])
+{
+    epochGuard guard;
+    bnode *p;
+    bleaf *lp;
+    int i;
+
+    // leaves are unsorted.  We copy a leaf in an RTM transaction,
+    // then sort the copy outside the transaction.
+    bleaf  leaf_copy;
+    int    pos[LEAF_KEY_NUM];
+    int    count= 0;
+
+    bool in_tx;
+    int  retries= 0;
+
+    Pointer8B          parray[32];  // CC_OLC: the path
+    short              ppos[32];
+    unsigned long long vers[32];
+    unsigned long long lp_ver;      // CC_OLC: the version of lp
+
+    if (max_keys <= 0) return 0;
+
+    /* Part 1. find the start leaf as in lookup */
+
+    // CC_OLC: copy the leaf, then validate it
+    if (cc_mode == CC_OLC) {
+    AgainO8:
+        if (olcSearch(start_key, parray, ppos, vers) < 0) goto AgainO8;
+        lp= parray[0];
+        memcpy(&leaf_copy, lp, sizeof(bleaf));
+        olc_barrier();
+        if (lp->getVersion() != vers[0]) goto AgainO8;
+        lp_ver= vers[0];
+        goto walk_leaves;
+    }
+
+Again8:
+    // 1. RTM begin
+    in_tx= txBegin(retries, TX_OP_SCAN);
+
+    // 2. search nonleaf nodes
+    p = tree_meta->tree_root;
+
+    for (i=tree_meta->root_level; i>0; i--) {
+
+        // prefetch the entire node
+        NODE_PREF(p);
+
+        // if the lock bit is set, abort
+        if (p->isLocked()) {TX_ABORT(in_tx, 8); goto Again8;}
+
+        p= p->ch(searchNonleaf(p, p->num(), start_key));
+    }
+
+    // 3. copy the leaf node
+    lp= (bleaf *)p;
+
+    // prefetch the entire node
+    LEAF_PREF_NVM(lp);
+
+    // if the lock bit is set, abort
+    if (lp->lock) {TX_ABORT(in_tx, 9); goto Again8;}
+
+    memcpy(&leaf_copy, lp, sizeof(bleaf));
+
+    // 4. RTM commit
+    txEnd(in_tx, TX_OP_SCAN);
+
+    /* Part 2. walk the leaf chain */
+walk_leaves:
+    while (1) {
+        bleaf *next= leaf_copy.nextSibling();
+
+        // prefetch the next leaf while sorting the current one
+        if (next) LEAF_PREF_NVM(next);
+
+        // 1. sort the valid entries
+        int num= 0;
+        leafBitmap bmp= leaf_copy.bitmap;
+        for (int j=0; j<LEAF_KEY_NUM; j++) {
+            if (bmp & leafBit(j)) pos[num++]= j;
+        }
+        qsortBleaf(&leaf_copy, 0, num-1, pos);
+
+        // 2. output entries in [start_key, end_key]
+        for (int j=0; j<num; j++) {
+            key_type kk= leaf_copy.k(pos[j]);
+            if (kk < start_key) continue;
+            if (kk > end_key) return count;
+
+            keys[count]= kk;
+            ptrs[count]= leaf_copy.ch(pos[j]);
+            if (++count == max_keys) return count;
+        }
+
+        // 3. copy the next leaf.  lp (the leaf in leaf_copy) must still be
+        //    the left sibling of next.  Otherwise, lp or next has been
+        //    split or removed, and we search again for the keys after lp.
+        if (next == NULL) return count;
+
+        if (num > 0) {
+            key_type last_key= leaf_copy.k(pos[num-1]);
+            if (last_key == MAX_KEY) return count;
+            start_key= nextKey(last_key);
+        }
+
+        if (cc_mode == CC_OLC) {
+            // a change to lp or a removal of next increments lp's version
+            unsigned long long ver= next->getVersion();
+            olc_barrier();
+            memcpy(&leaf_copy, next, sizeof(bleaf));
+            olc_barrier();
+            if (leaf_copy.lock || (next->getVersion() != ver)
+                || (lp->getVersion() != lp_ver))
+                goto AgainO8;
+            lp= next; lp_ver= ver;
+            continue;
+        }
+
+        retries= 0;
+    Again9:
+        in_tx= txBegin(retries, TX_OP_SCAN);
+
+        // a removed lp has NULL sibling pointers (see retireLeaf)
+        if (lp->lock || !(lp->nextSibling() == next)) {
+            txEnd(in_tx, TX_OP_SCAN);
+            retries= 0;
+            goto Again8;
+        }
+
+        // if the lock bit is set, abort
+        if (next->lock) {TX_ABORT(in_tx, 9); goto Again9;}
+
+        memcpy(&leaf_copy, next, sizeof(bleaf));
+
+        txEnd(in_tx, TX_OP_SCAN);
+        lp= next;
+    }
+}
+
+/* ---------------------------------------------------------- *
+ 
+ insertion: insert (key, ptr) pair into unsorted_leaf_bmp
+ 
+ * ---------------------------------------------------------- */
+
+bool lbtree::insert (key_type key, void *ptr)
+{
+    epochGuard guard;
+    // record the path from root to leaf
+    // parray[level] is a node on the path
+    // child ppos[level] of parray[level] == parray[level-1]
+    //
+    Pointer8B parray[32];  // 0 .. root_level will be used
+    short     ppos[32];    // 1 .. root_level will be used
+    bool      isfull[32];  // 0 .. root_level will be used
+
+    unsigned char key_hash= hashcode1B(key);
+    volatile long long sum;
+
+    /* Part 1. get the positions to insert the key */
+
+    // CC_OLC: search without locking, then lock the leaf and the
+    // affected ancestors with compare-and-swap from the recorded versions
+  if (cc_mode == CC_OLC) {
+    bleaf *lp;
+    int i, level;
+    unsigned long long vers[32];
+
+AgainO2:
+    level= olcSearch(key, parray, ppos, vers);
+    if (level < 0) goto AgainO2;
+
+    lp= parray[0];
+
+    // prefetch the entire node
+    LEAF_PREF_NVM(lp);
+
+    // SIMD comparison of the fingerprints
+    leafBitmap mask= leafMatch(lp, key_hash);
+
+    // search every matching candidate
+    while (mask) {
+        int jj = leafBitScan(mask)-1;  // next candidate
+
+        if (lp->k(jj) == key) { // found: do nothing, return false
+           olc_barrier();
+           if (lp->getVersion() != vers[0]) goto AgainO2;
+           return false;
+        }
+
+        mask &= ~leafBit(jj);  // remove this bit
+    } // end while
+
+    // lock the leaf if it has not changed
+    if (! lp->lockVersion(vers[0])) goto AgainO2;
+
+    isfull[0]= lp->isFull();
+    if (isfull[0]) {
+        for (i=1; i<=level; i++) {
+            bnode *p= parray[i];
+            if (! p->lockVersion(vers[i])) {
+                // unlock without changing the versions, then restart
+                for (int j=1; j<i; j++) ((bnode *)parray[j])->lock()= vers[j];
+                lp->unlock();
+                goto AgainO2;
+            }
+            isfull[i]= (p->num() == NON_LEAF_KEY_NUM);
+            if (! isfull[i]) break;
+        }
+    }
+  } // end of Part 1 (CC_OLC)
+
+  else
+  { bnode *p;
+    bleaf *lp;
+    int i;
+    bool in_tx;
+    int  retries= 0;
+    
+Again2:
+    // 1. RTM begin
+    in_tx= txBegin(retries, TX_OP_INSERT);
+
+    // 2. search nonleaf nodes
+    p = tree_meta->tree_root;
+    
+    for (i=tree_meta->root_level; i>0; i--) {
+        
+        // prefetch the entire node
+        NODE_PREF(p);
+
+        // if the lock bit is set, abort
+        if (p->isLocked()) {TX_ABORT(in_tx, 3); goto Again2;}
+
+        parray[i]= p;
+        isfull[i]= (p->num() == NON_LEAF_KEY_NUM);
+
+        ppos[i]= searchNonleaf(p, p->num(), key);
+        p= p->ch(ppos[i]);
+    }
+    
+    // 3. search leaf node
+    lp= (bleaf *)p;
+
+    // prefetch the entire node
+    LEAF_PREF_NVM(lp);
+
+    // if the lock bit is set, abort
+    if (lp->lock) {TX_ABORT(in_tx, 4); goto Again2;}
+
+    parray[0]= lp;
+
+    // SIMD comparison of the fingerprints
+    leafBitmap mask= leafMatch(lp, key_hash);
+
+    // search every matching candidate
+    while (mask) {
+        int jj = leafBitScan(mask)-1;  // next candidate
+
+        if (lp->k(jj) == key) { // found: do nothing, return false
+           txEnd(in_tx, TX_OP_INSERT);
+           return false;
+        }
+
+        mask &= ~leafBit(jj);  // remove this bit
+    } // end while
+
+    // 4. set lock bits before exiting the RTM transaction
+    lp->lock= 1;
+
+    isfull[0]= lp->isFull();
+    if (isfull[0]) {
+        for (i=1; i<=tree_meta->root_level; i++) {
+            p= parray[i];
+            p->lock()++;
+            if (! isfull[i]) break;
+        }
+    }
+
+    // 5. RTM commit
+    txEnd(in_tx, TX_OP_INSERT);
+
+  } // end of Part 1
+
+    /* Part 2. leaf node */
+  {
+    bleaf *lp= parray[0];
+    bleafMeta meta= *((bleafMeta *)lp);
+
+    // the key to store in the leaf
+    key= persistKey(key);
+    keyFence();
+
+    /* 1. leaf is not full */
+    if (! isfull[0]) {
+
+       meta.v.lock= 0;  // clear lock in temp meta
+
+       // 1.1 get first empty slot
+       leafBitmap bitmap= meta.v.bitmap;
+       int slot= leafBitScan(~bitmap)-1;
+
+       // 1.2 set leaf.entry[slot]= (k, v);
+       // set fgpt, bitmap in meta
+       lp->k(slot)= key;
+       lp->ch(slot)= ptr;
+       meta.v.fgpt[slot]= key_hash;
+       bitmap |= leafBit(slot); 
+
+       // 1.3 line 0 holds slots 0 .. LEAF_LINE0_SLOTS-1 after the header
+       // (256B leaf: line 0: 0-2; line 1: 3-6; line 2: 7-10; line 3: 11-13)
+       // in line 0?
+       if (slot<LEAF_LINE0_SLOTS) {
+           // 1.3.1 write word 0
+           meta.v.bitmap= bitmap;
+           lp->setWord0(&meta);
+
+           // 1.3.2 flush
+           clwb(lp); sfence();
+
+           return true;
+       }
+
+       // 1.4 line 1 .. LEAF_LINE_NUM-1
+       else {
+         int last_slot= last_slot_in_line[slot];
+         int from= 0;
+         for (int to=slot+1; to<=last_slot && from<LEAF_LINE0_SLOTS; to++) {
+            if ((bitmap&leafBit(to))==0) {
+               // 1.4.1 for each empty slot in the line
+               // copy an entry from line 0
+               lp->ent[to]= lp->ent[from];
+               meta.v.fgpt[to]= meta.v.fgpt[from];
+               bitmap |= leafBit(to); bitmap &= ~leafBit(from);
+               from ++;
+            }
+         }
+
+         // 1.4.2 flush the line(s) containing slot
+         clwbLeafSlot(lp, slot); sfence();
+
+         // 1.4.3 change meta and flush line 0
+         meta.v.bitmap= bitmap;
+         lp->setBothWords(&meta);
+         clwb(lp); sfence();
+
+         return true;
+       }
+    } // end of not full
+
+    /* 2. leaf is full, split */
+
+    // 2.1 get sorted positions
+    int sorted_pos[LEAF_KEY_NUM];
+    for (int i=0; i<LEAF_KEY_NUM; i++) sorted_pos[i]=i;
+    qsortBleaf(lp, 0, LEAF_KEY_NUM-1, sorted_pos);
+
+    // 2.2 split point is the middle point
+    int split= (LEAF_KEY_NUM/2);  // [0,..split-1] [split,LEAF_KEY_NUM-1]
+    key_type split_key= nonleafKey(lp->k(sorted_pos[split-1]),
+                                   lp->k(sorted_pos[split]));
+
+    // 2.3 create new node
+    bleaf * newp = (bleaf *)nvmpool_alloc_node(LEAF_SIZE);
+
+    // 2.4 move entries sorted_pos[split .. LEAF_KEY_NUM-1]
+    leafBitmap freed_slots= 0;
+    for (int i=split; i<LEAF_KEY_NUM; i++) {
+        newp->ent[i]= lp->ent[sorted_pos[i]];
+        newp->fgpt[i]= lp->fgpt[sorted_pos[i]];
+
+        // add to freed slots bitmap
+        freed_slots |= leafBit(sorted_pos[i]);
+    }
+    newp->bitmap= ((leafBit(LEAF_KEY_NUM - split)-1) << split);
+    newp->lock= 0; newp->alt= 0;
+
+       // remove freed slots from temp bitmap
+    meta.v.bitmap &= ~freed_slots;
+
+    newp->next[0]= lp->next[lp->alt];
+    lp->next[1-lp->alt]= newp;
+
+       // set alt in temp bitmap
+    meta.v.alt= 1 - lp->alt;
+
+    // 2.5 key >= split_key: insert key into new node
+    if (key >= split_key) {
+        newp->k(split-1)= key; newp->ch(split-1)= ptr;
+        newp->fgpt[split-1]= key_hash;
+        newp->bitmap |= leafBit(split-1);
+
+        if (tree_meta->root_level > 0) meta.v.lock= 0;  // do not clear lock of root
+    }
+    
+    // 2.6 clwb newp, clwb lp line[3] and sfence
+    LOOP_FLUSH(clwb, newp, LEAF_LINE_NUM); 
+    clwb(&(lp->next[0]));
+    sfence();
+
+    // 2.7 clwb lp and flush: NVM atomic write to switch alt and set bitmap
+    tree_meta->newGeneration();  // newp is added to the leaf list
+    lp->setBothWords(&meta);
+    clwb(lp); sfence();
+
+    // 2.8 key < split_key: insert key into old node 
+    if (key < split_key) {
+
+       // note: lock bit is still set
+       if (tree_meta->root_level > 0) meta.v.lock= 0;  // do not clear lock of root
+
+       // get first empty slot
+       leafBitmap bitmap= meta.v.bitmap;
+       int slot= leafBitScan(~bitmap)-1;
+
+       // set leaf.entry[slot]= (k, v);
+       // set fgpt, bitmap in meta
+       lp->k(slot)= key;
+       lp->ch(slot)= ptr;
+       meta.v.fgpt[slot]= key_hash;
+       bitmap |= leafBit(slot); 
+
+       // in line 0?
+       if (slot<LEAF_LINE0_SLOTS) {
+           // write word 0
+           meta.v.bitmap= bitmap;
+           lp->setWord0(&meta);
+           // flush
+           clwb(lp); sfence();
+       }
+       // line 1 .. LEAF_LINE_NUM-1
+       else {
+         int last_slot= last_slot_in_line[slot];
+         int from= 0;
+         for (int to=slot+1; to<=last_slot && from<LEAF_LINE0_SLOTS; to++) {
+            if ((bitmap&leafBit(to))==0) {
+               // for each empty slot in the line
+               // copy an entry from line 0
+               lp->ent[to]= lp->ent[from];
+               meta.v.fgpt[to]= meta.v.fgpt[from];
+               bitmap |= leafBit(to); bitmap &= ~leafBit(from);
+               from ++;
+            }
+         }
+
+         // flush the line(s) containing slot
+         clwbLeafSlot(lp, slot); sfence();
+
+         // change meta and flush line 0
+         meta.v.bitmap= bitmap;
+         lp->setBothWords(&meta);
+         clwb(lp); sfence();
+       }
+    }
+
+    key= split_key; ptr= newp;
+    /* (key, ptr) to be inserted in the parent non-leaf */
+
+  } // end of Part 2
+
+    /* Part 3. nonleaf node */
+    insertNonleaf(key, ptr, parray, ppos);
+    return true;
+}
+
+/**
+ * Part 3 of insertion: insert the new child into the non-leaf nodes
+ *
+ * @param key     the key of the new child
+ * @param ptr     the new child
+ * @param parray  the path: parray[lev] are locked if they may change
+ * @param ppos    child ppos[lev] of parray[lev] is split into ptr
+ */
+void lbtree::insertNonleaf(key_type key, void *ptr,
+                           Pointer8B parray[], short ppos[])
+{
+    bnode *p, *newp;
+    int    n, i, pos, r, lev, total_level;
+    
+#define   LEFT_KEY_NUM		((NON_LEAF_KEY_NUM)/2)
+#define   RIGHT_KEY_NUM		((NON_LEAF_KEY_NUM) - LEFT_KEY_NUM)
+    
+    total_level = tree_meta->root_level;
+    lev = 1;
+    
+    while (lev <= total_level) {
+        
+        p = parray[lev];
+        n = p->num();
+        pos = ppos[lev] + 1;  // the new child is ppos[lev]+1 >= 1
+        
+        /* if the non-leaf is not full, simply insert key ptr */
+        
+        if (n < NON_LEAF_KEY_NUM) {
+            for (i=n; i>=pos; i--) p->ent[i+1]= p->ent[i];
+
+            p->k(pos) = key; p->ch(pos) = ptr; 
+            p->num() = n+1; 
+            sfence();
+
+            // unlock after all changes are globally visible
+            p->unlock();
+            return;
+        }
+        
+        /* otherwise allocate a new non-leaf and redistribute the keys */
+        newp = (bnode *)mempool_alloc_node(NONLEAF_SIZE);
+        
+        /* if key should be in the left node */
+        if (pos <= LEFT_KEY_NUM) {
+            for (r=RIGHT_KEY_NUM, i=NON_LEAF_KEY_NUM; r>=0; r--, i--) {
+                newp->ent[r]= p->ent[i];
+            }
+            /* newp->key[0] actually is the key to be pushed up !!! */
+            for (i=LEFT_KEY_NUM-1; i>=pos; i--) p->ent[i+1]= p->ent[i];
+
+            p->k(pos) = key; p->ch(pos) = ptr;
+        } 
+        /* if key should be in the right node */
+        else {
+            for (r=RIGHT_KEY_NUM, i=NON_LEAF_KEY_NUM; i>=pos; i--, r--){
+                newp->ent[r]= p->ent[i];
+            }
+            newp->k(r) = key; newp->ch(r) = ptr; r--;
+            for (;r>=0; r--, i--) {
+                newp->ent[r]= p->ent[i];
+            }
+        } /* end of else */
+        
+        key = newp->k(0); ptr = newp;
+
+        p->num() = LEFT_KEY_NUM;  
+        if (lev < total_level) p->unlock(); // do not clear lock bit of root
+        newp->num() = RIGHT_KEY_NUM; newp->lock()= 0;
+
+        lev ++;
+    } /* end of while loop */
+    
+    /* root was splitted !! add another level */
+    newp = (bnode *)mempool_alloc_node(NONLEAF_SIZE);
+    
+    newp->num() = 1; newp->lock()= 1;
+    newp->ch(0) = tree_meta->tree_root; newp->ch(1) = ptr; newp->k(1) = key;
+    sfence();  // ensure new node is consistent
+
+    void *old_root= tree_meta->tree_root;
+    tree_meta->root_level = lev;
+    olc_barrier();  // root_level must be visible before tree_root
+    tree_meta->tree_root = newp;  
+    sfence();   // tree root change is globablly visible
+                // old root and new root are both locked
+
+    // unlock old root
+    if (total_level > 0) { // previous root is a nonleaf
+       ((bnode *)old_root)->unlock();
+    }
+    else { // previous root is a leaf
+       ((bleaf *)old_root)->lock= 0;
+    }
+
+    // unlock new root
+    newp->lock()= 0;
+
+    return;
+    
+#undef RIGHT_KEY_NUM
+#undef LEFT_KEY_NUM
+}
+
+/* ---------------------------------------------------------- *
+
+ update, cas, and fetch_add: write the value slot of an existing key
+
+ * ---------------------------------------------------------- */
+
+/**
+ * compute the new value of a slot
+ *
+ * @param op    VALUE_SET, VALUE_CAS, VALUE_ADD, or VALUE_GET
+ * @param cur   the current value
+ * @param a     SET: the new value, CAS: the expected value, ADD: the delta
+ * @param b     CAS: the desired value
+ * @param nv    return the new value
+ * @retval true if the slot is to be written
+ */
+static inline bool newValue(int op, void *cur, void *a, void *b, void * &nv)
+{
+    switch (op) {
+    case VALUE_SET: nv= a; return true;
+    case VALUE_CAS: nv= b; return (cur == a);
+    case VALUE_GET: return false;
+    default:        nv= (void *)((long long)cur + (long long)a); return true;
+    }
+}
+
+/**
+ * read and write the value slot (ch) of an existing key in place
+ *
+ * The slot is found in Part 1, and the new value is computed from the
+ * current value and written with one 8B store.  The bitmap, the
+ * fingerprints, and the other entries are not changed, so only the line
+ * of ch(pos) is flushed.  An aligned 8B store is failure-atomic: after a
+ * crash, the slot holds the old or the new value.
+ *
+ * CC_RTM/CC_LOCK: the read, the check, and the store are in the
+ * transaction (or under the fallback lock), and an insert that moves the
+ * entry holds the leaf lock bit, which aborts the transaction.  The line
+ * is flushed after the commit.  A later operation on the slot may read
+ * the value before it is flushed, but its own flush persists the line
+ * with its value, which includes the effect of this one.  CC_OLC: the
+ * leaf is locked with compare-and-swap while the slot is read and
+ * written.  Locking increments the version counter of the leaf, and
+ * unlocking does not restore it, so a concurrent reader of the slot
+ * fails validation and restarts instead of returning a stale value.
+ * VALUE_GET only reads the slot, and validates the version instead of
+ * locking the leaf.
+ *
+ * @param key   the index key
+ * @param op    VALUE_SET, VALUE_CAS, VALUE_ADD, or VALUE_GET (see newValue)
+ * @param old   return the value before the operation
+ * @retval -1 if the key is not found, 1 if the slot is written, 0 otherwise
+ */
+int lbtree::writeValue (key_type key, int op, void *a, void *b, void **old)
+{
+    epochGuard guard;
+    bleaf *lp;
+    int pos;
+    void *cur, *nv;
+    bool written;
+
+    /* Part 1. find the slot, then read and write it */
+
+  if (cc_mode == CC_OLC) {
+    Pointer8B          parray[32];
+    short              ppos[32];
+    unsigned long long vers[32];
+
+AgainO12:
+    if (olcSearch(key, parray, ppos, vers) < 0) goto AgainO12;
+    lp= parray[0];
+
+    // prefetch the entire node
+    LEAF_PREF_NVM(lp);
+
+    pos= searchLeaf(lp, key);
+
+    if (pos < 0) { // not found: do nothing
+       olc_barrier();
+       if (lp->getVersion() != vers[0]) goto AgainO12;
+       return -1;
+    }
+
+    if (op == VALUE_GET) {
+       cur= lp->ch(pos);
+       olc_barrier();
+       if (lp->getVersion() != vers[0]) goto AgainO12;
+
+       if (old) *old= cur;
+       return 0;
+    }
+
+    // lock the leaf if it has not changed, so the entry cannot move
+    if (! lp->lockVersion(vers[0])) goto AgainO12;
+
+    cur= lp->ch(pos);
+    written= newValue(op, cur, a, b, nv);
+    if (written) {
+       lp->ch(pos)= nv;
+       clwb(&(lp->ch(pos))); sfence();
+    }
+
+    lp->unlock();
+
+    if (old) *old= cur;
+    return (written ? 1 : 0);
+  }
+
+  else
+  { bnode *p;
+    int i;
+    bool in_tx;
+    int  retries= 0;
+
+Again12:
+    // 1. RTM begin
+    in_tx= txBegin(retries, TX_OP_UPDATE);
+
+    // 2. search nonleaf nodes
+    p = tree_meta->tree_root;
+
+    for (i=tree_meta->root_level; i>0; i--) {
+
+        // prefetch the entire node
+        NODE_PREF(p);
+
+        // if the lock bit is set, abort
+        if (p->isLocked()) {TX_ABORT(in_tx, 10); goto Again12;}
+
+        p= p->ch(searchNonleaf(p, p->num(), key));
+    }
+
+    // 3. search leaf node
+    lp= (bleaf *)p;
+
+    // prefetch the entire node
+    LEAF_PREF_NVM(lp);
+
+    // if the lock bit is set, abort
+    if (lp->lock) {TX_ABORT(in_tx, 11); goto Again12;}
+
+    // 4. read and write the slot
+    pos= searchLeaf(lp, key);
+    written= false;
+    if (pos >= 0) {
+       cur= lp->ch(pos);
+       written= newValue(op, cur, a, b, nv);
+       if (written) lp->ch(pos)= nv;
+    }
+
+    // 5. RTM commit
+    txEnd(in_tx, TX_OP_UPDATE);
+
+  } // end of Part 1
+
+    /* Part 2. persist the slot */
+    if (pos < 0) return -1;
+
+    if (written) {clwb(&(lp->ch(pos))); sfence();}
+
+    if (old) *old= cur;
+    return (written ? 1 : 0);
+}
+
+/**
+ * update the key if it exists, otherwise insert it
+ *
+ * @retval true if the key is inserted, false if it is updated
+ */
+bool lbtree::upsert (key_type key, void *ptr)
+{
+    // retry if another thread inserts or deletes the key in between
+    while (true) {
+        if (update(key, ptr)) return false;
+        if (insert(key, ptr)) return true;
+    }
+}
+
+/* ---------------------------------------------------------- *
+
+ values: records in the NVM value heap behind ch()
+
+ * ---------------------------------------------------------- */
+
+/**
+ * insert a key with a value
+ *
+ * The value record is written and persisted before insert() writes the
+ * leaf entry, so a published entry never points to a partial record.  If
+ * the key exists, the record has never been visible and is freed at once.
+ */
+bool lbtree::put (key_type key, const void *val, int len)
+{
+    if ((len < 0) || (len > VALUE_MAX_LEN)) return false;
+
+    nvmValue *v= nvmvalue_alloc(len);
+    memcpy(v->data, val, len);
+    clwbmore(v, v->data + len - 1); sfence();
+
+    if (insert(key, v)) return true;
+
+    nvmvalue_free(v);
+    return false;
+}
+
+/**
+ * copy the value of a key that was inserted by put()
+ *
+ * The record pointer is read in Part 1 of writeValue.  A record is not
+ * changed after it is published, and a replaced or removed record is
+ * retired, so it can be copied under the epochGuard after the search.
+ */
+int lbtree::get (key_type key, void *buf, int size)
+{
+    epochGuard guard;
+    void *p;
+    if (writeValue(key, VALUE_GET, NULL, NULL, &p) < 0) return -1;
+
+    nvmValue *v= (nvmValue *)p;
+    memcpy(buf, v->data, min((int)(v->len), size));
+    return v->len;
+}
+
+/**
+ * replace the value of a key that was inserted by put()
+ *
+ * The new record is persisted before the slot is overwritten, and the old
+ * record is retired.
+ */
+bool lbtree::replace (key_type key, const void *val, int len)
+{
+    if ((len < 0) || (len > VALUE_MAX_LEN)) return false;
+
+    nvmValue *v= nvmvalue_alloc(len);
+    memcpy(v->data, val, len);
+    clwbmore(v, v->data + len - 1); sfence();
+
+    void *old;
+    if (writeValue(key, VALUE_SET, v, NULL, &old) < 0) {
+       nvmvalue_free(v);
+       return false;
+    }
+
+    nvmvalue_retire((nvmValue *)old);
+    return true;
+}
+
+/**
+ * delete a key that was inserted by put(), and retire its record
+ */
+bool lbtree::remove (key_type key)
+{
+    void *old;
+    if (! delKey(key, &old)) return false;
+
+    nvmvalue_retire((nvmValue *)old);
+    return true;
+}
+
+/* ---------------------------------------------------------- *
+
+ batch insertion
+ 
+ * ---------------------------------------------------------- */
+
+// the maximum number of keys inserted into a leaf in one pass
+#define BATCH_LEAF_KEY_NUM   (2*LEAF_KEY_NUM)
+
+typedef struct batchEntry {
+    key_type  k;
+    void *    ptr;
+    int       order;  // position in the batch
+} batchEntry;
+
+static int compareBatchEntry(const void *a, const void *b)
+{
+    const batchEntry *x= (const batchEntry *)a;
+    const batchEntry *y= (const batchEntry *)b;
+    if (x->k != y->k) return ((x->k < y->k) ? -1 : 1);
+    return (x->order - y->order);
+}
+
+/**
+ * write new entries into free slots of a leaf
+ *
+ * @param lp     the leaf node
+ * @param meta   the temp meta of lp: fgpt[] and bitmap are updated
+ * @param free   the slots to use (ascending), updated
+ * @param keys   the keys to insert
+ * @param ptrs   the associated pointers
+ * @param idx    insert keys[idx[0]] ... keys[idx[num-1]]
+ * @param num    the number of entries to insert
+ * @retval the bitmap of the cache lines that are written
+ */
+static inline int writeLeafSlots(bleaf *lp, bleafMeta *meta, leafBitmap &free,
+                                 key_type keys[], void *ptrs[],
+                                 int idx[], int num)
+{
+    int lines= 0;
+
+    for (int j=0; j<num; j++) {
+        int slot= leafBitScan(free)-1;
+        free &= ~leafBit(slot);
+
+        lp->k(slot)= keys[idx[j]];
+        lp->ch(slot)= ptrs[idx[j]];
+        meta->v.fgpt[slot]= hashcode1B(keys[idx[j]]);
+        meta->v.bitmap |= leafBit(slot);
+        lines |= (1<<LEAF_SLOT_LINE(slot)) | (1<<LEAF_SLOT_END_LINE(slot));
+    }
+
+    return lines;
+}
+
+// flush lines 1 .. LEAF_LINE_NUM-1 of a leaf, line 0 is flushed with the header
+static inline void flushLeafLines(bleaf *lp, int lines)
+{
+    if ((lines & ~1) == 0) return;
+    for (int l=1; l<LEAF_LINE_NUM; l++)
+       if (lines & (1<<l)) clwb((char *)lp + l*CACHE_LINE_SIZE);
+    sfence();
+}
+
+/**
+ * insert a batch of index entries
+ *
+ * @param keys  the index keys (in any order)
+ * @param ptrs  the record pointers
+ * @param n     the number of index entries
+ *
+ * The batch is sorted.  Then the tree is searched once per leaf, and all the
+ * keys that belong to the leaf are inserted while the leaf is locked.  If a
+ * key appears more than once, the first (key, ptr) is inserted.
+ */
+void lbtree::insertBatch(const key_type keys[], void *ptrs[], int n)
+{
+    epochGuard guard;
+    if (n <= 0) return;
+
+    // 1. sort the batch and remove duplicates
+    batchEntry *ent= (batchEntry *) malloc(n * sizeof(batchEntry));
+    key_type *  skeys= (key_type *) malloc(n * sizeof(key_type));
+    void **     sptrs= (void **) malloc(n * sizeof(void *));
+    if (!ent || !skeys || !sptrs) {perror("malloc"); exit(1);}
+
+    for (int i=0; i<n; i++) {
+        ent[i].k= keys[i]; ent[i].ptr= ptrs[i]; ent[i].order= i;
+    }
+    qsort(ent, n, sizeof(batchEntry), compareBatchEntry);
+
+    int num= 0;
+    for (int i=0; i<n; i++) {
+        if (num > 0 && ent[i].k == skeys[num-1]) continue;
+        skeys[num]= ent[i].k; sptrs[num]= ent[i].ptr; num++;
+    }
+
+    // 2. insert the keys leaf by leaf
+    for (int i=0; i<num; )
+        i += insertLeafBatch(skeys+i, sptrs+i, num-i);
+
+    free(ent);
+    free(skeys);
+    free(sptrs);
+}
+
+/**
+ * insert sorted keys into the leaf of keys[0]
+ *
+ * @param keys  sorted keys without duplicates
+ * @param ptrs  the associated record pointers
+ * @param n     the number of keys
+ * @retval the number of keys that are done, at least 1
+ *
+ * At most BATCH_LEAF_KEY_NUM keys are considered.  The new entries are
+ * written to free slots, the lines are flushed once, and the bitmap is
+ * published with a single setBothWords.  If the leaf overflows, it is split
+ * once: the upper half goes to a new leaf, and the lower half stays in the
+ * leaf.  New keys of the lower half that do not fit in the slots that were
+ * free before the split are written after the split is published.
+ */
+int lbtree::insertLeafBatch(key_type keys[], void *ptrs[], int n)
+{
+    Pointer8B parray[32];  // 0 .. root_level will be used
+    short     ppos[32];    // 1 .. root_level will be used
+    bool      isfull[32];  // 0 .. root_level will be used
+    int       level;
+
+    key_type  ub= MAX_KEY; // keys in the leaf are < ub if has_ub
+    bool      has_ub= false;
+    int       cnt;         // keys[0 .. cnt-1] belong to the leaf
+
+    /* Part 1. find the leaf of keys[0], then lock it.  The ancestors are
+               locked as in insert() if the leaf may be split. */
+
+  if (cc_mode == CC_OLC) {
+    bleaf *lp;
+    int i;
+    unsigned long long vers[32];
+
+AgainO11:
+    level= olcSearch(keys[0], parray, ppos, vers);
+    if (level < 0) goto AgainO11;
+
+    // the upper bound of the leaf is the separator right of the path
+    for (i=1; i<=level; i++) {
+        bnode *p= parray[i];
+        if (ppos[i] < p->num()) {ub= p->k(ppos[i]+1); has_ub= true; break;}
+    }
+    olc_barrier();
+    for (int j=1; j<=i && j<=level; j++)
+        if (((bnode *)parray[j])->getVersion() != (int)vers[j]) goto AgainO11;
+
+    lp= parray[0];
+    LEAF_PREF_NVM(lp);
+
+    // lock the leaf if it has not changed
+    if (! lp->lockVersion(vers[0])) goto AgainO11;
+
+    for (cnt=1; cnt<n && cnt<BATCH_LEAF_KEY_NUM; cnt++)
+        if (has_ub && keys[cnt] >= ub) break;
+
+    isfull[0]= (lp->num() + cnt > LEAF_KEY_NUM);
+    if (isfull[0]) {
+        for (i=1; i<=level; i++) {
+            bnode *p= parray[i];
+            if (! p->lockVersion(vers[i])) {
+                // unlock without changing the versions, then restart
+                for (int j=1; j<i; j++) ((bnode *)parray[j])->lock()= vers[j];
+                lp->unlock();
+                goto AgainO11;
+            }
+            isfull[i]= (p->num() == NON_LEAF_KEY_NUM);
+            if (! isfull[i]) break;
+        }
+    }
+  } // end of Part 1 (CC_OLC)
+
+  else
+  { bnode *p;
+    bleaf *lp;
+    int i;
+    bool in_tx;
+    int  retries= 0;
+
+Again11:
+    // 1. RTM begin
+    in_tx= txBegin(retries, TX_OP_INSERT);
+
+    // 2. search nonleaf nodes
+    p = tree_meta->tree_root;
+    level= tree_meta->root_level;
+    has_ub= false;
+
+    for (i=level; i>0; i--) {
+
+        // prefetch the entire node
+        NODE_PREF(p);
+
+        // if the lock bit is set, abort
+        if (p->isLocked()) {TX_ABORT(in_tx, 3); goto Again11;}
+
+        parray[i]= p;
+        int t= p->num();
+        isfull[i]= (t == NON_LEAF_KEY_NUM);
+
+        ppos[i]= searchNonleaf(p, t, keys[0]);
+        if (ppos[i] < t) {ub= p->k(ppos[i]+1); has_ub= true;}
+        p= p->ch(ppos[i]);
+    }
+
+    // 3. the leaf node
+    lp= (bleaf *)p;
+
+    // prefetch the entire node
+    LEAF_PREF_NVM(lp);
+
+    // if the lock bit is set, abort
+    if (lp->lock) {TX_ABORT(in_tx, 4); goto Again11;}
+
+    parray[0]= lp;
+
+    for (cnt=1; cnt<n && cnt<BATCH_LEAF_KEY_NUM; cnt++)
+        if (has_ub && keys[cnt] >= ub) break;
+
+    // 4. set lock bits before exiting the RTM transaction
+    lp->lock= 1;
+
+    isfull[0]= (lp->num() + cnt > LEAF_KEY_NUM);
+    if (isfull[0]) {
+        for (i=1; i<=level; i++) {
+            p= parray[i];
+            p->lock()++;
+            if (! isfull[i]) break;
+        }
+    }
+
+    // 5. RTM commit
+    txEnd(in_tx, TX_OP_INSERT);
+
+  } // end of Part 1
 
-       // 1.2 set leaf.entry[slot]= (k, v);
-       // set fgpt, bitmap in meta
-       lp->k(slot)= key;
-       lp->ch(slot)= ptr;
-       meta.v.fgpt[slot]= key_hash;
-       bitmap |= (1<<slot); 
+    /* Part 2. leaf node */
+    bleaf *lp= parray[0];
+    bleafMeta meta= *((bleafMeta *)lp);
+    leafBitmap old_bitmap= meta.v.bitmap;
+    int e= leafCountBit(old_bitmap);
+
+    // 2.1 the new keys: keys[nk[0]], ..., keys[nk[c-1]]
+    int nk[BATCH_LEAF_KEY_NUM];
+    int c= 0;
+    for (int j=0; j<cnt; j++)
+        if (searchLeaf(lp, keys[j]) < 0) nk[c++]= j;
+
+    // both halves of a split must fit, and the lower half must keep an
+    // old entry.  The keys that are left out are inserted in a later pass.
+    int done= cnt;
+    int small= c;  // number of new keys smaller than all old entries
+    if (e > 0) {
+        key_type min_key= MAX_KEY;
+        for (int s=0; s<LEAF_KEY_NUM; s++)
+            if ((old_bitmap & leafBit(s)) && lp->k(s) < min_key) min_key= lp->k(s);
+        for (small=0; small<c && keys[nk[small]]<min_key; small++);
+    }
+    int max_c= ((e == 0) ? LEAF_KEY_NUM
+                : ((small >= LEAF_KEY_NUM) ? LEAF_KEY_NUM-1
+                                           : BATCH_LEAF_KEY_NUM - e));
+    if (c > max_c) {done= nk[max_c]; c= max_c;}
+    if (small > c) small= c;
+
+    // 2.2 the ancestors are not modified unless the leaf is split
+    if (isfull[0] && (e + c <= LEAF_KEY_NUM)) {
+        for (int i=1; i<=level; i++) {
+            ((bnode *)parray[i])->unlock();
+            if (! isfull[i]) break;
+        }
+    }
 
-       // 1.3 line 0: 0-2; line 1: 3-6; line 2: 7-10; line 3: 11-13
-       // in line 0?
-       if (slot<3) {
-           // 1.3.1 write word 0
-           meta.v.bitmap= bitmap;
-           lp->setWord0(&meta);
+    // 2.3 nothing to insert
+    if (c == 0) {
+        meta.v.lock= 0;
+        lp->setWord0(&meta);
+        return done;
+    }
 
-           // 1.3.2 flush
-           clwb(lp); sfence();
+    // the keys to store in the leaves, persistent before any entry is
+    // written
+    for (int j=0; j<c; j++) keys[nk[j]]= persistKey(keys[nk[j]]);
+    keyFence();
 
-           return;
-       }
+    leafBitmap free_slots= (~old_bitmap) & LEAF_FULL_BITMAP;
 
-       // 1.4 line 1--3
-       else {
-         int last_slot= last_slot_in_line[slot];
-         int from= 0;
-         for (int to=slot+1; to<=last_slot; to++) {
-            if ((bitmap&(1<<to))==0) {
-               // 1.4.1 for each empty slot in the line
-               // copy an entry from line 0
-               lp->ent[to]= lp->ent[from];
-               meta.v.fgpt[to]= meta.v.fgpt[from];
-               bitmap |= (1<<to); bitmap &= ~(1<<from);
-               from ++;
-            }
-         }
+    // 2.4 leaf does not overflow: write the entries, flush them, and
+    //     publish the new bitmap
+    if (e + c <= LEAF_KEY_NUM) {
+        meta.v.lock= 0;  // clear lock in temp meta
 
-         // 1.4.2 flush the line containing slot
-         clwb(&(lp->k(slot))); sfence();
+        int lines= writeLeafSlots(lp, &meta, free_slots, keys, ptrs, nk, c);
+        flushLeafLines(lp, lines);
 
-         // 1.4.3 change meta and flush line 0
-         meta.v.bitmap= bitmap;
-         lp->setBothWords(&meta);
-         clwb(lp); sfence();
+        lp->setBothWords(&meta);
+        clwb(lp); sfence();
 
-         return;
-       }
-    } // end of not full
+        return done;
+    }
 
-    /* 2. leaf is full, split */
+    /* 2.5 leaf overflows, split */
 
-    // 2.1 get sorted positions
+    // merge the sorted old entries (>=0: slot) and new keys (<0: -1-j)
     int sorted_pos[LEAF_KEY_NUM];
-    for (int i=0; i<LEAF_KEY_NUM; i++) sorted_pos[i]=i;
-    qsortBleaf(lp, 0, LEAF_KEY_NUM-1, sorted_pos);
+    for (int s=0, j=0; s<LEAF_KEY_NUM; s++)
+        if (old_bitmap & leafBit(s)) sorted_pos[j++]= s;
+    qsortBleaf(lp, 0, e-1, sorted_pos);
+
+    int total= e + c;
+    int merged[BATCH_LEAF_KEY_NUM];
+    for (int i=0, a=0, b=0; i<total; i++) {
+        if (b >= c || (a < e && lp->k(sorted_pos[a]) < keys[nk[b]]))
+            merged[i]= sorted_pos[a++];
+        else
+            merged[i]= -1 - nk[b++];
+    }
 
-    // 2.2 split point is the middle point
-    int split= (LEAF_KEY_NUM/2);  // [0,..split-1] [split,LEAF_KEY_NUM-1]
-    key_type split_key= lp->k(sorted_pos[split]);
+    // split point: [0, .. split-1] [split, .. total-1]
+    int split= max(total/2, small+1);
+    key_type split_key= nonleafKey(
+           ((merged[split-1] >= 0) ? lp->k(merged[split-1])
+                                   : keys[-1-merged[split-1]]),
+           ((merged[split] >= 0) ? lp->k(merged[split])
+                                 : keys[-1-merged[split]]));
 
-    // 2.3 create new node
+    // create new node and move the upper half into it
     bleaf * newp = (bleaf *)nvmpool_alloc_node(LEAF_SIZE);
 
-    // 2.4 move entries sorted_pos[split .. LEAF_KEY_NUM-1]
-    uint16_t freed_slots= 0;
-    for (int i=split; i<LEAF_KEY_NUM; i++) {
-        newp->ent[i]= lp->ent[sorted_pos[i]];
-        newp->fgpt[i]= lp->fgpt[sorted_pos[i]];
-
-        // add to freed slots bitmap
-        freed_slots |= (1<<sorted_pos[i]);
+    leafBitmap freed_slots= 0;
+    for (int i=split; i<total; i++) {
+        int to= i - split;
+        if (merged[i] >= 0) {
+            newp->ent[to]= lp->ent[merged[i]];
+            newp->fgpt[to]= lp->fgpt[merged[i]];
+            freed_slots |= leafBit(merged[i]);
+        }
+        else {
+            newp->k(to)= keys[-1-merged[i]];
+            newp->ch(to)= ptrs[-1-merged[i]];
+            newp->fgpt[to]= hashcode1B(keys[-1-merged[i]]);
+        }
     }
-    newp->bitmap= (((1<<(LEAF_KEY_NUM - split))-1) << split);
+    newp->bitmap= (leafBit(total - split)-1);
     newp->lock= 0; newp->alt= 0;
 
        // remove freed slots from temp bitmap
@@ -802,172 +2949,46 @@ Again2:
        // set alt in temp bitmap
     meta.v.alt= 1 - lp->alt;
 
-    // 2.5 key > split_key: insert key into new node
-    if (key > split_key) {
-        newp->k(split-1)= key; newp->ch(split-1)= ptr;
-        newp->fgpt[split-1]= key_hash;
-        newp->bitmap |= 1<<(split-1);
+    // new keys of the lower half: those that fit in the slots that were
+    // free before the split are written now, the rest after the split
+    int left[LEAF_KEY_NUM], num_left= 0;
+    for (int i=0; i<split; i++)
+        if (merged[i] < 0) left[num_left++]= -1-merged[i];
 
-        if (tree_meta->root_level > 0) meta.v.lock= 0;  // do not clear lock of root
-    }
-    
-    // 2.6 clwb newp, clwb lp line[3] and sfence
-    LOOP_FLUSH(clwb, newp, LEAF_LINE_NUM); 
+    int now= min(num_left, leafCountBit(free_slots));
+    int lines= writeLeafSlots(lp, &meta, free_slots, keys, ptrs, left, now);
+
+    // clwb newp, the written lines of lp, lp line[3], and sfence
+    LOOP_FLUSH(clwb, newp, LEAF_LINE_NUM);
+    for (int l=1; l<LEAF_LINE_NUM; l++)
+       if (lines & (1<<l)) clwb((char *)lp + l*CACHE_LINE_SIZE);
     clwb(&(lp->next[0]));
     sfence();
 
-    // 2.7 clwb lp and flush: NVM atomic write to switch alt and set bitmap
+    // NVM atomic write to switch alt and set bitmap
+    if ((now == num_left) && (tree_meta->root_level > 0))
+        meta.v.lock= 0;  // do not clear lock of root
+
+    tree_meta->newGeneration();  // newp is added to the leaf list
     lp->setBothWords(&meta);
     clwb(lp); sfence();
 
-    // 2.8 key < split_key: insert key into old node 
-    if (key <= split_key) {
-
-       // note: lock bit is still set
-       if (tree_meta->root_level > 0) meta.v.lock= 0;  // do not clear lock of root
-
-       // get first empty slot
-       uint16_t bitmap= meta.v.bitmap;
-       int slot= bitScan(~bitmap)-1;
-
-       // set leaf.entry[slot]= (k, v);
-       // set fgpt, bitmap in meta
-       lp->k(slot)= key;
-       lp->ch(slot)= ptr;
-       meta.v.fgpt[slot]= key_hash;
-       bitmap |= (1<<slot); 
-
-       // line 0: 0-2; line 1: 3-6; line 2: 7-10; line 3: 11-13
-       // in line 0?
-       if (slot<3) {
-           // write word 0
-           meta.v.bitmap= bitmap;
-           lp->setWord0(&meta);
-           // flush
-           clwb(lp); sfence();
-       }
-       // line 1--3
-       else {
-         int last_slot= last_slot_in_line[slot];
-         int from= 0;
-         for (int to=slot+1; to<=last_slot; to++) {
-            if ((bitmap&(1<<to))==0) {
-               // for each empty slot in the line
-               // copy an entry from line 0
-               lp->ent[to]= lp->ent[from];
-               meta.v.fgpt[to]= meta.v.fgpt[from];
-               bitmap |= (1<<to); bitmap &= ~(1<<from);
-               from ++;
-            }
-         }
-
-         // flush the line containing slot
-         clwb(&(lp->k(slot))); sfence();
+    // the rest of the lower half goes to the freed slots
+    if (now < num_left) {
+        free_slots= (~meta.v.bitmap) & LEAF_FULL_BITMAP;
+        lines= writeLeafSlots(lp, &meta, free_slots, keys, ptrs,
+                              left+now, num_left-now);
+        flushLeafLines(lp, lines);
 
-         // change meta and flush line 0
-         meta.v.bitmap= bitmap;
-         lp->setBothWords(&meta);
-         clwb(lp); sfence();
-       }
+        if (tree_meta->root_level > 0) meta.v.lock= 0;  // do not clear lock of root
+        lp->setBothWords(&meta);
+        clwb(lp); sfence();
     }
 
-    key= split_key; ptr= newp;
-    /* (key, ptr) to be inserted in the parent non-leaf */
-
-  } // end of Part 2
-
     /* Part 3. nonleaf node */
-    {bnode *p, *newp;
-     int    n, i, pos, r, lev, total_level;
-        
-#define   LEFT_KEY_NUM		((NON_LEAF_KEY_NUM)/2)
-#define   RIGHT_KEY_NUM		((NON_LEAF_KEY_NUM) - LEFT_KEY_NUM)
-        
-        total_level = tree_meta->root_level;
-        lev = 1;
-        
-        while (lev <= total_level) {
-            
-            p = parray[lev];
-            n = p->num();
-            pos = ppos[lev] + 1;  // the new child is ppos[lev]+1 >= 1
-            
-            /* if the non-leaf is not full, simply insert key ptr */
-            
-            if (n < NON_LEAF_KEY_NUM) {
-                for (i=n; i>=pos; i--) p->ent[i+1]= p->ent[i];
-
-                p->k(pos) = key; p->ch(pos) = ptr; 
-                p->num() = n+1; 
-                sfence();
-
-                // unlock after all changes are globally visible
-                p->lock()= 0;
-                return;
-            }
-            
-            /* otherwise allocate a new non-leaf and redistribute the keys */
-            newp = (bnode *)mempool_alloc_node(NONLEAF_SIZE);
-            
-            /* if key should be in the left node */
-            if (pos <= LEFT_KEY_NUM) {
-                for (r=RIGHT_KEY_NUM, i=NON_LEAF_KEY_NUM; r>=0; r--, i--) {
-                    newp->ent[r]= p->ent[i];
-                }
-                /* newp->key[0] actually is the key to be pushed up !!! */
-                for (i=LEFT_KEY_NUM-1; i>=pos; i--) p->ent[i+1]= p->ent[i];
-
-                p->k(pos) = key; p->ch(pos) = ptr;
-            } 
-            /* if key should be in the right node */
-            else {
-                for (r=RIGHT_KEY_NUM, i=NON_LEAF_KEY_NUM; i>=pos; i--, r--){
-                    newp->ent[r]= p->ent[i];
-                }
-                newp->k(r) = key; newp->ch(r) = ptr; r--;
-                for (;r>=0; r--, i--) {
-                    newp->ent[r]= p->ent[i];
-                }
-            } /* end of else */
-            
-            key = newp->k(0); ptr = newp;
-
-            p->num() = LEFT_KEY_NUM;  
-            if (lev < total_level) p->lock()= 0; // do not clear lock bit of root
-            newp->num() = RIGHT_KEY_NUM; newp->lock()= 0;
-
-            lev ++;
-        } /* end of while loop */
-        
-        /* root was splitted !! add another level */
-        newp = (bnode *)mempool_alloc_node(NONLEAF_SIZE);
-        
-        newp->num() = 1; newp->lock()= 1;
-        newp->ch(0) = tree_meta->tree_root; newp->ch(1) = ptr; newp->k(1) = key;
-        sfence();  // ensure new node is consistent
-
-        void *old_root= tree_meta->tree_root;
-        tree_meta->root_level = lev;
-        tree_meta->tree_root = newp;  
-        sfence();   // tree root change is globablly visible
-                    // old root and new root are both locked
+    insertNonleaf(split_key, newp, parray, ppos);
 
-        // unlock old root
-        if (total_level > 0) { // previous root is a nonleaf
-           ((bnode *)old_root)->lock()= 0;
-        }
-        else { // previous root is a leaf
-           ((bleaf *)old_root)->lock= 0;
-        }
-
-        // unlock new root
-        newp->lock()= 0;
-
-        return;
-        
-#undef RIGHT_KEY_NUM
-#undef LEFT_KEY_NUM
-    }
+    return done;
 }
 
 /* ---------------------------------------------------------- *
@@ -977,12 +2998,37 @@ Again2:
  lazy delete - insertions >= deletions in most cases
  so no need to change the tree structure frequently
  
- So unless there is no key in a leaf or no child in a non-leaf, 
- the leaf and non-leaf won't be deleted.
+ A leaf that is left with fewer than LEAF_MIN_KEY_NUM keys is merged
+ into its left sibling under the same parent, or takes keys from the
+ sibling if the two do not fit in one leaf.  Otherwise, unless there
+ is no key in a leaf or no child in a non-leaf, the leaf and non-leaf
+ won't be deleted.
  
  * ---------------------------------------------------------- */
-void lbtree::del (key_type key)
+
+/**
+ * retire a leaf that has been removed from the leaf list
+ *
+ * The sibling pointers are cleared first, so that a scan that has copied
+ * the leaf finds that it is no longer the left sibling of its next leaf.
+ * (retire_node overwrites word 0, including the lock bit.)
+ */
+static inline void retireLeaf(bleaf *lp)
+{
+    lp->next[0]= lp->next[1]= NULL;
+    olc_barrier();
+    nvmpool_retire_node(lp);
+}
+
+/**
+ * delete key
+ *
+ * @param old  return the record pointer of the deleted entry (if not NULL)
+ * @retval false if the key is not found
+ */
+bool lbtree::delKey (key_type key, void **old)
 {
+    epochGuard guard;
     // record the path from root to leaf
     // parray[level] is a node on the path
     // child ppos[level] of parray[level] == parray[level-1]
@@ -990,24 +3036,158 @@ void lbtree::del (key_type key)
     Pointer8B parray[32];  // 0 .. root_level will be used
     short     ppos[32];    // 0 .. root_level will be used
     bleaf *   leaf_sibp= NULL;  // left sibling of the target leaf
+    bool      underflow= false; // merge with or borrow from leaf_sibp
 
     unsigned char key_hash= hashcode1B(key);
     volatile long long sum;
 
     /* Part 1. get the positions to insert the key */
+
+    // CC_OLC: search without locking, then lock the leaf, its left sibling
+    // if the leaf will be removed, and the affected ancestors with
+    // compare-and-swap from the recorded versions
+  if (cc_mode == CC_OLC) {
+    bnode *p;
+    bleaf *lp;
+    int i, j, level;
+    unsigned long long vers[32];
+
+    Pointer8B          sarray[32];  // path from parray[i] to the sibling
+    unsigned long long svers[32];
+    int                slevel;
+
+AgainO3:
+    level= olcSearch(key, parray, ppos, vers);
+    if (level < 0) goto AgainO3;
+
+    lp= parray[0];
+    leaf_sibp= NULL;
+
+    // prefetch the entire node
+    LEAF_PREF_NVM(lp);
+
+    // SIMD comparison of the fingerprints
+    leafBitmap mask= leafMatch(lp, key_hash);
+
+    // search every matching candidate
+    i= -1;
+    while (mask) {
+        int jj = leafBitScan(mask)-1;  // next candidate
+
+        if (lp->k(jj) == key) { // found: good
+           i= jj;
+           break;
+        }
+
+        mask &= ~leafBit(jj);  // remove this bit
+    } // end while
+
+    if (i < 0) { // not found: do nothing
+       olc_barrier();
+       if (lp->getVersion() != vers[0]) goto AgainO3;
+       return false;
+    }
+
+    ppos[0]= i;
+
+    // lock the leaf if it has not changed
+    if (! lp->lockVersion(vers[0])) goto AgainO3;
+
+    if (lp->num() == 1) {
+
+        // look for its left sibling
+        for (i=1; i<=level; i++) {
+            if (ppos[i]>=1) break;
+        }
+
+        if (i <= level) {
+            // go down from parray[i] along the right-most children
+            slevel= i;
+            p= parray[i];
+            Pointer8B child= p->ch(ppos[i]-1);
+            unsigned long long cv;
+
+            for (j=i-1; ; j--) {
+               olc_barrier();
+               cv= ((j > 0) ? ((bnode *)child)->getVersion()
+                            : ((bleaf *)child)->getWord0());
+               olc_barrier();
+               if (p->getVersion() != (int)((j==i-1) ? vers[i] : svers[j+1]))
+                  goto unlock_leaf;
+               if (j == 0) break;
+               if (cv & 1) goto unlock_leaf;
+
+               p= child; sarray[j]= p; svers[j]= cv;
+               int n= p->num();
+               if ((unsigned int)n > NON_LEAF_KEY_NUM) goto unlock_leaf;
+               child= p->ch(n);
+            }
+
+            if ((cv & LEAF_LOCK_BIT) || !((bleaf *)child)->lockWord0(cv))
+               goto unlock_leaf;
+            leaf_sibp= (bleaf *)child;
+
+            // the path to the sibling must not have changed
+            olc_barrier();
+            bool changed= (((bnode *)parray[slevel])->getVersion()
+                           != (int)vers[slevel]);
+            for (j=slevel-1; j>=1; j--)
+               changed |= (((bnode *)sarray[j])->getVersion() != (int)svers[j]);
+            if (changed) goto unlock_leaf;
+        }
+
+        // lock affected ancestors
+        for (i=1; i<=level; i++) {
+            p= (bnode *) parray[i];  
+            if (! p->lockVersion(vers[i])) {
+               // unlock without changing the versions, then restart
+               for (j=1; j<i; j++) ((bnode *)parray[j])->lock()= vers[j];
+               goto unlock_leaf;
+            }
+            
+            if (p->num() >= 1) break;  // at least 2 children, ok to stop
+        }
+    }
+
+    // the leaf underflows: lock its left sibling under the same parent and
+    // the parent.  If either is busy, simply delete the key.
+    else if ((lp->num() <= LEAF_MIN_KEY_NUM) && (level > 0) && (ppos[1] >= 1)) {
+        p= (bnode *) parray[1];
+        bleaf *sp= p->ch(ppos[1]-1);
+        olc_barrier();
+        unsigned long long cv= sp->getWord0();
+        olc_barrier();
+
+        if ((p->getVersion() == (int)vers[1]) && !(cv & LEAF_LOCK_BIT)
+            && sp->lockWord0(cv)) {
+            if (p->lockVersion(vers[1])) {
+                leaf_sibp= sp;
+                underflow= true;
+            }
+            else sp->unlock();
+        }
+    }
+    goto part1_done;
+
+unlock_leaf:
+    // unlock, then restart
+    if (leaf_sibp) leaf_sibp->unlock();
+    lp->unlock();
+    goto AgainO3;
+
+part1_done: ;
+  } // end of Part 1 (CC_OLC)
+
+  else
   { bnode *p;
     bleaf *lp;
-    int i,t,m,b;
-    key_type r;
+    int i;
+    bool in_tx;
+    int  retries= 0;
     
 Again3:
     // 1. RTM begin
-    if(_xbegin() != _XBEGIN_STARTED) {
-        // random backoff
-        // sum= 0; 
-        // for (int i=(rdtsc() % 1024); i>0; i--) sum += i;
-        goto Again3;
-    }
+    in_tx= txBegin(retries, TX_OP_DEL);
 
     // 2. search nonleaf nodes
     p = tree_meta->tree_root;
@@ -1018,72 +3198,44 @@ Again3:
         NODE_PREF(p);
 
         // if the lock bit is set, abort
-        if (p->lock()) {_xabort(5); goto Again3;}
+        if (p->isLocked()) {TX_ABORT(in_tx, 5); goto Again3;}
 
         parray[i]= p;
 
-        // binary search to narrow down to at most 8 entries
-        b=1; t=p->num();
-        while (b+7<=t) {
-            m=(b+t) >>1;
-            r= key - p->k(m);
-            if (r>0) b=m+1;
-            else if (r<0) t = m-1;
-            else {p=p->ch(m); ppos[i]=m; goto inner_done;}
-        }
-        
-        // sequential search (which is slightly faster now)
-        for (; b<=t; b++)
-            if (key < p->k(b)) break;
-        p = p->ch(b-1); ppos[i]= b-1;
-        
-    inner_done: ;
+        ppos[i]= searchNonleaf(p, p->num(), key);
+        p= p->ch(ppos[i]);
     }
     
     // 3. search leaf node
     lp= (bleaf *)p;
 
     // prefetch the entire node
-    LEAF_PREF (lp);
+    LEAF_PREF_NVM(lp);
 
     // if the lock bit is set, abort
-    if (lp->lock) {_xabort(6); goto Again3;}
+    if (lp->lock) {TX_ABORT(in_tx, 6); goto Again3;}
 
     parray[0]= lp;
 
-    // SIMD comparison
-       // a. set every byte to key_hash in a 16B register 
-    __m128i key_16B = _mm_set1_epi8((char)key_hash);
-
-       // b. load meta into another 16B register
-    __m128i fgpt_16B= _mm_load_si128((const __m128i*)lp);
-
-       // c. compare them
-    __m128i cmp_res = _mm_cmpeq_epi8(key_16B, fgpt_16B);
-
-       // d. generate a mask
-    unsigned int mask= (unsigned int)
-                        _mm_movemask_epi8(cmp_res);  // 1: same; 0: diff
-
-    // remove the lower 2 bits then AND bitmap
-    mask=  (mask >> 2)&((unsigned int)(lp->bitmap));
+    // SIMD comparison of the fingerprints
+    leafBitmap mask= leafMatch(lp, key_hash);
 
     // search every matching candidate
     i= -1;
     while (mask) {
-        int jj = bitScan(mask)-1;  // next candidate
+        int jj = leafBitScan(mask)-1;  // next candidate
 
         if (lp->k(jj) == key) { // found: good
            i= jj;
            break;
         }
 
-        mask &= ~(0x1<<jj);  // remove this bit
+        mask &= ~leafBit(jj);  // remove this bit
     } // end while
 
     if (i < 0) { // not found: do nothing
-       _xend();
-       return;
+       txEnd(in_tx, TX_OP_DEL);
+       return false;
     }
 
     ppos[0]= i;
@@ -1107,7 +3259,10 @@ Again3:
             }
 
             leaf_sibp= (bleaf *)p;
-            if (leaf_sibp->lock) {_xabort(7); goto Again3;}
+            if (leaf_sibp->lock) {
+               if (! in_tx) lp->lock= 0;  // an abort would roll it back
+               TX_ABORT(in_tx, 7); goto Again3;
+            }
 
             // lock leaf_sibp
             leaf_sibp->lock= 1;
@@ -1116,14 +3271,29 @@ Again3:
         // lock affected ancestors
         for (i=1; i<=tree_meta->root_level; i++) {
             p= (bnode *) parray[i];  
-            p->lock()= 1;
+            p->lock()++;
             
             if (p->num() >= 1) break;  // at least 2 children, ok to stop
         }
     }
 
+    // the leaf underflows: lock its left sibling under the same parent and
+    // the parent.  If the sibling is busy, simply delete the key.
+    else if ((lp->num() <= LEAF_MIN_KEY_NUM) && (tree_meta->root_level > 0)
+             && (ppos[1] >= 1)) {
+        p= parray[1];
+        leaf_sibp= p->ch(ppos[1]-1);
+
+        if (! leaf_sibp->lock) {
+            leaf_sibp->lock= 1;
+            p->lock()++;
+            underflow= true;
+        }
+        else leaf_sibp= NULL;
+    }
+
     // 5. RTM commit
-    _xend();
+    txEnd(in_tx, TX_OP_DEL);
 
   } // end of Part 1
 
@@ -1131,21 +3301,125 @@ Again3:
   {
     bleaf *lp= parray[0];
 
+    // the leaf is locked, so the entry has not changed.  The key record
+    // is reused only after this operation is done.
+    if (old) *old= lp->ch(ppos[0]);
+    retireKey(lp->k(ppos[0]));
+
+    /* 0. leaf underflows */
+    if (underflow) {
+        // the remaining entries of the leaf
+        leafBitmap rest= lp->bitmap & ~leafBit(ppos[0]);
+        int m= leafCountBit(rest);
+        int sn= leaf_sibp->num();
+
+        bleafMeta meta= *((bleafMeta *)leaf_sibp);
+        meta.v.lock= 0;  // clear lock in temp meta
+
+        tree_meta->newGeneration();  // lp is replaced in the leaf list
+
+        // 0.1 merge: copy the entries to the free slots of the sibling.
+        //     Then an NVM atomic write switches alt to skip lp and sets the
+        //     bitmap, which also deletes the key.
+        if (sn + m <= LEAF_KEY_NUM) {
+            leafBitmap free_slots= (~meta.v.bitmap) & LEAF_FULL_BITMAP;
+            int lines= 0;
+            while (rest) {
+                int from= leafBitScan(rest)-1;
+                int to= leafBitScan(free_slots)-1;
+                rest &= ~leafBit(from);
+                free_slots &= ~leafBit(to);
+
+                leaf_sibp->ent[to]= lp->ent[from];
+                meta.v.fgpt[to]= lp->fgpt[from];
+                meta.v.bitmap |= leafBit(to);
+                for (int l=LEAF_SLOT_LINE(to); l<=LEAF_SLOT_END_LINE(to); l++)
+                   lines |= (1<<l);
+            }
+            leaf_sibp->next[1-leaf_sibp->alt]= lp->next[lp->alt];
+            meta.v.alt= 1 - leaf_sibp->alt;
+
+            for (int l=1; l<LEAF_LINE_NUM; l++)
+               if (lines & (1<<l)) clwb((char *)leaf_sibp + l*CACHE_LINE_SIZE);
+            clwb(&(leaf_sibp->next[0]));
+            sfence();
+
+            leaf_sibp->setBothWords(&meta);
+            clwb(leaf_sibp); sfence();
+
+            retireLeaf(lp);
+
+            goto part3;  // remove lp from its parent
+        }
+
+        // 0.2 redistribute: a new leaf replaces lp with its remaining
+        //     entries and the largest entries of the sibling.  The NVM
+        //     atomic write to the sibling switches alt to the new leaf and
+        //     removes the moved entries from the bitmap.
+        int sorted_pos[LEAF_KEY_NUM];
+        for (int s=0, j=0; s<LEAF_KEY_NUM; s++)
+            if (meta.v.bitmap & leafBit(s)) sorted_pos[j++]= s;
+        qsortBleaf(leaf_sibp, 0, sn-1, sorted_pos);
+
+        int keep= (sn + m)/2;  // keys left in the sibling
+        bleaf * newp = (bleaf *)nvmpool_alloc_node(LEAF_SIZE);
+
+        int to= 0;
+        for (int i=keep; i<sn; i++, to++) {
+            newp->ent[to]= leaf_sibp->ent[sorted_pos[i]];
+            newp->fgpt[to]= leaf_sibp->fgpt[sorted_pos[i]];
+            meta.v.bitmap &= ~leafBit(sorted_pos[i]);
+        }
+        while (rest) {
+            int from= leafBitScan(rest)-1;
+            rest &= ~leafBit(from);
+            newp->ent[to]= lp->ent[from];
+            newp->fgpt[to]= lp->fgpt[from];
+            to++;
+        }
+        newp->bitmap= (leafBit(to)-1);
+        newp->lock= 0; newp->alt= 0;
+
+        newp->next[0]= lp->next[lp->alt];
+        leaf_sibp->next[1-leaf_sibp->alt]= newp;
+        meta.v.alt= 1 - leaf_sibp->alt;
+
+        LOOP_FLUSH(clwb, newp, LEAF_LINE_NUM);
+        clwb(&(leaf_sibp->next[0]));
+        sfence();
+
+        leaf_sibp->setBothWords(&meta);
+        clwb(leaf_sibp); sfence();
+
+        // newp takes the place of lp in the parent
+        bnode *p= parray[1];
+        key_type old_key= p->k(ppos[1]);
+        p->k(ppos[1])= nonleafKey(leaf_sibp->k(sorted_pos[keep-1]), newp->k(0));
+        p->ch(ppos[1])= newp;
+        p->unlock();
+        retireSeparator(old_key);
+
+        retireLeaf(lp);
+        return true;
+
+    } // end of underflow
+
     /* 1. leaf contains more than one key */
     /*    If this leaf node is the root, we cannot delete the root. */
     if ((lp->num()>1)||(tree_meta->root_level==0)) {
        bleafMeta meta= *((bleafMeta *)lp);
 
        meta.v.lock= 0;  // clear lock in temp meta
-       meta.v.bitmap &= ~(1<<ppos[0]);  // mark the bitmap to delete the entry
+       meta.v.bitmap &= ~leafBit(ppos[0]);  // mark the bitmap to delete the entry
        lp->setWord0(&meta);
        clwb(lp); sfence();
 
-       return;
+       return true;
 
     } // end of more than one key
 
     /* 2. leaf has only one key: remove the leaf node */
+        tree_meta->newGeneration();
     
         /* if it has a left sibling */
         if (leaf_sibp != NULL) {
@@ -1162,11 +3436,15 @@ Again3:
             tree_meta->setFirstLeaf(lp->next[lp->alt]);  // the method calls clwb+sfence
         }
 
-     // free the deleted leaf node
-     nvmpool_free_node(lp);
+     // retire the deleted leaf node
+     // (Concurrent readers may still visit a removed node.  It is not
+     //  reused until they finish, and in CC_OLC mode their validation fails
+     //  because its version has changed.)
+     retireLeaf(lp);
 
   } // end of Part 2
 
+part3:
     /* Part 3: non-leaf node */
     {bnode *p, *sibp, *parp;
      int    n, i, pos, r, lev;
@@ -1184,6 +3462,7 @@ Again3:
                     p->ch(0)= p->ch(1); 
                     pos= 1;  // move the rest
                 }
+                retireSeparator(p->k(pos));
                 for (i=pos; i<n; i++) p->ent[i]= p->ent[i+1];
                 p->num()= n - 1;
                 sfence();  
@@ -1193,23 +3472,24 @@ Again3:
                 if ((p->num()==0) && (lev >= tree_meta->root_level)) // root
                     break;
 
-                p->lock()= 0;
-                return;
+                p->unlock();
+                return true;
             }
 
             /* otherwise only 1 ptr */
-            mempool_free_node(p);
+            mempool_retire_node(p);
 
             lev++;
         } /* end of while */
 
         // p==root has 1 child? so delete the root
         tree_meta->root_level = tree_meta->root_level - 1;
+        olc_barrier();  // root_level must be visible before tree_root
         tree_meta->tree_root = p->ch(0); // running transactions will abort
         sfence();
 
-        mempool_free_node (p);
-        return;
+        mempool_retire_node (p);
+        return true;
     }
 }
 
@@ -1233,9 +3513,9 @@ void lbtree::randomize (Pointer8B pnode, int level)
         int num= 0;
 
         // 1. get all entries
-        unsigned short bmp= lp->bitmap;
+        leafBitmap bmp= lp->bitmap;
         for (int i=0; i<LEAF_KEY_NUM; i++) {
-            if (bmp & (1<<i)) {
+            if (bmp & leafBit(i)) {
                 pos[num++]= i;
             }
         }
@@ -1258,6 +3538,8 @@ void lbtree::randomize (Pointer8B pnode, int level)
  * ----------------------------------------------------------------- */
 void lbtree::print (Pointer8B pnode, int level)
 {
+    char kb[KEY_STR_SIZE];
+
     if (level > 0) {
         bnode *p= pnode;
 
@@ -1265,24 +3547,25 @@ void lbtree::print (Pointer8B pnode, int level)
 
         print (p->ch(0), level-1);
         for (int i=1; i<=p->num(); i++) {
-            printf ("%*c%lld\n", 10+level*4, '+', p->k(i));
+            printf ("%*c%s\n", 10+level*4, '+', keyToStr(p->k(i), kb));
             print (p->ch(i), level-1);
         }
     }
     else {
         bleaf * lp = pnode;
 
-        unsigned short bmp= lp->bitmap;
+        leafBitmap bmp= lp->bitmap;
         for (int i=0; i<LEAF_KEY_NUM; i++) {
-            if (bmp & (1<<i)) {
-                printf ("[%2d] hash=%02x key=%lld\n", i, lp->fgpt[i], lp->k(i));
+            if (bmp & leafBit(i)) {
+                printf ("[%2d] hash=%02x key=%s\n", i, lp->fgpt[i],
+                        keyToStr(lp->k(i), kb));
             }
         }
 
         bleaf * pnext= lp->nextSibling();
         if (pnext != NULL) {
-            int first_pos= bitScan(pnext->bitmap)-1;
-            printf ("->(%lld)\n", pnext->k(first_pos));
+            int first_pos= leafBitScan(pnext->bitmap)-1;
+            printf ("->(%s)\n", keyToStr(pnext->k(first_pos), kb));
         }
         else
             printf ("->(null)\n");
@@ -1298,12 +3581,12 @@ void lbtree::print (Pointer8B pnode, int level)
  */
 void lbtree::getMinMaxKey (bleaf *p, key_type &min_key, key_type &max_key)
 {
-    unsigned short bmp= p->bitmap;
+    leafBitmap bmp= p->bitmap;
     max_key= MIN_KEY;
     min_key= MAX_KEY;
     
     for (int i=0; i<LEAF_KEY_NUM; i++) {
-        if (bmp & (1<<i)) {
+        if (bmp & leafBit(i)) {
             if (p->k(i) > max_key) max_key = p->k(i);
             if (p->k(i) < min_key) min_key = p->k(i);
         }
@@ -1336,6 +3619,8 @@ void lbtree::checkFirstLeaf(void)
  */
 void lbtree::check (Pointer8B pnode, int level, key_type &start, key_type &end, bleaf * &ptr)
 {
+    char kb1[KEY_STR_SIZE], kb2[KEY_STR_SIZE];
+
     if (pnode.isNull()) {
         printf ("level %d: null child pointer\n", level + 1);
         exit (1);
@@ -1357,11 +3642,24 @@ void lbtree::check (Pointer8B pnode, int level, key_type &start, key_type &end,
         getMinMaxKey(lp, start, end);
 
         // check fingerprints
-        unsigned short bmp= lp->bitmap;
+        leafBitmap bmp= lp->bitmap;
         for (int i=0; i<LEAF_KEY_NUM; i++) {
-            if (bmp & (1<<i)) {
+            if (bmp & leafBit(i)) {
                 if (hashcode1B(lp->k(i)) != lp->fgpt[i]) {
-                    printf ("leaf(%lld): hash code for %lld is wrong\n", start, lp->k(i)); 
+                    printf ("leaf(%s): hash code for %s is wrong\n",
+                            keyToStr(start, kb1), keyToStr(lp->k(i), kb2));
+                    exit(1);
+                }
+            }
+        }
+
+        // check duplicate keys
+        for (int i=0; i<LEAF_KEY_NUM; i++) {
+            if (!(bmp & leafBit(i))) continue;
+            for (int j=i+1; j<LEAF_KEY_NUM; j++) {
+                if ((bmp & leafBit(j)) && (lp->k(i) == lp->k(j))) {
+                    printf ("leaf(%s): duplicate key %s\n",
+                            keyToStr(start, kb1), keyToStr(lp->k(i), kb2));
                     exit(1);
                 }
             }
@@ -1369,20 +3667,21 @@ void lbtree::check (Pointer8B pnode, int level, key_type &start, key_type &end,
 
         // check lock bit
         if (lp->lock != 0) {
-            printf ("leaf(%lld): lock bit == 1\n", start); 
+            printf ("leaf(%s): lock bit == 1\n", keyToStr(start, kb1));
             exit(1);
         }
 
         // check sibling pointer
         if ((ptr) && (ptr->nextSibling()!=lp)) {
-            printf ("leaf(%lld): sibling broken from previous node\n", start); 
+            printf ("leaf(%s): sibling broken from previous node\n",
+                    keyToStr(start, kb1));
             fflush(stdout);
 
             /* output more info */
             bleaf *pp= (bleaf *)ptr;
             key_type ss, ee;
             getMinMaxKey(pp, ss, ee);
-            printf("previous(%lld - %lld) -> ", ss, ee);
+            printf("previous(%s - %s) -> ", keyToStr(ss, kb1), keyToStr(ee, kb2));
 
             pp= pp->nextSibling();
             if (pp == NULL) {
@@ -1390,7 +3689,7 @@ void lbtree::check (Pointer8B pnode, int level, key_type &start, key_type &end,
             }
             else {
                 getMinMaxKey(pp, ss, ee);
-                printf("(%lld - %lld)\n", ss, ee);
+                printf("(%s - %s)\n", keyToStr(ss, kb1), keyToStr(ee, kb2));
             }
 
             exit(1);
@@ -1420,7 +3719,8 @@ void lbtree::check (Pointer8B pnode, int level, key_type &start, key_type &end,
         check (p->ch(0), level-1, curstart, curend, curptr);
         start = curstart;
         if (p->num()>=1 && curend >= p->k(1)) {
-            printf ("nonleaf level %d(%lld): key order wrong at child 0\n", level, p->k(1));
+            printf ("nonleaf level %d(%s): key order wrong at child 0\n",
+                    level, keyToStr(p->k(1), kb1));
             exit (1);
         }
         
@@ -1428,8 +3728,8 @@ void lbtree::check (Pointer8B pnode, int level, key_type &start, key_type &end,
         for (i=1; i<p->num(); i++) {
             check (p->ch(i), level-1, curstart, curend, curptr);
             if (!(p->k(i)<=curstart && curend<p->k(i+1)) ) {
-                printf ("nonleaf level %d(%lld): key order wrong at child %d(%lld)\n",
-                        level, p->k(1), i, p->k(i));
+                printf ("nonleaf level %d(%s): key order wrong at child %d(%s)\n",
+                        level, keyToStr(p->k(1), kb1), i, keyToStr(p->k(i), kb2));
                 exit (1);
             }
         }
@@ -1438,16 +3738,17 @@ void lbtree::check (Pointer8B pnode, int level, key_type &start, key_type &end,
         if (i == p->num()) {
            check (p->ch(i), level-1, curstart, curend, curptr);
            if (curstart < p->k(i)) {
-               printf ("nonleaf level %d(%lld): key order wrong at last child %d(%lld)\n", 
-                        level, p->k(1), i, p->k(i));
+               printf ("nonleaf level %d(%s): key order wrong at last child %d(%s)\n", 
+                        level, keyToStr(p->k(1), kb1), i, keyToStr(p->k(i), kb2));
                exit (1);
            }
         }
         end = curend;
 
         // check lock bit
-        if (p->lock() != 0) {
-            printf ("nonleaf level %d(%lld): lock bit is set\n", level, p->k(1)); 
+        if (p->isLocked()) {
+            printf ("nonleaf level %d(%s): lock bit is set\n",
+                    level, keyToStr(p->k(1), kb1));
             exit(1);
         }
         
@@ -1467,10 +3768,19 @@ tree * initTree(void *nvm_addr, bool recover)
 
 int main (int argc, char *argv[])
 {
-    printf("NON_LEAF_KEY_NUM= %d, LEAF_KEY_NUM= %d, nonleaf size= %lu, leaf size= %lu\n",
-           NON_LEAF_KEY_NUM, LEAF_KEY_NUM, sizeof(bnode), sizeof(bleaf));
+    printf("NON_LEAF_KEY_NUM= %d, LEAF_KEY_NUM= %d, nonleaf size= %lu, leaf size= %lu, key size= %lu\n",
+           NON_LEAF_KEY_NUM, LEAF_KEY_NUM, sizeof(bnode), sizeof(bleaf),
+           sizeof(key_type));
     assert((sizeof(bnode) == NONLEAF_SIZE)&&(sizeof(bleaf) == LEAF_SIZE));
 
+    // CC_OLC sets the leaf lock bit in word 0 with compare-and-swap
+    bleafMeta meta;
+    meta.word8B[0]= 0; meta.v.lock= 1;
+    assert(meta.word8B[0] == LEAF_LOCK_BIT);
+
+    // leafMatch expects the fingerprints right after the bitmap word
+    assert((char *)(meta.v.fgpt) - (char *)&meta == LEAF_BITMAP_SIZE);
+
     initUseful();
 
     return parse_command (argc, argv);
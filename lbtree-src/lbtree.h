@@ -24,17 +24,148 @@
 /* ---------------------------------------------------------------------- */
 
 /* In a non-leaf, there are NON_LEAF_KEY_NUM keys and NON_LEAF_KEY_NUM+1
- * child pointers.
+ * child pointers.  The rest of the node (16B for 16B and 32B keys) is
+ * padding.
  */
 #define NON_LEAF_KEY_NUM    (NONLEAF_SIZE/(KEY_SIZE+POINTER_SIZE)-1)
+#define NONLEAF_PAD_SIZE    (NONLEAF_SIZE - (NON_LEAF_KEY_NUM+1)*(KEY_SIZE+POINTER_SIZE))
+
+/* In a leaf, there are a header, LEAF_KEY_NUM entries of LEAF_ENTRY_SIZE
+ * bytes, 2x8B sibling pointers, and padding.  The header consists of the
+ * bitmap, lock, and alt bits in a word of LEAF_BITMAP_SIZE bytes, followed
+ * by 1B fingerprints (and unused bytes if the keys are wider than 8B).
+ * The header is in line 0 so that one clwb persists it, and the bitmap word
+ * is in the first 8B so that it can be changed with an atomic write.
+ *
+ *   leaf size   key size   keys   header   bitmap word   slots in line 0
+ *     256B         8B       14     16B        2B              3
+ *     512B         8B       28     32B        4B              2
+ *     1KB          8B       56     64B        8B              0
+ *     256B        16B        9     16B        2B              2
+ *     512B        16B       19     32B        4B              1
+ *     1KB         16B       39     64B        8B              0
+ *     256B        32B        5     16B        2B              1
+ *     512B        32B       12     16B        2B              1
+ *     1KB         32B       24     32B        4B              0
+ *
+ * Compile with -DLEAF_LINE_NUM=8 or 16 for 512B or 1KB leaves.  With 16B
+ * and 32B keys, an entry may span two cache lines.
+ */
+#define LEAF_ENTRY_SIZE     (KEY_SIZE + POINTER_SIZE)
 
-/* In a leaf, there are 16B header, 14x16B entries, 2x8B sibling pointers.
+#if (LEAF_SIZE == 256) && (KEY_SIZE == 8)
+#define LEAF_KEY_NUM        (14) 
+#define LEAF_BITMAP_SIZE    2
+#define LEAF_HEADER_SIZE    16
+#elif (LEAF_SIZE == 512) && (KEY_SIZE == 8)
+#define LEAF_KEY_NUM        (28)
+#define LEAF_BITMAP_SIZE    4
+#define LEAF_HEADER_SIZE    32
+#elif (LEAF_SIZE == 1024) && (KEY_SIZE == 8)
+#define LEAF_KEY_NUM        (56)
+#define LEAF_BITMAP_SIZE    8
+#define LEAF_HEADER_SIZE    64
+#elif (LEAF_SIZE == 256) && (KEY_SIZE == 16)
+#define LEAF_KEY_NUM        (9)
+#define LEAF_BITMAP_SIZE    2
+#define LEAF_HEADER_SIZE    16
+#elif (LEAF_SIZE == 512) && (KEY_SIZE == 16)
+#define LEAF_KEY_NUM        (19)
+#define LEAF_BITMAP_SIZE    4
+#define LEAF_HEADER_SIZE    32
+#elif (LEAF_SIZE == 1024) && (KEY_SIZE == 16)
+#define LEAF_KEY_NUM        (39)
+#define LEAF_BITMAP_SIZE    8
+#define LEAF_HEADER_SIZE    64
+#elif (LEAF_SIZE == 256) && (KEY_SIZE == 32)
+#define LEAF_KEY_NUM        (5)
+#define LEAF_BITMAP_SIZE    2
+#define LEAF_HEADER_SIZE    16
+#elif (LEAF_SIZE == 512) && (KEY_SIZE == 32)
+#define LEAF_KEY_NUM        (12)
+#define LEAF_BITMAP_SIZE    2
+#define LEAF_HEADER_SIZE    16
+#elif (LEAF_SIZE == 1024) && (KEY_SIZE == 32)
+#define LEAF_KEY_NUM        (24)
+#define LEAF_BITMAP_SIZE    4
+#define LEAF_HEADER_SIZE    32
+#else
+#error "LB+-Tree requires leaf node size to be 256B, 512B, or 1KB."
+#endif
+
+#if LEAF_BITMAP_SIZE == 2
+typedef uint16_t            leafBitmap;
+#elif LEAF_BITMAP_SIZE == 4
+typedef uint32_t            leafBitmap;
+#else
+typedef uint64_t            leafBitmap;
+#endif
+
+// the unused bits of the bitmap word, so that fgpt[] starts after the word
+#define LEAF_BITMAP_PAD_BITS  (8*LEAF_BITMAP_SIZE - LEAF_KEY_NUM - 2)
+
+#define LEAF_FGPT_SIZE      (LEAF_HEADER_SIZE - LEAF_BITMAP_SIZE)
+#define LEAF_HEADER_WORDS   (LEAF_HEADER_SIZE/8)
+#define LEAF_NEXT_OFFSET    (LEAF_HEADER_SIZE + LEAF_ENTRY_SIZE*LEAF_KEY_NUM)
+#define LEAF_PAD_SIZE       (LEAF_SIZE - LEAF_NEXT_OFFSET - 16)
+
+// both sibling pointers are persisted with one clwb
+#if (LEAF_NEXT_OFFSET/CACHE_LINE_SIZE) != ((LEAF_NEXT_OFFSET+15)/CACHE_LINE_SIZE)
+#error "the sibling pointers of a leaf must be in the same cache line"
+#endif
+
+// the bit of a slot in the bitmap, and the bitmap of a full leaf
+#define leafBit(slot)       (((leafBitmap)1) << (slot))
+#define LEAF_FULL_BITMAP    ((leafBitmap)((1ULL << LEAF_KEY_NUM) - 1))
+
+// bitScan() and countBit() for leaf bitmaps
+#define leafBitScan(x)      __builtin_ffsll((unsigned long long)(x))
+#define leafCountBit(x)     __builtin_popcountll((unsigned long long)(x))
+
+// the slots entirely in line 0, and the first and last cache lines of a slot
+#define LEAF_LINE0_SLOTS    ((CACHE_LINE_SIZE - LEAF_HEADER_SIZE)/LEAF_ENTRY_SIZE)
+#define LEAF_SLOT_LINE(slot) \
+        ((LEAF_HEADER_SIZE + LEAF_ENTRY_SIZE*(slot))/CACHE_LINE_SIZE)
+#define LEAF_SLOT_END_LINE(slot) \
+        ((LEAF_HEADER_SIZE + LEAF_ENTRY_SIZE*(slot) + LEAF_ENTRY_SIZE-1)/CACHE_LINE_SIZE)
+
+/* The leaf lock bit in word 0 of the leaf header (after the bitmap). */
+#define LEAF_LOCK_BIT       (1ULL << LEAF_KEY_NUM)
+
+/* CC_OLC: the versions of the leaves are counters in DRAM.  Word 0 of a
+ * leaf cannot serve as the version, because it can return to an earlier
+ * value, e.g. when a key is deleted and another key is inserted into the
+ * same slot.  A leaf uses counter (address/LEAF_SIZE) mod LEAF_VERSION_NUM.
+ * Leaves that share a counter only cause extra restarts.  Every counter
+ * has its own cache line, so that locking a leaf does not invalidate the
+ * line that the readers of neighbouring leaves validate.
  */
-#if LEAF_SIZE != 256
-#error "LB+-Tree requires leaf node size to be 256B."
+#ifndef LEAF_VERSION_NUM
+#define LEAF_VERSION_NUM    (16*1024)
 #endif
 
-#define LEAF_KEY_NUM        (14) 
+typedef struct leafVersion {
+    unsigned long long  ver;
+    char                pad[CACHE_LINE_SIZE - sizeof(unsigned long long)];
+} __attribute__((aligned(CACHE_LINE_SIZE))) leafVersion;
+
+extern leafVersion leaf_versions[LEAF_VERSION_NUM];
+
+/* A deletion that leaves fewer than LEAF_MIN_KEY_NUM keys in a leaf merges
+ * the leaf into its left sibling, or moves keys from the sibling if the
+ * two leaves do not fit in one.
+ */
+#ifndef LEAF_MIN_KEY_NUM
+#define LEAF_MIN_KEY_NUM    (LEAF_KEY_NUM/4)
+#endif
+
+/* lookupBatch() traverses the tree for up to LOOKUP_BATCH_GROUP keys at a
+ * time, prefetching the nodes of all the keys in the group at every level.
+ * Define PREFETCH_RECORD to also prefetch the records that are found.
+ */
+#ifndef LOOKUP_BATCH_GROUP
+#define LOOKUP_BATCH_GROUP  8
+#endif
 
 /* ---------------------------------------------------------------------- */
 /**
@@ -114,6 +245,9 @@ typedef struct bnodeMeta {/* 8B */
 class bnode{
 public:
     IdxEntry   ent[NON_LEAF_KEY_NUM + 1];
+#if NONLEAF_PAD_SIZE > 0
+    char       pad[NONLEAF_PAD_SIZE];
+#endif
 public:
     key_type  & k(int idx)  { return ent[idx].k; }
     Pointer8B & ch(int idx) { return ent[idx].ch; }
@@ -124,15 +258,28 @@ public:
     
     int & num(void)  { return ((bnodeMeta *)&(ent[0].k))->num;}
     int & lock(void) { return ((bnodeMeta *)&(ent[0].k))->lock;}
+
+    // The lock is a version.  It is odd if the node is locked.
+    // Lock and unlock both increment the version.
+    bool isLocked(void) { return (lock() & 1); }
+
+    int getVersion(void) { return *((volatile int *)&(lock())); }
+
+    bool lockVersion(int version)
+    { return __sync_bool_compare_and_swap(&(lock()), version, version+1); }
+
+    void unlock(void)
+    { asm volatile("" ::: "memory"); lock()++; }
 }; // bnode
 
 typedef union bleafMeta {
-    unsigned long long  word8B[2];
+    unsigned long long  word8B[LEAF_HEADER_WORDS];
     struct {
-       uint16_t         bitmap:14;
-       uint16_t         lock  :1;
-       uint16_t         alt   :1;
-       unsigned char    fgpt[LEAF_KEY_NUM]; /* fingerprints */
+       leafBitmap       bitmap:LEAF_KEY_NUM;
+       leafBitmap       lock  :1;
+       leafBitmap       alt   :1;
+       leafBitmap             :LEAF_BITMAP_PAD_BITS;
+       unsigned char    fgpt[LEAF_FGPT_SIZE]; /* fingerprints */
     } v;
 } bleafMeta;
 
@@ -143,25 +290,31 @@ typedef union bleafMeta {
  */
 class bleaf {
 public:
-    uint16_t            bitmap:14;
-    uint16_t            lock  :1;
-    uint16_t            alt   :1;
-    unsigned char       fgpt[LEAF_KEY_NUM]; /* fingerprints */
+    leafBitmap          bitmap:LEAF_KEY_NUM;
+    leafBitmap          lock  :1;
+    leafBitmap          alt   :1;
+    leafBitmap                :LEAF_BITMAP_PAD_BITS;
+    unsigned char       fgpt[LEAF_FGPT_SIZE]; /* fingerprints */
     IdxEntry            ent[LEAF_KEY_NUM];
     bleaf *             next[2];
+#if LEAF_PAD_SIZE > 0
+    char                pad[LEAF_PAD_SIZE];
+#endif
 
 public:
     key_type  & k(int idx)  { return ent[idx].k; }
     Pointer8B & ch(int idx) { return ent[idx].ch; }
 
-    int num() {return countBit(bitmap);}
+    int num() {return leafCountBit(bitmap);}
     bleaf * nextSibling() {return next[alt];}
 
-    bool isFull(void) { return (bitmap == 0x3fff); }
+    bool isFull(void) { return (bitmap == LEAF_FULL_BITMAP); }
 
+    // write the header: word 0 (bitmap, lock, alt) is written last
     void setBothWords(bleafMeta *m) {
        bleafMeta * my_meta= (bleafMeta *)this;
-       my_meta->word8B[1]= m->word8B[1];
+       for (int w=LEAF_HEADER_WORDS-1; w>0; w--)
+          my_meta->word8B[w]= m->word8B[w];
        my_meta->word8B[0]= m->word8B[0];
     }
 
@@ -170,24 +323,183 @@ public:
        my_meta->word8B[0]= m->word8B[0];
     }
 
+    unsigned long long getWord0(void) {
+       return ((volatile bleafMeta *)this)->word8B[0];
+    }
+
+    // CC_OLC: the version counter of the leaf.  A thread that locks the
+    // leaf increments it before changing the leaf.
+    unsigned long long & version(void) {
+       return leaf_versions[((unsigned long long)this / LEAF_SIZE)
+                            % LEAF_VERSION_NUM].ver;
+    }
+
+    unsigned long long getVersion(void) {
+       return *((volatile unsigned long long *)&(version()));
+    }
+
+    // CC_OLC: set the lock bit if word 0 is still equal to word0
+    bool lockWord0(unsigned long long word0) {
+       bleafMeta * my_meta= (bleafMeta *)this;
+       if (! __sync_bool_compare_and_swap(&(my_meta->word8B[0]),
+                                          word0, word0|LEAF_LOCK_BIT))
+          return false;
+       __sync_fetch_and_add(&(version()), 1);
+       return true;
+    }
+
+    // CC_OLC: lock the leaf if its version is still equal to ver
+    bool lockVersion(unsigned long long ver) {
+       bleafMeta * my_meta= (bleafMeta *)this;
+       unsigned long long word0= getWord0();
+       if ((word0 & LEAF_LOCK_BIT)
+           || !__sync_bool_compare_and_swap(&(my_meta->word8B[0]),
+                                            word0, word0|LEAF_LOCK_BIT))
+          return false;
+       if (__sync_bool_compare_and_swap(&(version()), ver, ver+1))
+          return true;
+       my_meta->word8B[0]= word0;
+       return false;
+    }
+
+    // CC_OLC: clear the lock bit of a leaf locked by this thread
+    void unlock(void) {
+       bleafMeta * my_meta= (bleafMeta *)this;
+       my_meta->word8B[0]= getWord0() & ~LEAF_LOCK_BIT;
+    }
+
 }; // bleaf
 
 /* ---------------------------------------------------------------------- */
+/*                      RTM transaction statistics                        */
+/* ---------------------------------------------------------------------- */
+
+// operations
+#define TX_OP_LOOKUP      0
+#define TX_OP_INSERT      1
+#define TX_OP_DEL         2
+#define TX_OP_SCAN        3
+#define TX_OP_UPDATE      4
+#define TX_OP_NUM         5
+
+// outcomes of Part 1 of an operation
+#define TX_COMMIT         0   /* RTM transaction committed */
+#define TX_CONFLICT       1   /* abort: data conflict */
+#define TX_CAPACITY       2   /* abort: read/write set overflow */
+#define TX_RETRY          3   /* abort: other, may succeed if retried */
+#define TX_OTHER          4   /* abort: other */
+#define TX_FALLBACK       5   /* Part 1 ran under the fallback lock */
+#define TX_LOCK_NONLEAF   6   /* a non-leaf lock bit was set: code 1,3,5,8,10 */
+#define TX_LOCK_LEAF      7   /* a leaf lock bit was set: code 2,4,6,9,11 */
+#define TX_LOCK_SIBLING   8   /* a sibling leaf lock bit was set: code 7 */
+#define TX_LOCK_FALLBACK  9   /* the fallback lock was taken */
+#define TX_STAT_NUM       10
+
+/**
+ * txStats: counters of a worker thread (padded to avoid false sharing)
+ *
+ * TX_LOCK_* count both explicit aborts in RTM transactions and restarts
+ * on the fallback path.  Define NO_TX_STAT to disable the counters.
+ */
+typedef struct alignas(CACHE_LINE_SIZE) txStats {
+    long long count[TX_OP_NUM][TX_STAT_NUM];
+} txStats;
+
+/* ---------------------------------------------------------------------- */
+
+/**
+ * ckptHeader: the header of a checkpoint of the non-leaf nodes on NVM
+ *
+ * The header takes a cache line.  It is followed by num_nodes bnodes in
+ * breadth-first order, starting from the root.  In a node above level 1,
+ * a child pointer is the index of the child in the image.  Nodes at level
+ * 1 are image[first_level1 .. num_nodes-1], which point to the leaf nodes.
+ *
+ * The checkpoint is valid if gen is equal to the generation in
+ * nvmTreeMeta, i.e. no leaf node has been added to or removed from the
+ * leaf list since the checkpoint was taken.
+ *
+ * When the tree outgrows the region, the next checkpoint is written to a
+ * new region, which records the old one in prev until its lines are free.
+ */
+#define CKPT_MAGIC   0x4c4254434b505431ULL
+
+typedef struct ckptHeader {
+    unsigned long long magic;
+    unsigned long long gen;        /* generation of the leaf list */
+    long long          size;       /* size of the NVM region */
+    int                root_level;
+    int                num_nodes;  /* number of non-leaf nodes */
+    int                first_level1;
+    struct ckptHeader *prev;       /* the old region to free */
+} ckptHeader;
+
+#define ckptImage(ck)   ((bnode *)((char *)(ck) + CACHE_LINE_SIZE))
+
+/**
+ * nvmTreeMeta: the persistent tree meta data at the beginning of the
+ * 4KB root page on NVM
+ */
+typedef struct nvmTreeMeta {
+    bleaf *              first_leaf;
+    unsigned long long   gen;   /* incremented when the leaf list changes */
+    ckptHeader *         ckpt;  /* the latest checkpoint */
+    unsigned long long   clean; /* 1 if the tree has been shut down cleanly */
+    long long            leaf_size; /* LEAF_SIZE of the program that created it */
+    long long            key_type_id; /* KEY_TYPE_ID of the program */
+} nvmTreeMeta;
+
+// KEY_SIZE, bit 8 for unsigned 8B keys, and bit 9 for string keys
+#ifdef KEY_UNSIGNED
+#define KEY_TYPE_ID     (KEY_SIZE | 0x100)
+#elif defined(KEY_STRING)
+#define KEY_TYPE_ID     (KEY_SIZE | 0x200)
+#else
+#define KEY_TYPE_ID     (KEY_SIZE)
+#endif
+
+// states of the latest checkpoint in DRAM
+#define CKPT_VALID      0   /* gen is the same as the checkpoint */
+#define CKPT_NEWGEN     1   /* a thread is incrementing gen */
+#define CKPT_STALE      2   /* gen has been incremented after the checkpoint */
 
 class treeMeta {
  public:
     int        root_level; // leaf: level 0, parent of leaf: level 1
     Pointer8B  tree_root;
     bleaf **   first_leaf; // on NVM
+    nvmTreeMeta *    nvm_meta;    // on NVM
+    std::atomic<int> ckpt_state;
+    std::atomic<int> ckpt_writer; // 1 while a thread writes a checkpoint
 
  public:
     treeMeta(void *nvm_address, bool recover=false)
     { 
          root_level = 0; 
          tree_root=NULL; 
-         first_leaf= (bleaf **) nvm_address;
-
-         if (! recover) setFirstLeaf(NULL);
+         nvm_meta= (nvmTreeMeta *) nvm_address;
+         first_leaf= &(nvm_meta->first_leaf);
+         ckpt_state= CKPT_STALE;
+         ckpt_writer= 0;
+
+         if (! recover) {
+            nvm_meta->gen= 0;
+            nvm_meta->ckpt= NULL;
+            nvm_meta->clean= 0;
+            nvm_meta->leaf_size= LEAF_SIZE;
+            nvm_meta->key_type_id= KEY_TYPE_ID;
+            setFirstLeaf(NULL);
+         }
+         else if (nvm_meta->leaf_size != LEAF_SIZE) {
+            fprintf(stderr, "leaf size of the NVM file is %lldB, not %dB\n",
+                    nvm_meta->leaf_size, LEAF_SIZE);
+            exit(1);
+         }
+         else if (nvm_meta->key_type_id != KEY_TYPE_ID) {
+            fprintf(stderr, "key type of the NVM file is %llx, not %x\n",
+                    nvm_meta->key_type_id, KEY_TYPE_ID);
+            exit(1);
+         }
     }
 
     void setFirstLeaf(bleaf * leaf)
@@ -195,12 +507,45 @@ class treeMeta {
          *first_leaf= leaf;
          clwb(first_leaf); sfence();
     }
+
+    void setClean(unsigned long long clean)
+    {
+         nvm_meta->clean= clean;
+         clwb(&(nvm_meta->clean)); sfence();
+    }
+
+    /**
+     * Call this method before adding a leaf node to or removing a leaf node
+     * from the leaf list.  The first call after a checkpoint increments the
+     * persistent generation so that the checkpoint becomes invalid.
+     * Others wait until the new generation is persistent.
+     */
+    void newGeneration(void)
+    {
+         if (ckpt_state.load() == CKPT_STALE) return;
+
+         int state= CKPT_VALID;
+         if (ckpt_state.compare_exchange_strong(state, CKPT_NEWGEN)) {
+            nvm_meta->gen ++;
+            clwb(&(nvm_meta->gen)); sfence();
+            ckpt_state.store(CKPT_STALE);
+         }
+         else {
+            while (ckpt_state.load() != CKPT_STALE) _mm_pause();
+         }
+    }
  
 }; // treeMeta
 
 
 /* ---------------------------------------------------------------------- */
 
+// operations of lbtree::writeValue
+#define VALUE_SET         0   /* update */
+#define VALUE_CAS         1   /* compare-and-swap */
+#define VALUE_ADD         2   /* fetch-and-add */
+#define VALUE_GET         3   /* read only */
+
 class lbtree: public tree {
   public:  // root and level
     
@@ -208,8 +553,14 @@ class lbtree: public tree {
     
   public:
     lbtree(void *nvm_address, bool recover=false)
-    {tree_meta= new treeMeta(nvm_address, recover);
+    {the_thread_nvmpools.set_node_size(LEAF_SIZE);
+     tree_meta= new treeMeta(nvm_address, recover);
      if (!tree_meta) {perror("new"); exit(1);}
+     if (recover) {
+        recoverTree(); releasePendingLeaves(); recoverValues();
+        tree_meta->setClean(0);
+     }
+     initTxStats();
     }
 
     ~lbtree()
@@ -230,6 +581,46 @@ class lbtree: public tree {
          int target_level, Pointer8B ptrs[], key_type keys[], int &num_nodes,
          bool free_above_level_nodes);
 
+    // rebuild the non-leaf nodes from the leaf nodes in NVM
+    void recoverTree(void);
+
+    // free the leaf nodes that were allocated but not published at a crash
+    void releasePendingLeaves(void);
+
+    // rebuild the bitmaps of the value records after a crash
+    void recoverValues(void);
+
+    // allocate RTM statistics for the worker threads
+    void initTxStats(void);
+
+    // CC_OLC: search the tree without locking
+    int olcSearch(key_type key, Pointer8B parray[], short ppos[],
+                  unsigned long long vers[]);
+
+    // look up a group of at most LOOKUP_BATCH_GROUP keys
+    void txLookupGroup(const key_type keys[], int num,
+                       void *leaves[], int pos[]);
+    void olcLookupGroup(const key_type keys[], int num,
+                        void *leaves[], int pos[]);
+
+    // load the non-leaf nodes from a valid checkpoint
+    bool loadCheckpoint(void);
+
+    int countNonleaf(Pointer8B pnode, int level);
+
+    // insert sorted keys into the leaf of keys[0], return the number done
+    int insertLeafBatch(key_type keys[], void *ptrs[], int n);
+
+    // read and write the value slot of key in place
+    int writeValue(key_type key, int op, void *a, void *b, void **old);
+
+    // delete key, return its record pointer in *old
+    bool delKey(key_type key, void **old);
+
+    // Part 3 of insert: insert (key, ptr) into parray[1 ..]
+    void insertNonleaf(key_type key, void *ptr,
+                       Pointer8B parray[], short ppos[]);
+
     // sort pos[start] ... pos[end] (inclusively)
     void qsortBleaf(bleaf *p, int start, int end, int pos[]);
 
@@ -247,18 +638,78 @@ class lbtree: public tree {
 
     // given a search key, perform the search operation
     // return the leaf node pointer and the position within leaf node
+    // (the leaf may be removed and reused by concurrent deletions, unless
+    //  the caller holds an epochGuard while it uses the leaf)
     void * lookup (key_type key, int *pos);
     
+    // look up n keys, interleaving the traversals of a group of keys
+    // return the number of keys found
+    int lookupBatch (const key_type keys[], int n, void *leaves[], int pos[]);
+
     void * get_recptr (void *p, int pos)
     {
         return ((bleaf *)p)->ch(pos);
     }
 
-    // insert (key, ptr)
-    void insert (key_type key, void *ptr);
+    // range scan: find the start leaf as in lookup, then follow the
+    // sibling pointers and return the valid entries of every leaf in order
+    int scan (key_type start_key, key_type end_key, int max_keys,
+              key_type keys[], void *ptrs[]);
+
+    int scan (key_type start_key, int max_keys, key_type keys[], void *ptrs[])
+    {
+        return scan (start_key, MAX_KEY, max_keys, keys, ptrs);
+    }
+
+    // RTM statistics summed over all worker threads
+    void getTxStats(txStats *total);
+    void clearTxStats(void);
+    void print_stats(void);
+
+    // write the non-leaf nodes to a checkpoint on NVM
+    // A worker thread may call it between its operations while the others
+    // run (see lbtree.cc).
+    void checkpoint (bool shutdown);
+
+    // insert (key, ptr), return false if the key exists
+    bool insert (key_type key, void *ptr);
+
+    // insert (key, value record in the NVM value heap), and copy a value
+    bool put (key_type key, const void *val, int len);
+    int get (key_type key, void *buf, int size);
+
+    // replace or delete a key inserted by put, and retire its old record
+    bool replace (key_type key, const void *val, int len);
+    bool remove (key_type key);
     
+    // insert a batch of (key, ptr): sort the batch, then insert the keys
+    // of a leaf in one pass
+    void insertBatch (const key_type keys[], void *ptrs[], int n);
+
+    // overwrite the record pointer of an existing key in place
+    bool update (key_type key, void *ptr)
+    {
+        return (writeValue(key, VALUE_SET, ptr, NULL, NULL) > 0);
+    }
+
+    // set the value slot to desired if it is expected
+    bool cas (key_type key, void *expected, void *desired)
+    {
+        return (writeValue(key, VALUE_CAS, expected, desired, NULL) > 0);
+    }
+
+    // add delta to the value slot, return the old value in *old
+    bool fetch_add (key_type key, long long delta, long long *old)
+    {
+        return (writeValue(key, VALUE_ADD, (void *)delta, NULL,
+                           (void **)old) > 0);
+    }
+
+    // update the key if it exists, otherwise insert it
+    bool upsert (key_type key, void *ptr);
+
     // delete key
-    void del (key_type key);
+    void del (key_type key) {delKey(key, NULL);}
     
 private:
     void print (Pointer8B pnode, int level);